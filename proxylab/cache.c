@@ -1,50 +1,669 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "cache.h"
 
-cache cache_new ()
+static struct cache_shard *cache_shard (cache C, uint64_t hash);
+static web_data cache_find (cache C, struct cache_shard *S, uint64_t hash,
+    char *website, char *file, int port);
+static void cache_touch (cache C, struct cache_shard *S, web_data w);
+static int cache_admit (struct cache_shard *S, uint64_t hash);
+static void cache_add (cache C, struct cache_shard *S, web_data w);
+static void cache_link (cache C, struct cache_shard *S, web_data w,
+    int uses);
+static void *cache_chunk (cache C, int size);
+static web_data cache_place (cache C, web_data w);
+static void cache_evict (cache C, web_data w);
+static void cache_remove (cache C, struct cache_shard *S, web_data w);
+static void cache_unlink (cache C, struct cache_shard *S, web_data w);
+static int cache_entry_size (cache C, web_data w);
+static void cache_demote (cache C, web_data w);
+static int cache_head_size (web_data w);
+static int cache_compressible (web_data w);
+static int cache_header_is (const char *head, const char *end,
+    const char *name, const char *value);
+
+/*
+ * cache_new - create a cache of MAX_CACHE_SIZE bytes split into nshards
+ * shards, or as many as leave each CACHE_SHARD_MIN bytes if that is
+ * fewer (see CACHE_SHARDS), each evicting as policy decides. If admitWindow is not 0, an
+ * object is only cached the second time it is inserted within about
+ * admitWindow inserts into its shard. If slabbed is set, entries are
+ * kept in a slab allocator reserved up front (see slab.h) rather than
+ * on the heap. If compress is set, the data of each entry is compressed
+ * when that pays off and decompressed by whoever reads it (see
+ * web_data_unpack). All locking is done here, so the cache can be shared
+ * freely between threads.
+ */
+cache cache_new (int nshards, const policy_ops_t *policy, int admitWindow,
+    int slabbed, int compress)
 {
     cache C = malloc(sizeof(struct cache_header));
-	  C->items = vector_new ();
-	  C->size = 0;
-	  return C;
+    int i;
+
+    while (nshards > 1 && MAX_CACHE_SIZE / nshards < CACHE_SHARD_MIN)
+        nshards--;
+    if (nshards < 1)
+        nshards = 1;
+
+    C->nshards = nshards;
+    C->capacity = MAX_CACHE_SIZE / nshards;
+    C->policy = policy;
+    C->slabs = slabbed ? slabs_new (MAX_CACHE_SIZE) : NULL;
+    C->compress = compress;
+    C->plainBytes = C->storedBytes = 0;
+    C->disk = NULL;
+    C->snapshot = NULL;
+    C->snapshotBytes = 0;
+    C->shards = calloc(nshards, sizeof(struct cache_shard));
+
+    for (i = 0; i < nshards; i++)
+    {
+        C->shards[i].items = vector_new ();
+        C->shards[i].size = 0;
+        C->shards[i].tick = 0;
+        C->shards[i].policy = policy->new (C->capacity);
+        C->shards[i].keeper = admitWindow > 0
+            ? doorkeeper_new (admitWindow) : NULL;
+        pthread_mutex_init (&C->shards[i].lock, NULL);
+    }
+
+    return C;
 }
-void cache_free (cache C) 
+
+void cache_free (cache C)
 {
-    vector_free (C->items);
+    int i;
+
+    for (i = 0; i < C->nshards; i++)
+    {
+        C->policy->free (C->shards[i].policy);
+        if (C->shards[i].keeper)
+            doorkeeper_free (C->shards[i].keeper);
+        vector_free (C->shards[i].items);
+        pthread_mutex_destroy (&C->shards[i].lock);
+    }
+
+    if (C->slabs)
+        slabs_destroy (C->slabs);
+    if (C->disk)
+        disk_close (C->disk);
+    if (C->snapshot)
+        munmap (C->snapshot, C->snapshotBytes);
+    free (C->shards);
     free (C);
 }
 
-const char *cache_get (cache C, char *website, char *file, int port, 
+/*
+ * cache_open_disk - give C a second tier, a file of bytes at path (see
+ * disk.h). Entries evicted from memory are copied there, and can still
+ * be found with cache_lookup_disk. Returns -1 if the file can't be set
+ * up.
+ */
+int cache_open_disk (cache C, const char *path, long bytes)
+{
+    if ((C->disk = disk_open (path, bytes)) == NULL)
+        return -1;
+    return 0;
+}
+
+/*
+ * cache_ratio - how many times over compression shrinks the data now
+ * cached, 1 if there is none
+ */
+double cache_ratio (cache C)
+{
+    long plain = __atomic_load_n (&C->plainBytes, __ATOMIC_RELAXED);
+    long stored = __atomic_load_n (&C->storedBytes, __ATOMIC_RELAXED);
+
+    return stored > 0 ? (double)plain / stored : 1;
+}
+
+/*
+ * cache_get - return the data cached for website, file, port, or NULL.
+ * The data is as stored, so compressed if the entry's plain_size is set.
+ * Nothing keeps the data from being evicted once this returns, so it is
+ * only safe when no other thread can insert; see cache_lookup.
+ */
+const char *cache_get (cache C, char *website, char *file, int port,
     int *data_size)
 {
-	  vector V = C->items;
-	  web_data w = vector_get (V, website, file, port);
-	  
-    if (w != NULL) 
+    uint64_t hash = web_data_hash (website, file, port);
+    struct cache_shard *S = cache_shard (C, hash);
+
+    pthread_mutex_lock (&S->lock);
+    web_data w = cache_find (C, S, hash, website, file, port);
+    pthread_mutex_unlock (&S->lock);
+
+    if (w != NULL)
     {
         *data_size = w->data_size;
-		    return w->data;
-	  }
-    
-    else 
+        return w->data;
+    }
+
+    else
     {
         *data_size = 0;
-		    return NULL;
+        return NULL;
+    }
+}
+
+/*
+ * cache_lookup - like cache_get, but returns the entry itself pinned
+ * with a reference, so that it stays valid after the caller lets go of
+ * the cache's lock even if it is evicted. The caller must drop it with
+ * web_data_release. cache_get's pointer is only safe while nothing else
+ * can touch the cache.
+ */
+web_data cache_lookup (cache C, char *website, char *file, int port)
+{
+    uint64_t hash = web_data_hash (website, file, port);
+    struct cache_shard *S = cache_shard (C, hash);
+
+    pthread_mutex_lock (&S->lock);
+
+    web_data w = cache_find (C, S, hash, website, file, port);
+
+    if (w != NULL)
+        web_data_retain (w);
+
+    pthread_mutex_unlock (&S->lock);
+    return w;
+}
+
+/*
+ * cache_recheck - like cache_lookup, for a key the caller has just
+ * missed: its policy heard of that lookup already, so is only told of
+ * a hit
+ */
+web_data cache_recheck (cache C, char *website, char *file, int port)
+{
+    uint64_t hash = web_data_hash (website, file, port);
+    struct cache_shard *S = cache_shard (C, hash);
+
+    pthread_mutex_lock (&S->lock);
+
+    web_data w = vector_get (S->items, hash, website, file, port);
+
+    if (w != NULL)
+    {
+        cache_touch (C, S, w);
+        web_data_retain (w);
     }
+
+    pthread_mutex_unlock (&S->lock);
+    return w;
 }
 
-void cache_insert (cache C, char *website, char *file, int port, 
+/*
+ * cache_insert - add a copy of data to the shard website, file, port
+ * belongs to, evicting the entries the shard's policy picks to make
+ * room. Objects bigger than a whole shard are not cached, nor are ones
+ * the shard's doorkeeper has not been offered before.
+ */
+void cache_insert (cache C, char *website, char *file, int port,
     char *data, int dataSize)
 {
-	  vector V = C->items;
-	  // Get the web_data pointer which we will insert into the memory
-	  web_data w = web_data_new (website, file, port, data, dataSize);
-	  // while the size of the cache is bigger than 1 Mb
-	  
-    while (C->size + dataSize > MAX_CACHE_SIZE) 
-    {
-		    C->size -= vector_evict_LRU (V);
-	  }
-	  
-    vector_push_back (V, w);
-    C->size += dataSize;
+    if (dataSize > C->capacity)
+        return;
+
+    uint64_t hash = web_data_hash (website, file, port);
+    struct cache_shard *S = cache_shard (C, hash);
+
+    // One-hit wonders are turned away before anything is copied
+    if (!cache_admit (S, hash))
+        return;
+
+    cache_add (C, S, web_data_new (website, file, port, data, dataSize));
+}
+
+/*
+ * cache_reserve - an empty entry for website, file, port with room for
+ * capacity bytes of data, for the caller to fill and cache_store. With
+ * slabs it is laid out in the chunk it will be cached in, so that
+ * storing it copies nothing; if evict is not set only a free chunk
+ * will do, so that a fetch yet to finish never pushes out what is
+ * cached. NULL if it would not be cached now: it is too big, no chunk
+ * can be had, or the doorkeeper would turn it away, which is not told
+ * of the key. cache_insert the data to have it counted.
+ */
+web_data cache_reserve (cache C, char *website, char *file, int port,
+    int capacity, int evict)
+{
+    int size = web_data_block_size (website, file, capacity);
+    uint64_t hash = web_data_hash (website, file, port);
+    struct cache_shard *S = cache_shard (C, hash);
+    void *chunk;
+    int seen = 1;
+
+    if (size > C->capacity)
+        return NULL;
+
+    if (S->keeper)
+    {
+        pthread_mutex_lock (&S->lock);
+        seen = doorkeeper_seen (S->keeper, hash);
+        pthread_mutex_unlock (&S->lock);
+    }
+
+    if (!seen)
+        return NULL;
+    if (C->slabs == NULL)
+        return web_data_alloc (website, file, port, capacity);
+    if ((chunk = evict ? cache_chunk (C, size)
+        : slabs_alloc (C->slabs, size)) == NULL)
+        return NULL;
+
+    web_data w = web_data_init (chunk, website, file, port);
+    w->slabs = C->slabs;
+    return w;
+}
+
+/*
+ * cache_store - like cache_insert, but for an entry the caller filled
+ * itself (see web_data_alloc and cache_reserve), which is cached without
+ * copying unless it has to move into a slab. Takes over the caller's
+ * reference to w: either the cache keeps it, trimmed to its contents,
+ * or it is freed.
+ */
+void cache_store (cache C, web_data w)
+{
+    struct cache_shard *S = cache_shard (C, w->hash);
+
+    if (!cache_admit (S, w->hash))
+    {
+        web_data_release (w);
+        return;
+    }
+
+    cache_add (C, S, w);
+}
+
+/*
+ * cache_lookup_disk - the record of website, file, port in C's disk
+ * tier, pinned until disk_release, or NULL if it has none. Only worth
+ * asking once cache_lookup has missed.
+ */
+disk_rec cache_lookup_disk (cache C, char *website, char *file, int port)
+{
+    return C->disk ? disk_lookup (C->disk, website, file, port) : NULL;
+}
+
+/*
+ * cache_restore - add w, an entry read back from a snapshot, to its
+ * shard as it was when saved, hit uses times since it was cached. Goes
+ * around the doorkeeper and compression, which w already went through.
+ * An entry in C->snapshot is used in place, even with slabs: it counts
+ * against its shard at its own size and, being in no slab, is only
+ * evicted by its shard's policy. Takes over the caller's reference to w.
+ */
+void cache_restore (cache C, web_data w, int uses)
+{
+    struct cache_shard *S = cache_shard (C, w->hash);
+
+    if (web_data_size (w) > C->capacity)
+    {
+        web_data_release (w);
+        return;
+    }
+
+    if (C->slabs && !w->mapped && (w = cache_place (C, w)) == NULL)
+        return;
+
+    cache_link (C, S, w, uses);
+}
+
+/*
+ * cache_collect - every entry of the shard-th shard, retained, with how
+ * much it has been used, into a new array at *items for the caller to
+ * free. Returns how many there are.
+ */
+int cache_collect (cache C, int shard, struct cache_item **items)
+{
+    struct cache_shard *S = &C->shards[shard];
+    web_data *entries;
+    int i, n;
+
+    pthread_mutex_lock (&S->lock);
+
+    entries = malloc((S->items->size + 1) * sizeof(web_data));
+    *items = malloc((S->items->size + 1) * sizeof(struct cache_item));
+    n = vector_entries (S->items, entries);
+
+    for (i = 0; i < n; i++)
+    {
+        web_data_retain (entries[i]);
+        (*items)[i].w = entries[i];
+        (*items)[i].used = entries[i]->used;
+        (*items)[i].uses = entries[i]->uses;
+    }
+
+    pthread_mutex_unlock (&S->lock);
+    free (entries);
+    return n;
+}
+
+/*
+ * cache_admit - whether the doorkeeper of S, if any, lets the key that
+ * hashes to hash in
+ */
+static int cache_admit (struct cache_shard *S, uint64_t hash)
+{
+    int admit = 1;
+
+    if (S->keeper)
+    {
+        pthread_mutex_lock (&S->lock);
+        admit = doorkeeper_admit (S->keeper, hash);
+        pthread_mutex_unlock (&S->lock);
+    }
+    return admit;
+}
+
+/*
+ * cache_add - add w, fresh from the heap or cache_reserve, to shard S,
+ * noting where its head ends and when it was cached, compressing it
+ * first if C does and it is worth it, and evicting to make room for all
+ * the bytes it takes up, key and header included. Entries bigger than a
+ * whole shard, or that no slab can be found for, are freed instead.
+ */
+static void cache_add (cache C, struct cache_shard *S, web_data w)
+{
+    w->head_size = cache_head_size (w);
+    w->stored = time (NULL);
+
+    // Compressed before any lock is taken, and before its size counts
+    if (C->compress && cache_compressible (w))
+        w = web_data_compress (w);
+
+    if (web_data_size (w) > C->capacity)
+    {
+        web_data_release (w);
+        return;
+    }
+
+    if (w->slabs == NULL)
+        w = C->slabs ? cache_place (C, w) : web_data_trim (w);
+    if (w == NULL)
+        return;
+
+    cache_link (C, S, w, 0);
+}
+
+/*
+ * cache_link - make w, which fits in a shard, one of S's entries in
+ * place of any it already has for the same key, evicting to make room,
+ * and replay to S's policy up to CACHE_REPLAY_MAX of the uses hits w
+ * has had already
+ */
+static void cache_link (cache C, struct cache_shard *S, web_data w,
+    int uses)
+{
+    int size = cache_entry_size (C, w);
+    web_data old;
+    int i;
+
+    pthread_mutex_lock (&S->lock);
+
+    // Two fetches of one key can both finish; the later copy wins
+    old = vector_get (S->items, w->hash, w->website, w->file, w->port);
+    if (old != NULL)
+    {
+        C->policy->remove (S->policy, old);
+        cache_unlink (C, S, old);
+    }
+
+    // while the shard would go over its share of the cache
+    while (S->size + size > C->capacity)
+    {
+        cache_remove (C, S, C->policy->evict (S->policy));
+    }
+
+    vector_push_back (S->items, w);
+    C->policy->insert (S->policy, w);
+    for (i = 0; i < uses && i < CACHE_REPLAY_MAX; i++)
+    {
+        C->policy->access (S->policy, w->hash);
+        C->policy->hit (S->policy, w);
+    }
+    w->used = ++S->tick;
+    w->uses = uses;
+    if (w->slabs)
+        slabs_link (w->slabs, w);
+    S->size += size;
+    __atomic_add_fetch (&C->plainBytes, web_data_plain_size (w),
+        __ATOMIC_RELAXED);
+    __atomic_add_fetch (&C->storedBytes, w->data_size, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock (&S->lock);
+}
+
+/*
+ * cache_chunk - a slab chunk for size bytes, evicting what the slabs
+ * pick (from any shard) until one is free, or NULL if none can be had.
+ * Caller must hold no shard lock.
+ */
+static void *cache_chunk (cache C, int size)
+{
+    void *chunk;
+    int tries;
+
+    // Emptying a whole page for another class may take this many
+    for (tries = 0; (chunk = slabs_alloc (C->slabs, size)) == NULL; tries++)
+    {
+        web_data victim = NULL;
+
+        if (tries > SLAB_PAGE_CHUNKS
+            || (victim = slabs_victim (C->slabs, size)) == NULL)
+            return NULL;
+        cache_evict (C, victim);
+    }
+    return chunk;
+}
+
+/*
+ * cache_place - move w from the heap into a slab chunk (see cache_chunk).
+ * Returns the moved entry, or NULL if w had to be dropped. Caller must
+ * hold no shard lock.
+ */
+static web_data cache_place (cache C, web_data w)
+{
+    void *chunk = cache_chunk (C, web_data_size (w));
+
+    if (chunk == NULL)
+    {
+        web_data_release (w);
+        return NULL;
+    }
+
+    web_data t = web_data_place (w, chunk);
+    t->slabs = C->slabs;
+    t->mapped = 0;
+    web_data_release (w);
+    return t;
+}
+
+/*
+ * cache_evict - evict w, which slabs_victim retained, from its shard if
+ * it is still cached, and drop the reference
+ */
+static void cache_evict (cache C, web_data w)
+{
+    struct cache_shard *S = cache_shard (C, w->hash);
+
+    pthread_mutex_lock (&S->lock);
+    if (w->slabLinked)
+    {
+        C->policy->remove (S->policy, w);
+        cache_remove (C, S, w);
+    }
+    pthread_mutex_unlock (&S->lock);
+
+    web_data_release (w);
+}
+
+/*
+ * cache_remove - take w, already off its policy's queues, out of shard
+ * S, demoting it to the disk tier if C has one. Caller must hold
+ * S->lock.
+ */
+static void cache_remove (cache C, struct cache_shard *S, web_data w)
+{
+    if (C->disk)
+        cache_demote (C, w);
+
+    cache_unlink (C, S, w);
+}
+
+/*
+ * cache_unlink - take w, already off its policy's queues, out of shard
+ * S without demoting it. Caller must hold S->lock.
+ */
+static void cache_unlink (cache C, struct cache_shard *S, web_data w)
+{
+    if (w->slabs)
+        slabs_unlink (w->slabs, w);
+    S->size -= cache_entry_size (C, w);
+    __atomic_sub_fetch (&C->plainBytes, web_data_plain_size (w),
+        __ATOMIC_RELAXED);
+    __atomic_sub_fetch (&C->storedBytes, w->data_size, __ATOMIC_RELAXED);
+    vector_remove (S->items, w);
+}
+
+/*
+ * cache_demote - copy w's data, uncompressed, to C's disk tier if there
+ * is room for it there
+ */
+static void cache_demote (cache C, web_data w)
+{
+    disk_rec r = disk_begin (C->disk, w->website, w->file, w->port,
+        web_data_plain_size (w));
+
+    if (r == NULL)
+        return;
+
+    r->stored = w->stored;
+    if (web_data_unpack (w, disk_data (r)) < 0)
+        disk_abort (r);
+    else
+        disk_commit (r);
+}
+
+/*
+ * cache_entry_size - bytes w counts for against its shard's budget: its
+ * slab chunk, or if it is not in one its own size
+ */
+static int cache_entry_size (cache C, web_data w)
+{
+    int size = web_data_size (w);
+
+    return w->slabs ? slabs_chunk_size (w->slabs, size) : size;
+}
+
+/*
+ * cache_head_size - bytes of w's data, an HTTP response not yet
+ * compressed, up to and including the blank line after its head, or 0
+ * if it has none
+ */
+static int cache_head_size (web_data w)
+{
+    const char *end = memmem (w->data, w->data_size, "\r\n\r\n", 4);
+
+    return end ? end + 4 - w->data : 0;
+}
+
+/*
+ * cache_compressible - whether w's data, an HTTP response, might be
+ * worth compressing: it is not tiny, and its body is not already
+ * compressed, which a Content-Encoding or a media Content-Type gives
+ * away
+ */
+static int cache_compressible (web_data w)
+{
+    const char *end, *p;
+
+    if (w->data_size < CACHE_COMPRESS_MIN)
+        return 0;
+
+    end = w->head_size ? w->data + w->head_size - 4 : w->data + w->data_size;
+
+    // Skip the status line
+    p = memchr (w->data, '\n', end - w->data);
+    if (p == NULL)
+        return 1;
+
+    for (p++; p < end; p++)
+    {
+        if (cache_header_is (p, end, "content-encoding:", "")
+            || cache_header_is (p, end, "content-type:", "image/")
+            || cache_header_is (p, end, "content-type:", "video/")
+            || cache_header_is (p, end, "content-type:", "audio/")
+            || cache_header_is (p, end, "content-type:", "application/zip")
+            || cache_header_is (p, end, "content-type:", "application/gzip"))
+            return 0;
+
+        if ((p = memchr (p, '\n', end - p)) == NULL)
+            break;
+    }
+    return 1;
+}
+
+/*
+ * cache_header_is - whether the header line at head, which ends by end,
+ * is called name (with its colon, in lower case) and its value starts
+ * with value. Both compare ignoring case.
+ */
+static int cache_header_is (const char *head, const char *end,
+    const char *name, const char *value)
+{
+    int nameLen = strlen (name), valueLen = strlen (value);
+
+    if (end - head < nameLen || strncasecmp (head, name, nameLen))
+        return 0;
+
+    for (head += nameLen; head < end && (*head == ' ' || *head == '\t'); )
+        head++;
+
+    return end - head >= valueLen && !strncasecmp (head, value, valueLen);
+}
+
+/*
+ * cache_shard - the shard an entry whose key hashes to hash lives in.
+ * The index inside a shard uses the low bits of the hash, so the shard
+ * is picked by the high ones.
+ */
+static struct cache_shard *cache_shard (cache C, uint64_t hash)
+{
+    return &C->shards[(hash >> 32) % C->nshards];
+}
+
+/*
+ * cache_find - look the key up in shard S, telling its policy about the
+ * lookup and any hit. Caller must hold S->lock.
+ */
+static web_data cache_find (cache C, struct cache_shard *S, uint64_t hash,
+    char *website, char *file, int port)
+{
+    web_data w = vector_get (S->items, hash, website, file, port);
+
+    C->policy->access (S->policy, hash);
+    if (w != NULL)
+        cache_touch (C, S, w);
+
+    return w;
+}
+
+/*
+ * cache_touch - record a hit on w, one of S's entries. Caller must hold
+ * S->lock.
+ */
+static void cache_touch (cache C, struct cache_shard *S, web_data w)
+{
+    C->policy->hit (S->policy, w);
+    w->used = ++S->tick;
+    w->uses++;
+    if (w->slabs)
+        slabs_touch (w->slabs, w);
 }
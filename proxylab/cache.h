@@ -2,23 +2,86 @@
 #define CACHE_H
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "vector.h"
+#include "policy.h"
+#include "doorkeeper.h"
+#include "slab.h"
+#include "disk.h"
 
 #define MAX_CACHE_SIZE 1049000
 
-struct cache_header
+/* Shards the proxy splits its cache into. Each gets an equal share of
+   MAX_CACHE_SIZE and evicts only its own entries to make room, so a
+   share that holds just a few big objects makes them evict each other
+   while other shards sit half empty. cache_new therefore uses fewer
+   shards, down to one, until each can hold CACHE_SHARD_OBJECTS of the
+   largest entries: a small cache trades some lock contention for
+   keeping its hit rate, and a big one still gets all CACHE_SHARDS. */
+#define CACHE_SHARDS 8
+#define CACHE_SHARD_OBJECTS 4
+#define CACHE_SHARD_MIN (CACHE_SHARD_OBJECTS * SLAB_PAGE_SIZE)
+
+/* Smaller objects are not worth compressing */
+#define CACHE_COMPRESS_MIN 512
+
+/* Most hits of a restored entry replayed to its shard's policy */
+#define CACHE_REPLAY_MAX 16
+
+/* One independently locked part of the cache, with its own budget */
+struct cache_shard
 {
 	vector items;
-	int size;
+	int size;       // bytes its entries take up, headers and keys included
+	void *policy;   // the eviction policy's state for this shard
+	doorkeeper keeper;  // NULL if every object is admitted
+	unsigned long tick; // counts its inserts and hits
+	pthread_mutex_t lock;
+};
+
+/* Entries are spread over the shards by a hash of their key, so
+   lookups and inserts for different objects rarely share a lock */
+struct cache_header
+{
+	struct cache_shard *shards;
+	int nshards;
+	int capacity;   // byte budget of each shard
+	const policy_ops_t *policy;
+	slabs slabs;    // where entries live, or NULL for the heap
+	int compress;   // whether bodies are compressed once cached
+	long plainBytes;   // data of the cached entries, uncompressed
+	long storedBytes;  // ... and as stored
+	disk disk;      // where evicted entries go, or NULL
+	char *snapshot; // a loaded snapshot entries live in, or NULL
+	long snapshotBytes;
 };
 typedef struct cache_header *cache;
 
-cache cache_new ();
+/* An entry as cache_collect found it, and its use until then */
+struct cache_item
+{
+	web_data w;     // retained
+	unsigned long used;
+	int uses;
+};
+
+cache cache_new (int nshards, const policy_ops_t *policy, int admitWindow,
+    int slabbed, int compress);
 void cache_free (cache C);
+int cache_open_disk (cache C, const char *path, long bytes);
+double cache_ratio (cache C);
 
-const char *cache_get (cache C, char *website, char *file, int port, 
+const char *cache_get (cache C, char *website, char *file, int port,
     int *data_size);
-void cache_insert (cache C, char *website, char *file, int port, 
+web_data cache_lookup (cache C, char *website, char *file, int port);
+web_data cache_recheck (cache C, char *website, char *file, int port);
+void cache_insert (cache C, char *website, char *file, int port,
     char *data, int dataSize);
+web_data cache_reserve (cache C, char *website, char *file, int port,
+    int capacity, int evict);
+void cache_store (cache C, web_data w);
+disk_rec cache_lookup_disk (cache C, char *website, char *file, int port);
+void cache_restore (cache C, web_data w, int uses);
+int cache_collect (cache C, int shard, struct cache_item **items);
 
 #endif
@@ -0,0 +1,331 @@
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "connpool.h"
+
+static unsigned connpool_bucket (char *host, int port);
+static struct origin *connpool_origin (connpool P, char *host, int port);
+static struct origin *connpool_add_origin (connpool P, char *host,
+    int port);
+static void connpool_release (connpool P, struct origin *o);
+static void connpool_expire (connpool P, struct origin *o, time_t now);
+static int pconn_healthy (int fd);
+static void *connpool_reaper (void *vargp);
+
+/*
+ * connpool_new - create a pool keeping at most maxIdle idle connections
+ * per origin, each for at most idleSecs, and checking out at most
+ * maxActive per origin at a time (any number if 0). A reaper thread
+ * closes expired connections even for origins that are never asked for
+ * again.
+ */
+connpool connpool_new (int maxIdle, int idleSecs, int maxActive)
+{
+    connpool P = calloc(1, sizeof(struct connpool_header));
+
+    P->maxIdle = maxIdle;
+    P->idleSecs = idleSecs > 0 ? idleSecs : 1;
+    P->maxActive = maxActive;
+    pthread_mutex_init(&P->mutex, NULL);
+    pthread_cond_init(&P->stop, NULL);
+
+    if (maxIdle > 0)
+        Pthread_create(&P->reaper, NULL, connpool_reaper, P);
+
+    return P;
+}
+
+/*
+ * connpool_get - check out a connection to host:port, waiting up to
+ * CONNPOOL_WAIT_SECS while maxActive are already out, and reusing an
+ * idle one that still looks healthy if there is one. *reused says
+ * which. Hand it back with connpool_put or connpool_drop. Returns -1 if
+ * none came free in time or a new connection could not be opened.
+ * New connections have
+ * Nagle turned off: each request goes out in a single write, and Nagle
+ * would only hold back the tail of one longer than a segment until the
+ * server's (possibly delayed) ACK of the rest.
+ */
+int connpool_get (connpool P, char *host, int port, int *reused)
+{
+    struct pconn *c;
+    struct timespec deadline;
+    int fd = -1;
+
+    pthread_mutex_lock(&P->mutex);
+
+    struct origin *o = connpool_origin(P, host, port);
+
+    if (o == NULL)
+        o = connpool_add_origin(P, host, port);
+
+    if (P->maxActive > 0 && o->nactive >= P->maxActive)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CONNPOOL_WAIT_SECS;
+
+        while (o->nactive >= P->maxActive)
+        {
+            if (pthread_cond_timedwait(&o->freed, &P->mutex, &deadline)
+                == ETIMEDOUT && o->nactive >= P->maxActive)
+            {
+                pthread_mutex_unlock(&P->mutex);
+                return -1;
+            }
+        }
+    }
+
+    o->nactive++;
+    connpool_expire(P, o, time(NULL));
+
+    while (fd < 0 && (c = o->idle) != NULL)
+    {
+        o->idle = c->next;
+        o->nidle--;
+
+        if (pconn_healthy(c->fd))
+            fd = c->fd;
+        else
+            close(c->fd);
+
+        free(c);
+    }
+
+    pthread_mutex_unlock(&P->mutex);
+
+    if (fd >= 0)
+    {
+        *reused = 1;
+        return fd;
+    }
+
+    *reused = 0;
+
+    int one = 1;
+    if ((fd = open_clientfd_r(host, port)) >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    else
+    {
+        pthread_mutex_lock(&P->mutex);
+        connpool_release(P, o);
+        pthread_mutex_unlock(&P->mutex);
+    }
+    return fd;
+}
+
+/*
+ * connpool_put - hand back a connection whose last response was fully
+ * read. It is closed instead if the origin already has maxIdle idle
+ * connections.
+ */
+void connpool_put (connpool P, char *host, int port, int fd)
+{
+    pthread_mutex_lock(&P->mutex);
+
+    struct origin *o = connpool_origin(P, host, port);
+
+    connpool_release(P, o);
+
+    if (o->nidle >= P->maxIdle)
+    {
+        pthread_mutex_unlock(&P->mutex);
+        close(fd);
+        return;
+    }
+
+    struct pconn *c = malloc(sizeof(struct pconn));
+    c->fd = fd;
+    c->idleSince = time(NULL);
+    c->next = o->idle;
+    o->idle = c;
+    o->nidle++;
+
+    pthread_mutex_unlock(&P->mutex);
+}
+
+/*
+ * connpool_drop - close a checked out connection that can't be reused
+ */
+void connpool_drop (connpool P, char *host, int port, int fd)
+{
+    close(fd);
+
+    pthread_mutex_lock(&P->mutex);
+    connpool_release(P, connpool_origin(P, host, port));
+    pthread_mutex_unlock(&P->mutex);
+}
+
+/*
+ * connpool_free - stop the reaper, close every idle connection and free
+ * P. Every checked out connection must have been handed back.
+ */
+void connpool_free (connpool P)
+{
+    int b;
+
+    pthread_mutex_lock(&P->mutex);
+    P->stopping = 1;
+    pthread_cond_signal(&P->stop);
+    pthread_mutex_unlock(&P->mutex);
+
+    if (P->maxIdle > 0)
+        pthread_join(P->reaper, NULL);
+
+    for (b = 0; b < CONNPOOL_BUCKETS; b++)
+    {
+        struct origin *o, *next;
+
+        for (o = P->buckets[b]; o; o = next)
+        {
+            struct pconn *c, *cnext;
+
+            for (c = o->idle; c; c = cnext)
+            {
+                cnext = c->next;
+                close(c->fd);
+                free(c);
+            }
+
+            next = o->next;
+            pthread_cond_destroy(&o->freed);
+            free(o->host);
+            free(o);
+        }
+    }
+
+    pthread_cond_destroy(&P->stop);
+    pthread_mutex_destroy(&P->mutex);
+    free(P);
+}
+
+/*
+ * connpool_bucket - djb2 hash of host:port
+ */
+static unsigned connpool_bucket (char *host, int port)
+{
+    unsigned h = 5381;
+
+    while (*host)
+        h = h * 33 + (unsigned char)*host++;
+
+    return (h * 33 + port) % CONNPOOL_BUCKETS;
+}
+
+/*
+ * connpool_origin - find the entry for host:port. Caller must hold
+ * P->mutex. Returns NULL if host:port has never been pooled.
+ */
+static struct origin *connpool_origin (connpool P, char *host, int port)
+{
+    unsigned b = connpool_bucket(host, port);
+    struct origin *o;
+
+    for (o = P->buckets[b]; o; o = o->next)
+    {
+        if (o->port == port && !strcmp(o->host, host))
+            return o;
+    }
+
+    return NULL;
+}
+
+/*
+ * connpool_add_origin - add an entry for host:port, which has none.
+ * Caller must hold P->mutex.
+ */
+static struct origin *connpool_add_origin (connpool P, char *host,
+    int port)
+{
+    struct origin *o = malloc(sizeof(struct origin));
+    unsigned b = connpool_bucket(host, port);
+
+    o->host = strdup(host);
+    o->port = port;
+    o->nidle = 0;
+    o->idle = NULL;
+    o->nactive = 0;
+    pthread_cond_init(&o->freed, NULL);
+
+    o->next = P->buckets[b];
+    P->buckets[b] = o;
+    return o;
+}
+
+/*
+ * connpool_release - count one of o's connections as no longer checked
+ * out and wake a request waiting for it. Caller must hold P->mutex.
+ */
+static void connpool_release (connpool P, struct origin *o)
+{
+    o->nactive--;
+    pthread_cond_signal(&o->freed);
+}
+
+/*
+ * connpool_expire - close o's connections that have been idle longer
+ * than P->idleSecs. The list is most recently used first, so they are
+ * all at its tail. Caller must hold P->mutex.
+ */
+static void connpool_expire (connpool P, struct origin *o, time_t now)
+{
+    struct pconn **link = &o->idle;
+
+    while (*link && now - (*link)->idleSince < P->idleSecs)
+        link = &(*link)->next;
+
+    while (*link)
+    {
+        struct pconn *c = *link;
+        *link = c->next;
+        close(c->fd);
+        free(c);
+        o->nidle--;
+    }
+}
+
+/*
+ * pconn_healthy - an idle connection is healthy if the origin has
+ * neither closed it nor sent anything unsolicited on it
+ */
+static int pconn_healthy (int fd)
+{
+    char c;
+    int n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * connpool_reaper - close expired idle connections once a second until
+ * connpool_free
+ */
+static void *connpool_reaper (void *vargp)
+{
+    connpool P = (connpool)vargp;
+    struct timespec deadline;
+    int b;
+
+    pthread_mutex_lock(&P->mutex);
+
+    while (!P->stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        if (pthread_cond_timedwait(&P->stop, &P->mutex, &deadline)
+            != ETIMEDOUT)
+            continue;
+
+        time_t now = time(NULL);
+
+        for (b = 0; b < CONNPOOL_BUCKETS; b++)
+        {
+            struct origin *o;
+            for (o = P->buckets[b]; o; o = o->next)
+                connpool_expire(P, o, now);
+        }
+    }
+
+    pthread_mutex_unlock(&P->mutex);
+    return NULL;
+}
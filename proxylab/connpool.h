@@ -0,0 +1,60 @@
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <pthread.h>
+#include <time.h>
+
+/* Defaults, overridable from the command line */
+#define CONNPOOL_MAX_IDLE 4     /* idle connections kept per origin */
+#define CONNPOOL_IDLE_SECS 4    /* idle connections older than this close */
+#define CONNPOOL_MAX_ACTIVE 32  /* connections in use per origin, 0 for any */
+/* A request gives up waiting for one of those to come free after this */
+#define CONNPOOL_WAIT_SECS 10
+#define CONNPOOL_BUCKETS 256
+
+/* An idle connection to an origin */
+struct pconn
+{
+    int fd;
+    time_t idleSince;
+    struct pconn *next;
+};
+
+/* All idle connections to one (host, port), most recently used first,
+   and how many more are checked out */
+struct origin
+{
+    char *host;
+    int port;
+    int nidle;
+    struct pconn *idle;
+    int nactive;
+    pthread_cond_t freed;   /* signalled when one is handed back */
+    struct origin *next;
+};
+
+/*  A pool of persistent connections to web servers, keyed by host and
+    port. Connections are checked out for one request and handed back
+    if the response left them reusable, or dropped. No more than
+    maxActive are checked out to an origin at once, so a burst of
+    misses can't swamp one server; further requests wait their turn. */
+struct connpool_header
+{
+    struct origin *buckets[CONNPOOL_BUCKETS];
+    int maxIdle;
+    int idleSecs;
+    int maxActive;
+    int stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t stop;    /* wakes the reaper for connpool_free */
+    pthread_t reaper;
+};
+typedef struct connpool_header *connpool;
+
+connpool connpool_new (int maxIdle, int idleSecs, int maxActive);
+int connpool_get (connpool P, char *host, int port, int *reused);
+void connpool_put (connpool P, char *host, int port, int fd);
+void connpool_drop (connpool P, char *host, int port, int fd);
+void connpool_free (connpool P);
+
+#endif
@@ -1,4 +1,7 @@
 /* $begin csapp.c */
+#define _GNU_SOURCE /* memmem */
+#include <poll.h>
+#include <time.h>
 #include "csapp.h"
 
 /* Updated with a reentrant open_clientfd_r function */
@@ -522,6 +525,9 @@ void V(sem_t *sem)
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
+
+io_ops_t io_ops = { read, write, getaddrinfo, freeaddrinfo };
+
 /*
  * rio_readn - robustly read n bytes (unbuffered)
  */
@@ -533,7 +539,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-    if ((nread = read(fd, bufp, nleft)) < 0) {
+    if ((nread = io_ops.read(fd, bufp, nleft)) < 0) {
         if (errno == EINTR) /* interrupted by sig handler return */
         nread = 0;      /* and call read() again */
         else
@@ -559,7 +565,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-    if ((nwritten = write(fd, bufp, nleft)) <= 0) {
+    if ((nwritten = io_ops.write(fd, bufp, nleft)) <= 0) {
         if (errno == EINTR)  /* interrupted by sig handler return */
         nwritten = 0;    /* and call write() again */
         else
@@ -573,21 +579,14 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
-/* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * rio_fill - refill the internal buffer via read() if it is empty.
+ *    Returns the number of unread bytes in it, 0 on EOF or -1 on error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+    rp->rio_cnt = io_ops.read(rp->rio_fd, rp->rio_buf, 
                sizeof(rp->rio_buf));
     if (rp->rio_cnt < 0) {
         if (errno != EINTR) /* interrupted by sig handler return */
@@ -598,6 +597,24 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     else 
         rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+    return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -650,31 +667,75 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - robustly read a text line (buffered)
+ *     The line is copied out of the internal buffer a run at a time,
+ *     up to the newline memchr finds, rather than a byte at a time.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *nl;
+    int rc;
 
-    for (n = 1; n < maxlen; n++) { 
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-        *bufp++ = c;
-        if (c == '\n')
-        break;
-    } else if (rc == 0) {
-        if (n == 1)
-        return 0; /* EOF, no data read */
-        else
-        break;    /* EOF, some data was read */
-    } else
+    while (n + 1 < maxlen) {
+    if ((rc = rio_fill(rp)) < 0)
         return -1;    /* error */
+    if (rc == 0)
+        break;        /* EOF */
+    cnt = maxlen - 1 - n;
+    if (rp->rio_cnt < cnt)
+        cnt = rp->rio_cnt;
+    if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+        cnt = nl - rp->rio_bufptr + 1;
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
+    if (nl)
+        break;
     }
-    *bufp = 0;
-    return n;
+    if (n == 0 && maxlen > 1)
+    return 0;         /* EOF, no data read */
+    bufp[n] = 0;
+    return n == 0 || bufp[n - 1] != '\n' ? n + 1 : n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readheadb - read an HTTP head, up to and including the blank line
+ *     that ends it (buffered), copying out whole runs of the internal
+ *     buffer. Returns its length, 0 on EOF before any of it, or -1 on
+ *     error, on EOF part way or if it does not end within maxlen bytes.
+ */
+/* $begin rio_readheadb */
+ssize_t rio_readheadb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    size_t n = 0, cnt, from;
+    char *bufp = usrbuf, *end;
+    int rc;
+
+    while (n < maxlen) {
+    if ((rc = rio_fill(rp)) <= 0)
+        return rc < 0 || n > 0 ? -1 : 0;
+    cnt = maxlen - n;
+    if (rp->rio_cnt < cnt)
+        cnt = rp->rio_cnt;
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+
+    /* The blank line may have started in what was copied before */
+    from = n > 3 ? n - 3 : 0;
+    if ((end = memmem(bufp + from, n + cnt - from, "\r\n\r\n", 4)) != NULL)
+        cnt = end + 4 - (bufp + n);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
+    if (end)
+        return n;
+    }
+    return -1;
+}
+/* $end rio_readheadb */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -719,6 +780,12 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /******************************** 
  * Client/server helper functions
  ********************************/
+static int open_listenfd_opt(int port, int reuseport);
+static int connect_order(struct addrinfo *list, struct addrinfo **order,
+    int max);
+static int connect_start(struct addrinfo *ai);
+static long connect_now_ms(void);
+
 /*
  * open_clientfd - open connection to server at <hostname, port> 
  *   and return a socket descriptor ready for reading and writing.
@@ -755,43 +822,160 @@ int open_clientfd(char *hostname, int port)
 /* $end open_clientfd */
 
 /*
- * open_clientfd_r - thread-safe version of open_clientfd
+ * open_clientfd_r - thread-safe version of open_clientfd that races
+ *     connections to every IPv4 and IPv6 address of hostname, in the
+ *     style of Happy Eyeballs (RFC 8305). Attempts start
+ *     CONNECT_STAGGER_MS apart (or as soon as the previous one fails),
+ *     each is given up after CONNECT_TIMEOUT_MS, and the first to
+ *     connect wins. Returns a blocking socket or -1.
  */
 int open_clientfd_r(char *hostname, int port) {
-    int clientfd;
-    struct addrinfo *addlist, *p;
+    struct addrinfo hints, *addlist;
+    struct addrinfo *order[CONNECT_MAX_ADDRS];
+    struct pollfd pfd[CONNECT_MAX_ADDRS];
+    long started[CONNECT_MAX_ADDRS];
     char port_str[MAXLINE];
-    int rv;
-
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
+    int naddrs, next = 0, nlive = 0, clientfd = -1;
+    int i, fd;
 
     /* Get a list of addrinfo structs */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
     sprintf(port_str, "%d", port);
-    if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
+    if (io_ops.getaddrinfo(hostname, port_str, &hints, &addlist) != 0) {
         return -1;
     }
-  
-    /* Walk the list, using each addrinfo to try to connect */
-    for (p = addlist; p; p = p->ai_next) {
-        if (p->ai_family == AF_INET) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break; /* success */
+    naddrs = connect_order(addlist, order, CONNECT_MAX_ADDRS);
+
+    long nextStart = connect_now_ms();
+
+    while (clientfd < 0 && (next < naddrs || nlive > 0)) {
+        long now = connect_now_ms();
+
+        /* Start the next attempt when its turn comes, or right away if
+           nothing is in flight */
+        if (next < naddrs && (nlive == 0 || now >= nextStart)) {
+            pfd[next].fd = connect_start(order[next]);
+            pfd[next].events = POLLOUT;
+            pfd[next].revents = 0;
+            started[next] = now;
+            if (pfd[next].fd >= 0)
+                nlive++;
+            next++;
+            nextStart = now + CONNECT_STAGGER_MS;
+            continue;
+        }
+
+        /* Wait for an attempt to finish, one to time out or the next
+           one to be due */
+        long wait = next < naddrs ? nextStart - now : CONNECT_TIMEOUT_MS;
+        for (i = 0; i < next; i++) {
+            if (pfd[i].fd >= 0 && started[i] + CONNECT_TIMEOUT_MS - now < wait)
+                wait = started[i] + CONNECT_TIMEOUT_MS - now;
+        }
+
+        if (poll(pfd, next, wait > 0 ? wait : 0) < 0 && errno != EINTR)
+            break;
+        now = connect_now_ms();
+
+        for (i = 0; i < next && clientfd < 0; i++) {
+            if ((fd = pfd[i].fd) < 0)
+                continue;
+
+            if (pfd[i].revents) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                    && err == 0) {
+                    clientfd = fd; /* success */
+                    pfd[i].fd = -1;
+                    continue;
+                }
             }
+            else if (now - started[i] < CONNECT_TIMEOUT_MS) {
+                continue;
+            }
+
+            /* Failed or timed out, so the next address need not wait */
+            close(fd);
+            pfd[i].fd = -1;
+            nlive--;
+            nextStart = now;
         }
-    } 
+    }
 
-    /* Clean up */
-    freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
-        close(clientfd);
-        return -1;
+    /* Clean up the attempts that lost */
+    for (i = 0; i < next; i++) {
+        if (pfd[i].fd >= 0)
+            close(pfd[i].fd);
+    }
+    io_ops.freeaddrinfo(addlist);
+
+    if (clientfd >= 0)
+        fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) & ~O_NONBLOCK);
+    return clientfd;
+}
+
+/*
+ * connect_order - fill order with up to max addresses from list,
+ *     alternating between address families starting with the first
+ *     one listed, as RFC 8305 recommends. Returns the number stored.
+ */
+static int connect_order(struct addrinfo *list, struct addrinfo **order,
+    int max)
+{
+    struct addrinfo *same[CONNECT_MAX_ADDRS], *other[CONNECT_MAX_ADDRS], *p;
+    int nsame = 0, nother = 0, n = 0, i;
+
+    for (p = list; p; p = p->ai_next) {
+        if (p->ai_family == list->ai_family) {
+            if (nsame < CONNECT_MAX_ADDRS)
+                same[nsame++] = p;
+        }
+        else if (nother < CONNECT_MAX_ADDRS) {
+            other[nother++] = p;
+        }
     }
-    else { /* one of the connects succeeded */
-        return clientfd;
+
+    for (i = 0; n < max && (i < nsame || i < nother); i++) {
+        if (i < nsame)
+            order[n++] = same[i];
+        if (i < nother && n < max)
+            order[n++] = other[i];
     }
+    return n;
+}
+
+/*
+ * connect_start - start a non-blocking connect to ai. Returns the
+ *     socket, which may still be connecting, or -1.
+ */
+static int connect_start(struct addrinfo *ai)
+{
+    int fd;
+
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+        return -1;
+
+    if ((fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+        return fd;
+
+    close(fd);
+    return -1;
+}
+
+/* connect_now_ms - a monotonic clock in milliseconds */
+static long connect_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*  
@@ -800,6 +984,22 @@ int open_clientfd_r(char *hostname, int port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - like open_listenfd, but with SO_REUSEPORT
+ *     set so that several sockets can listen on the same port and the
+ *     kernel spreads incoming connections across them.
+ */
+int open_listenfd_reuseport(int port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(int port, int reuseport)
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -811,7 +1011,11 @@ int open_listenfd(int port)
     /* Eliminates "Address already in use" error from bind. */
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
            (const void *)&optval , sizeof(int)) < 0)
-    return -1;
+    goto fail;
+
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+           (const void *)&optval , sizeof(int)) < 0)
+    goto fail;
 
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
@@ -820,14 +1024,17 @@ int open_listenfd(int port)
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
     serveraddr.sin_port = htons((unsigned short)port); 
     if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0)
-    return -1;
+    goto fail;
 
     /* Make it a listening socket ready to accept connection requests */
     if (listen(listenfd, LISTENQ) < 0)
-    return -1;
+    goto fail;
     return listenfd;
+
+ fail:
+    close(listenfd);
+    return -1;
 }
-/* $end open_listenfd */
 
 /******************************************
  * Wrappers for the client/server helper routines 
@@ -863,5 +1070,14 @@ int Open_listenfd(int port)
     unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+    unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
 /* $end csapp.c */
 
@@ -47,6 +47,18 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* System calls underneath Rio and open_clientfd_r, which an alternative
+   I/O backend or resolver may replace. Defaults to read, write,
+   getaddrinfo and freeaddrinfo. */
+typedef struct {
+    ssize_t (*read)(int fd, void *buf, size_t n);
+    ssize_t (*write)(int fd, const void *buf, size_t n);
+    int (*getaddrinfo)(const char *node, const char *service,
+        const struct addrinfo *hints, struct addrinfo **res);
+    void (*freeaddrinfo)(struct addrinfo *res);
+} io_ops_t;
+extern io_ops_t io_ops;
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */ 
 extern char **environ; /* defined by libc */
@@ -56,6 +68,12 @@ extern char **environ; /* defined by libc */
 #define MAXBUF   8192  /* max I/O buffer size */
 #define LISTENQ  1024  /* second argument to listen() */
 
+/* open_clientfd_r starts a connection to the next address this often
+   until one succeeds, and gives up on each attempt after the timeout */
+#define CONNECT_STAGGER_MS 250
+#define CONNECT_TIMEOUT_MS 3000
+#define CONNECT_MAX_ADDRS  16
+
 /* Our own error-handling functions */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
@@ -148,6 +166,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readheadb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -160,11 +179,13 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 int open_clientfd(char *hostname, int portno);
 int open_clientfd_r(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_clientfd_r(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "disk.h"
+#include "web_data.h"
+
+static long disk_reserve (disk D, int size);
+static int disk_drop_oldest (disk D);
+static void disk_index_add (disk D, disk_rec r);
+static void disk_index_remove (disk D, disk_rec r);
+static int disk_matches (disk_rec r, char *website, char *file, int port);
+
+/*
+ * disk_open - create (or truncate) the file at path, bytes long rounded
+ * down to whole pages, for a disk tier and map it. Returns NULL if that
+ * fails, or if the file system can't punch holes in it.
+ */
+disk disk_open (const char *path, long bytes)
+{
+    disk D = calloc(1, sizeof(struct disk_header));
+
+    D->bytes = bytes / DISK_ALIGN * DISK_ALIGN;
+    D->fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (D->fd < 0 || D->bytes < 1 || ftruncate (D->fd, D->bytes) < 0
+        || fallocate (D->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            0, D->bytes) < 0
+        || (D->map = mmap(NULL, D->bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+            D->fd, 0)) == MAP_FAILED)
+    {
+        if (D->fd >= 0)
+            close (D->fd);
+        free (D);
+        return NULL;
+    }
+
+    D->indexCap = DISK_INDEX_MIN;
+    D->index = calloc(D->indexCap, sizeof(disk_rec));
+    pthread_mutex_init (&D->lock, NULL);
+    return D;
+}
+
+/*
+ * disk_close - unmap and close the tier. No record may be pinned.
+ */
+void disk_close (disk D)
+{
+    while (D->oldest)
+    {
+        disk_rec r = D->oldest;
+        D->oldest = r->next;
+        free (r);
+    }
+
+    munmap (D->map, D->bytes);
+    close (D->fd);
+    pthread_mutex_destroy (&D->lock);
+    free (D->index);
+    free (D);
+}
+
+/*
+ * disk_max_object - the most bytes a record in D, key included, may take
+ */
+int disk_max_object (disk D)
+{
+    long max = D->bytes / DISK_MAX_OBJECT_FRAC;
+
+    return max > 0x7fffffff ? 0x7fffffff : (int)max;
+}
+
+/*
+ * disk_begin - a record for size bytes of data under website, file,
+ * port, pinned for the caller to fill through disk_data and then hand
+ * to disk_commit or disk_abort. Returns NULL if there is no room.
+ */
+disk_rec disk_begin (disk D, char *website, char *file, int port, int size)
+{
+    int siteLen = strlen (website) + 1;
+    int fileLen = strlen (file) + 1;
+    int pages;
+    disk_rec r;
+    long off;
+
+    if (size < 0 || size > disk_max_object (D) - siteLen - fileLen)
+        return NULL;
+
+    pages = (siteLen + fileLen + size + DISK_ALIGN - 1) / DISK_ALIGN;
+    pthread_mutex_lock (&D->lock);
+
+    if ((off = disk_reserve (D, pages * DISK_ALIGN)) < 0)
+    {
+        pthread_mutex_unlock (&D->lock);
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(struct disk_record));
+    r->hash = web_data_hash (website, file, port);
+    r->port = port;
+    r->offset = off;
+    r->keyLen = siteLen + fileLen;
+    r->size = pages * DISK_ALIGN;
+    r->dataSize = size;
+    r->stored = time (NULL);
+    r->refs = 1;
+    r->disk = D;
+
+    if (D->newest)
+        D->newest->next = r;
+    else
+        D->oldest = r;
+    D->newest = r;
+    D->head = off + r->size;
+
+    pthread_mutex_unlock (&D->lock);
+
+    // The record's room is ours alone while it is pinned
+    memcpy (D->map + off, website, siteLen);
+    memcpy (D->map + off + siteLen, file, fileLen);
+    return r;
+}
+
+/*
+ * disk_data - where r's data is, in the mapped file
+ */
+char *disk_data (disk_rec r)
+{
+    return r->disk->map + r->offset + r->keyLen;
+}
+
+/*
+ * disk_commit - r, from disk_begin, has been filled: index it in place
+ * of any older copy, and unpin it
+ */
+void disk_commit (disk_rec r)
+{
+    disk D = r->disk;
+
+    pthread_mutex_lock (&D->lock);
+    disk_index_add (D, r);
+    r->refs--;
+    pthread_mutex_unlock (&D->lock);
+}
+
+/*
+ * disk_abort - r, from disk_begin, could not be filled: unpin it without
+ * indexing it. Its room is reclaimed when the log comes round to it.
+ */
+void disk_abort (disk_rec r)
+{
+    disk_release (r);
+}
+
+/*
+ * disk_put - append a copy of size bytes of data to D. Returns 0 if
+ * there was no room for it.
+ */
+int disk_put (disk D, char *website, char *file, int port,
+    const char *data, int size)
+{
+    disk_rec r = disk_begin (D, website, file, port, size);
+
+    if (r == NULL)
+        return 0;
+
+    memcpy (disk_data (r), data, size);
+    disk_commit (r);
+    return 1;
+}
+
+/*
+ * disk_lookup - the record of website, file, port in D, pinned so the
+ * log can't run over it until disk_release, or NULL
+ */
+disk_rec disk_lookup (disk D, char *website, char *file, int port)
+{
+    uint64_t hash = web_data_hash (website, file, port);
+    disk_rec r;
+
+    pthread_mutex_lock (&D->lock);
+
+    for (r = D->index[hash & (D->indexCap - 1)]; r != NULL; r = r->chain)
+    {
+        if (r->hash == hash && disk_matches (r, website, file, port))
+        {
+            r->refs++;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock (&D->lock);
+    return r;
+}
+
+/*
+ * disk_release - unpin r
+ */
+void disk_release (disk_rec r)
+{
+    pthread_mutex_lock (&r->disk->lock);
+    r->refs--;
+    pthread_mutex_unlock (&r->disk->lock);
+}
+
+/*
+ * disk_sendfile - send bytes *off up to end of r's data to fd straight
+ * from the file, advancing *off past what was sent. Returns the bytes
+ * sent, or -1 with errno set (EAGAIN if fd is non-blocking and full).
+ */
+long disk_sendfile (disk_rec r, int fd, long *off, long end)
+{
+    off_t pos = r->offset + r->keyLen + *off;
+    long sent = 0;
+    ssize_t n;
+
+    while (*off < end)
+    {
+        if ((n = sendfile (fd, r->disk->fd, &pos, end - *off)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return sent > 0 ? sent : -1;
+        }
+
+        if (n == 0)
+            break;
+
+        *off += n;
+        sent += n;
+    }
+    return sent;
+}
+
+/*
+ * disk_reserve - room for size bytes at the head of the log, dropping
+ * the oldest records until there is. Returns its offset, or -1 if a
+ * pinned record is in the way. Caller must hold D->lock.
+ */
+static long disk_reserve (disk D, int size)
+{
+    while (1)
+    {
+        if (D->oldest == NULL)
+            return size <= D->bytes ? 0 : -1;
+
+        long tail = D->oldest->offset;
+
+        if (tail < D->head)
+        {
+            // Free from the head to the end, and from the start up to
+            // the tail, where the log wraps round to if it must
+            if (D->bytes - D->head >= size)
+                return D->head;
+            if (tail >= size)
+                return 0;
+        }
+
+        else if (tail - D->head >= size)
+            return D->head;
+
+        if (!disk_drop_oldest (D))
+            return -1;
+    }
+}
+
+/*
+ * disk_drop_oldest - take the oldest record out of the log. Returns 0
+ * if it is pinned. Caller must hold D->lock.
+ *
+ * Unpinning a record is not enough to let the log write over it:
+ * sendfile queues the file's pages on the socket rather than copying
+ * them, so a record already "sent" may still be read long after. Its
+ * pages are punched out of the file instead, leaving the old ones to
+ * the sockets that hold them, and a new record gets fresh pages. That
+ * is why records are whole pages.
+ */
+static int disk_drop_oldest (disk D)
+{
+    disk_rec r = D->oldest;
+
+    if (r->refs > 0)
+        return 0;
+
+    if (r->indexed)
+        disk_index_remove (D, r);
+
+    fallocate (D->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        r->offset, r->size);
+
+    D->oldest = r->next;
+    if (D->oldest == NULL)
+        D->newest = NULL;
+
+    free (r);
+    return 1;
+}
+
+/*
+ * disk_index_add - index r, dropping any older copy of its key from the
+ * index, and growing the index to keep chains short
+ */
+static void disk_index_add (disk D, disk_rec r)
+{
+    char *website = D->map + r->offset;
+    char *file = website + strlen (website) + 1;
+    disk_rec *p;
+    int i;
+
+    for (p = &D->index[r->hash & (D->indexCap - 1)]; *p; p = &(*p)->chain)
+    {
+        if ((*p)->hash == r->hash
+            && disk_matches (*p, website, file, r->port))
+        {
+            (*p)->indexed = 0;
+            *p = (*p)->chain;
+            D->count--;
+            break;
+        }
+    }
+
+    if (D->count + 1 > D->indexCap)
+    {
+        disk_rec *old = D->index;
+        int oldCap = D->indexCap;
+
+        D->indexCap *= 2;
+        D->index = calloc(D->indexCap, sizeof(disk_rec));
+
+        for (i = 0; i < oldCap; i++)
+        {
+            while (old[i])
+            {
+                disk_rec q = old[i];
+                old[i] = q->chain;
+                q->chain = D->index[q->hash & (D->indexCap - 1)];
+                D->index[q->hash & (D->indexCap - 1)] = q;
+            }
+        }
+        free (old);
+    }
+
+    p = &D->index[r->hash & (D->indexCap - 1)];
+    r->chain = *p;
+    *p = r;
+    r->indexed = 1;
+    D->count++;
+}
+
+/*
+ * disk_index_remove - take r out of the index
+ */
+static void disk_index_remove (disk D, disk_rec r)
+{
+    disk_rec *p;
+
+    for (p = &D->index[r->hash & (D->indexCap - 1)]; *p; p = &(*p)->chain)
+    {
+        if (*p == r)
+        {
+            *p = r->chain;
+            r->indexed = 0;
+            D->count--;
+            return;
+        }
+    }
+}
+
+/*
+ * disk_matches - whether r's record is for website, file, port
+ */
+static int disk_matches (disk_rec r, char *website, char *file, int port)
+{
+    char *site = r->disk->map + r->offset;
+
+    return r->port == port && strcmp (site, website) == 0
+        && strcmp (site + strlen (site) + 1, file) == 0;
+}
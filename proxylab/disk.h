@@ -0,0 +1,70 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Default size of the disk tier's file, in megabytes */
+#define DISK_TIER_MB 64
+/* An object may take up at most this fraction of the file */
+#define DISK_MAX_OBJECT_FRAC 8
+#define DISK_INDEX_MIN 64
+/* Records start on page boundaries; see disk_drop_oldest */
+#define DISK_ALIGN 4096
+
+/* An object in the log. Its record there is its website and file
+   strings, each ending in '\0', and then its data. */
+struct disk_record
+{
+	uint64_t hash;      // web_data_hash of its key
+	int port;
+	long offset;        // of the record in the file
+	int size;           // bytes the record takes up there, in pages
+	int keyLen;         // ... of which the key strings
+	int dataSize;
+	long stored;        // time() when its object was first cached
+	int refs;           // readers and the writer filling it
+	int indexed;        // in the index, i.e. the newest copy, complete
+	struct disk_header *disk;
+	struct disk_record *next;   // the next newer record in the log
+	struct disk_record *chain;  // the next in its index bucket
+};
+typedef struct disk_record *disk_rec;
+
+/*  A second cache tier in a file, mapped into memory and written as a
+    circular log: each object is appended at the head, and when there is
+    no room the oldest records are dropped, first in first out. Only the
+    index of the records is kept on the heap. A record being filled or
+    sent is pinned, and the log will not run over it: objects that would
+    need its room are turned away until it is released. */
+struct disk_header
+{
+	int fd;
+	char *map;
+	long bytes;
+	long head;          // where the next record goes
+	disk_rec oldest;    // the records in log order
+	disk_rec newest;
+	disk_rec *index;    // indexed records by hash, chained
+	int indexCap;
+	int count;          // indexed records
+	pthread_mutex_t lock;
+};
+typedef struct disk_header *disk;
+
+disk disk_open (const char *path, long bytes);
+void disk_close (disk D);
+int disk_max_object (disk D);
+
+disk_rec disk_begin (disk D, char *website, char *file, int port, int size);
+char *disk_data (disk_rec r);
+void disk_commit (disk_rec r);
+void disk_abort (disk_rec r);
+int disk_put (disk D, char *website, char *file, int port,
+    const char *data, int size);
+
+disk_rec disk_lookup (disk D, char *website, char *file, int port);
+void disk_release (disk_rec r);
+long disk_sendfile (disk_rec r, int fd, long *off, long end);
+
+#endif
@@ -0,0 +1,354 @@
+#include "csapp.h"
+#include "dns.h"
+
+/* An addrinfo handed out by dns_getaddrinfo, with room for its address */
+struct dns_ai
+{
+    struct addrinfo ai;
+    struct sockaddr_storage ss;
+};
+
+static unsigned dns_bucket (const char *host);
+static struct dns_entry *dns_entry (dns D, const char *host);
+static void dns_store (dns D, struct dns_entry *e, int rc,
+    struct dns_addrs *addrs);
+static void *dns_refresher (void *vargp);
+
+/*
+ * dns_new - create a cache that trusts a resolved name for ttl seconds
+ * and a failed one for negTtl. Names are resolved with resolve, or with
+ * getaddrinfo if that is NULL.
+ */
+dns dns_new (int ttl, int negTtl, dns_resolver resolve)
+{
+    dns D = calloc(1, sizeof(struct dns_header));
+
+    D->ttl = ttl;
+    D->negTtl = negTtl;
+    D->resolve = resolve ? resolve : dns_system_resolve;
+    pthread_mutex_init(&D->mutex, NULL);
+    pthread_cond_init(&D->done, NULL);
+    pthread_cond_init(&D->stop, NULL);
+
+    if (ttl > 0)
+        Pthread_create(&D->refresher, NULL, dns_refresher, D);
+
+    return D;
+}
+
+/*
+ * dns_free - stop the refresher and free D and every name it holds. No
+ * other thread may be using D.
+ */
+void dns_free (dns D)
+{
+    struct dns_entry *e, *next;
+    int b;
+
+    pthread_mutex_lock(&D->mutex);
+    D->stopping = 1;
+    pthread_cond_signal(&D->stop);
+    pthread_mutex_unlock(&D->mutex);
+
+    if (D->ttl > 0)
+        pthread_join(D->refresher, NULL);
+
+    for (b = 0; b < DNS_BUCKETS; b++)
+    {
+        for (e = D->buckets[b]; e; e = next)
+        {
+            next = e->next;
+            free(e->host);
+            free(e);
+        }
+    }
+
+    pthread_cond_destroy(&D->stop);
+    pthread_cond_destroy(&D->done);
+    pthread_mutex_destroy(&D->mutex);
+    free(D);
+}
+
+/*
+ * dns_lookup - resolve host into out (which may be NULL), from the cache
+ * if it holds a live answer. If another thread is already resolving
+ * host, wait for its answer instead of starting a second lookup.
+ * Returns 0 or an EAI_* error code.
+ */
+int dns_lookup (dns D, const char *host, struct dns_addrs *out)
+{
+    struct dns_addrs addrs;
+    int rc;
+
+    pthread_mutex_lock(&D->mutex);
+
+    time_t now = time(NULL);
+    struct dns_entry *e = dns_entry(D, host);
+    int fresh = e->expires > now;
+
+    e->lastUsed = now;
+
+    while (!fresh && e->resolving)
+    {
+        unsigned gen = e->gen;
+
+        e->waiters++;
+        pthread_cond_wait(&D->done, &D->mutex);
+        e->waiters--;
+
+        // Take whatever the lookup we waited for found, even if the
+        // TTL is so short it has already expired
+        fresh = e->gen != gen || e->expires > time(NULL);
+    }
+
+    if (!fresh)
+    {
+        e->resolving = 1;
+        pthread_mutex_unlock(&D->mutex);
+
+        rc = D->resolve(host, &addrs);
+
+        pthread_mutex_lock(&D->mutex);
+        dns_store(D, e, rc, &addrs);
+    }
+
+    rc = e->rc;
+    if (rc == 0 && out != NULL)
+        *out = e->addrs;
+
+    pthread_mutex_unlock(&D->mutex);
+    return rc;
+}
+
+/*
+ * dns_getaddrinfo - getaddrinfo answered from the cache. service must
+ * be a port number; only hints->ai_family is honoured. The list must be
+ * freed with dns_freeaddrinfo.
+ */
+int dns_getaddrinfo (dns D, const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res)
+{
+    struct addrinfo *head = NULL, **tail = &head;
+    struct dns_addrs a;
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int port = service ? atoi(service) : 0;
+    int i, rc;
+
+    if ((rc = dns_lookup(D, node, &a)) != 0)
+        return rc;
+
+    for (i = 0; i < a.n; i++)
+    {
+        if (family != AF_UNSPEC && a.addr[i].ss_family != family)
+            continue;
+
+        struct dns_ai *ai = calloc(1, sizeof(struct dns_ai));
+
+        if (ai == NULL)
+        {
+            dns_freeaddrinfo(head);
+            return EAI_MEMORY;
+        }
+
+        memcpy(&ai->ss, &a.addr[i], a.len[i]);
+
+        if (ai->ss.ss_family == AF_INET)
+            ((struct sockaddr_in *)&ai->ss)->sin_port = htons(port);
+        else if (ai->ss.ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&ai->ss)->sin6_port = htons(port);
+
+        ai->ai.ai_family = ai->ss.ss_family;
+        ai->ai.ai_socktype = SOCK_STREAM;
+        ai->ai.ai_protocol = IPPROTO_TCP;
+        ai->ai.ai_addr = (SA *)&ai->ss;
+        ai->ai.ai_addrlen = a.len[i];
+
+        *tail = &ai->ai;
+        tail = &ai->ai.ai_next;
+    }
+
+    if (head == NULL)
+        return EAI_NONAME;
+
+    *res = head;
+    return 0;
+}
+
+/*
+ * dns_freeaddrinfo - free a list returned by dns_getaddrinfo
+ */
+void dns_freeaddrinfo (struct addrinfo *res)
+{
+    while (res != NULL)
+    {
+        struct addrinfo *next = res->ai_next;
+        free(res);
+        res = next;
+    }
+}
+
+/*
+ * dns_system_resolve - the default resolver, getaddrinfo. It honours
+ * /etc/hosts and nsswitch.conf like any other program on the machine.
+ */
+int dns_system_resolve (const char *host, struct dns_addrs *out)
+{
+    struct addrinfo hints, *list, *p;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rc = getaddrinfo(host, NULL, &hints, &list)) != 0)
+        return rc;
+
+    out->n = 0;
+
+    for (p = list; p && out->n < DNS_MAX_ADDRS; p = p->ai_next)
+    {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        memcpy(&out->addr[out->n], p->ai_addr, p->ai_addrlen);
+        out->len[out->n] = p->ai_addrlen;
+        out->n++;
+    }
+
+    freeaddrinfo(list);
+    return out->n > 0 ? 0 : EAI_NONAME;
+}
+
+/*
+ * dns_bucket - djb2 hash of a host name
+ */
+static unsigned dns_bucket (const char *host)
+{
+    unsigned h = 5381;
+
+    while (*host)
+        h = h * 33 + (unsigned char)tolower(*host++);
+
+    return h % DNS_BUCKETS;
+}
+
+/*
+ * dns_entry - find the entry for host, adding an expired one if there
+ * is none. Caller must hold D->mutex.
+ */
+static struct dns_entry *dns_entry (dns D, const char *host)
+{
+    unsigned b = dns_bucket(host);
+    struct dns_entry *e;
+
+    for (e = D->buckets[b]; e; e = e->next)
+    {
+        if (!strcasecmp(e->host, host))
+            return e;
+    }
+
+    e = Calloc(1, sizeof(struct dns_entry));
+    e->host = strdup(host);
+    e->next = D->buckets[b];
+    D->buckets[b] = e;
+
+    return e;
+}
+
+/*
+ * dns_store - record the result of resolving e->host and wake everyone
+ * waiting for it. Caller must hold D->mutex.
+ */
+static void dns_store (dns D, struct dns_entry *e, int rc,
+    struct dns_addrs *addrs)
+{
+    e->rc = rc;
+    if (rc == 0)
+        e->addrs = *addrs;
+
+    e->expires = time(NULL) + (rc == 0 ? D->ttl : D->negTtl);
+    e->resolving = 0;
+    e->gen++;
+
+    pthread_cond_broadcast(&D->done);
+}
+
+/*
+ * dns_refresher - once a second, re-resolve names that are about to
+ * expire but have been used since they were last resolved, and drop
+ * names nobody has asked for in a while, until dns_free. A failed
+ * refresh leaves the old answer in place until it expires.
+ */
+static void *dns_refresher (void *vargp)
+{
+    dns D = (dns)vargp;
+    int window = D->ttl / 2 < DNS_REFRESH ? D->ttl / 2 : DNS_REFRESH;
+    struct dns_entry *e, **link;
+    struct dns_addrs addrs;
+    struct timespec deadline;
+    int b;
+
+    pthread_mutex_lock(&D->mutex);
+
+    while (!D->stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        if (pthread_cond_timedwait(&D->stop, &D->mutex, &deadline)
+            != ETIMEDOUT)
+            continue;
+
+        time_t now = time(NULL);
+
+        for (b = 0; b < DNS_BUCKETS; b++)
+        {
+            link = &D->buckets[b];
+
+            while ((e = *link) != NULL)
+            {
+                int idle = !e->resolving && !e->waiters && e->expires <= now
+                    && now - e->lastUsed > D->ttl + D->negTtl;
+
+                if (idle)
+                {
+                    *link = e->next;
+                    free(e->host);
+                    free(e);
+                    continue;
+                }
+
+                link = &e->next;
+
+                int hot = e->rc == 0 && !e->resolving && e->expires > now
+                    && e->expires - now <= window
+                    && e->lastUsed > e->expires - D->ttl;
+
+                if (!hot)
+                    continue;
+
+                // Entries are only freed by this thread, and never while
+                // resolving, so e outlives the unlocked lookup
+                e->resolving = 1;
+                pthread_mutex_unlock(&D->mutex);
+
+                int rc = D->resolve(e->host, &addrs);
+
+                pthread_mutex_lock(&D->mutex);
+
+                if (rc == 0)
+                    dns_store(D, e, rc, &addrs);
+                else
+                {
+                    e->resolving = 0;
+                    pthread_cond_broadcast(&D->done);
+                }
+
+                now = time(NULL);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&D->mutex);
+    return NULL;
+}
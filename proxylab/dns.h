@@ -0,0 +1,68 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* Defaults, overridable from the command line */
+#define DNS_TTL 60          /* seconds a resolved name is trusted */
+#define DNS_NEG_TTL 5       /* seconds a failed lookup is remembered */
+#define DNS_REFRESH 10      /* hot names are re-resolved this long before
+                               they expire */
+#define DNS_MAX_ADDRS 8
+#define DNS_BUCKETS 256
+
+/* The addresses a name resolved to */
+struct dns_addrs
+{
+    int n;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t len[DNS_MAX_ADDRS];
+};
+
+/* Resolves host into out. Returns 0 or an EAI_* error code. */
+typedef int (*dns_resolver)(const char *host, struct dns_addrs *out);
+
+/* One cached name, positive or negative */
+struct dns_entry
+{
+    char *host;
+    int rc;                     /* result of the last resolution */
+    struct dns_addrs addrs;     /* valid if rc is 0 */
+    time_t expires;
+    time_t lastUsed;
+    int resolving;              /* a lookup for host is in flight */
+    int waiters;                /* threads waiting for that lookup */
+    unsigned gen;               /* bumped whenever a lookup completes */
+    struct dns_entry *next;
+};
+
+/*  A resolver cache shared by all threads. Concurrent misses for the
+    same name wait for a single lookup, and names still being used are
+    refreshed in the background shortly before they expire, so a busy
+    origin never sees a miss. */
+struct dns_header
+{
+    struct dns_entry *buckets[DNS_BUCKETS];
+    int ttl;
+    int negTtl;
+    dns_resolver resolve;
+    int stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;        /* broadcast when any lookup completes */
+    pthread_cond_t stop;        /* wakes the refresher for dns_free */
+    pthread_t refresher;
+};
+typedef struct dns_header *dns;
+
+dns dns_new (int ttl, int negTtl, dns_resolver resolve);
+void dns_free (dns D);
+int dns_lookup (dns D, const char *host, struct dns_addrs *out);
+int dns_getaddrinfo (dns D, const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res);
+void dns_freeaddrinfo (struct addrinfo *res);
+int dns_system_resolve (const char *host, struct dns_addrs *out);
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include "doorkeeper.h"
+
+static int doorkeeper_bit (doorkeeper D, uint64_t hash, int probe);
+static int doorkeeper_test (uint64_t *bits, int bit);
+
+/*
+ * doorkeeper_new - an empty doorkeeper remembering window keys per
+ * generation
+ */
+doorkeeper doorkeeper_new (int window)
+{
+    doorkeeper D = malloc(sizeof(struct doorkeeper_header));
+
+    D->nbits = 64;
+    while (D->nbits < window * DOORKEEPER_BITS_PER_KEY)
+        D->nbits *= 2;
+
+    D->bits[0] = calloc(D->nbits / 64, sizeof(uint64_t));
+    D->bits[1] = calloc(D->nbits / 64, sizeof(uint64_t));
+    D->window = window;
+    D->added = 0;
+    return D;
+}
+
+void doorkeeper_free (doorkeeper D)
+{
+    free (D->bits[0]);
+    free (D->bits[1]);
+    free (D);
+}
+
+/*
+ * doorkeeper_admit - returns 1 if hash was offered before within the
+ * window. Otherwise records it and returns 0.
+ */
+int doorkeeper_admit (doorkeeper D, uint64_t hash)
+{
+    int p;
+
+    if (doorkeeper_seen (D, hash))
+        return 1;
+
+    if (D->added == D->window)
+    {
+        uint64_t *old = D->bits[1];
+        memset (old, 0, D->nbits / 8);
+        D->bits[1] = D->bits[0];
+        D->bits[0] = old;
+        D->added = 0;
+    }
+
+    for (p = 0; p < DOORKEEPER_PROBES; p++)
+    {
+        int bit = doorkeeper_bit (D, hash, p);
+        D->bits[0][bit / 64] |= 1ULL << (bit % 64);
+    }
+    D->added++;
+    return 0;
+}
+
+/*
+ * doorkeeper_seen - whether doorkeeper_admit would admit hash now,
+ * without recording it
+ */
+int doorkeeper_seen (doorkeeper D, uint64_t hash)
+{
+    int seen[2] = { 1, 1 };
+    int p, g;
+
+    for (p = 0; p < DOORKEEPER_PROBES; p++)
+    {
+        int bit = doorkeeper_bit (D, hash, p);
+        for (g = 0; g < 2; g++)
+            seen[g] = seen[g] && doorkeeper_test (D->bits[g], bit);
+    }
+    return seen[0] || seen[1];
+}
+
+/*
+ * doorkeeper_bit - the bit of the probe'th hash function for hash, by
+ * double hashing on a remix of it
+ */
+static int doorkeeper_bit (doorkeeper D, uint64_t hash, int probe)
+{
+    uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+    uint32_t h1 = (uint32_t)(h >> 32);
+    uint32_t h2 = (uint32_t)h | 1;
+
+    return (int)((h1 + probe * h2) & (D->nbits - 1));
+}
+
+static int doorkeeper_test (uint64_t *bits, int bit)
+{
+    return (bits[bit / 64] >> (bit % 64)) & 1;
+}
@@ -0,0 +1,31 @@
+#ifndef DOORKEEPER_H
+#define DOORKEEPER_H
+
+#include <stdint.h>
+
+/* Keys a generation of the filter remembers before it is aged out */
+#define DOORKEEPER_WINDOW 4096
+#define DOORKEEPER_BITS_PER_KEY 10
+#define DOORKEEPER_PROBES 3
+
+/* A doorkeeper admits a key only the second time it is offered within
+   a window, so objects fetched once and never again stay out of the
+   cache. It is two bloom filters over key hashes: keys are recorded in
+   the current one and looked for in both, and once the current one has
+   recorded window keys it becomes the previous one and a cleared filter
+   takes its place. A key is thus remembered for one to two windows. */
+struct doorkeeper_header
+{
+    uint64_t *bits[2];  // the current and the previous generation
+    int nbits;          // a power of two
+    int window;
+    int added;          // keys recorded in the current generation
+};
+typedef struct doorkeeper_header *doorkeeper;
+
+doorkeeper doorkeeper_new (int window);
+void doorkeeper_free (doorkeeper D);
+int doorkeeper_admit (doorkeeper D, uint64_t hash);
+int doorkeeper_seen (doorkeeper D, uint64_t hash);
+
+#endif
@@ -0,0 +1,992 @@
+/*
+ * event.c - event-driven proxy engine
+ *
+ * Every client connection is a small state machine driven by an
+ * edge-triggered epoll loop. Each loop runs on its own thread and either
+ * shares the listening socket with the other loops (EPOLLEXCLUSIVE keeps
+ * them from stampeding on a single connection) or has an SO_REUSEPORT
+ * socket of its own. Sockets are never blocked on, so an idle or slow
+ * client costs its struct conn and nothing else.
+ *
+ * A connection goes through these states:
+ *
+ *   READ_REQUEST  buffering the request until the blank line
+ *   SEND_CACHED   writing a cache hit back to the client
+ *   SEND_FILE     sending a hit in the disk tier with sendfile
+ *   CONNECTING    waiting for a connector thread to reach the web server
+ *   SEND_REQUEST  writing the rewritten request to the web server
+ *   RELAY         copying the response to the client, one buffer at a time,
+ *                 or once it is known not to be cached, splicing it
+ *                 through a pipe without copying it at all
+ *
+ * Parsing, header rewriting and caching are shared with the threaded
+ * engine in proxy.c, so both engines serve identical responses.
+ * Reaching a web server, name resolution included, is handed to a few
+ * connector threads shared by the loops. Each races the server's
+ * addresses with open_clientfd_r (Happy Eyeballs, resolving through
+ * the DNS cache when there is one) and hands the socket back to the
+ * connection's loop through its eventfd, so a slow lookup or a dead
+ * address never holds up a loop.
+ *
+ * event_stop wakes every loop through an eventfd. A loop then stops
+ * accepting and exits once its last connection has closed.
+ */
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "event.h"
+
+enum conn_state
+{
+    READ_REQUEST,
+    SEND_CACHED,
+    SEND_FILE,
+    CONNECTING,
+    SEND_REQUEST,
+    RELAY,
+    CLOSED
+};
+
+struct conn;
+
+/* epoll hands back one of these so we know which socket fired */
+struct endpoint
+{
+    struct conn *c;
+    int isWeb;
+};
+
+struct conn
+{
+    int fd;                 /* client socket */
+    int webfd;              /* web server socket, -1 if not connected */
+    int state;
+    struct endpoint client;
+    struct endpoint web;
+
+    char *in;               /* request bytes read so far */
+    int inLen;
+    int inSize;
+
+    char *head;             /* a hit's head, rewritten, to go before out */
+    int headLen;
+    int headOff;
+
+    char *out;              /* bytes waiting to go to the client or server */
+    int outLen;
+    int outOff;
+
+    char *name;             /* cache key of the request */
+    char *dir;
+    int port;
+
+    web_data hit;           /* pinned cache entry out points into */
+    disk_rec diskHit;       /* pinned disk record being sent */
+    long fileOff;           /* ... and how much of it has gone */
+    web_data cacheBuf;      /* entry the response is copied into */
+    disk_rec diskFill;      /* ... or, once too big for it, disk record */
+    int cacheBufSize;       /* -1 once the response is too big to cache */
+    int pipe[2];            /* splices the rest of it if so, or -1 */
+    int piped;              /* bytes in the pipe */
+
+    struct loop *loop;      /* the loop it belongs to */
+    struct conn *nextConnect; /* on the connect queue, then its loop's
+                                 connected list */
+    struct conn *nextDead;
+};
+
+struct loop
+{
+    int epfd;
+    int listenfd;
+    int wakefd;             /* eventfd event_stop and connectors wake
+                               the loop with */
+    int cpu;                /* CPU to pin the loop to, or -1 */
+    int nconns;             /* connections open */
+    int stopping;           /* no longer accepting */
+    struct conn *dead;      /* closed this round, freed after the batch */
+    struct conn *connected; /* handed back by connectors, under connLock */
+    pthread_mutex_t connLock;
+};
+
+/* The loops, and how many have yet to exit once event_stop is called */
+static struct loop *loops;
+static int nloopsTotal;
+static int nrunning;
+static int stopping;
+static pthread_mutex_t stopLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stopped = PTHREAD_COND_INITIALIZER;
+
+/* epoll's data for a loop's wakefd; the listener's is NULL */
+static struct endpoint wakeup;
+
+/* Connections waiting for a connector thread, oldest first */
+static struct conn *connectHead, *connectTail;
+static pthread_mutex_t connectLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connectReady = PTHREAD_COND_INITIALIZER;
+
+static void *event_loop (void *vargp);
+static void event_accept (struct loop *L);
+static void event_wake (struct loop *L);
+static void *event_connector (void *vargp);
+static void conn_step (struct loop *L, struct conn *c, int isWeb,
+    uint32_t events);
+static int conn_read_request (struct loop *L, struct conn *c);
+static int conn_handle_request (struct loop *L, struct conn *c);
+static int conn_build_request (struct conn *c, struct http_request *req);
+static int conn_relay (struct conn *c);
+static void conn_fill (struct conn *c, int n);
+static int conn_splice (struct conn *c);
+static int conn_flush (int fd, struct conn *c);
+static int conn_hit_head (struct conn *c, const char *data, int headLen,
+    int size, long stored);
+static int conn_send_file (struct conn *c);
+static void conn_close (struct loop *L, struct conn *c);
+static void conn_connect (struct conn *c);
+static void conn_connected (struct loop *L, struct conn *c);
+static int set_nonblocking (int fd);
+
+/*
+ * event_run - serve clients with nloops event loops (one per online CPU
+ * if nloops <= 0). Loop i accepts on listenfds[i % nlisten], so a single
+ * listener is shared by every loop. If pin is set loop i is pinned to
+ * CPU i. Returns once the loops are running; see event_stop.
+ */
+void event_run (int *listenfds, int nlisten, int nloops, int pin)
+{
+    pthread_t tid;
+    int i;
+
+    if (nloops <= 0)
+        nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nloops <= 0)
+        nloops = 1;
+
+    for (i = 0; i < nlisten; i++)
+    {
+        if (set_nonblocking(listenfds[i]) < 0)
+            unix_error("event_run: could not make listener non-blocking");
+    }
+
+    loops = calloc(nloops, sizeof(struct loop));
+    nloopsTotal = nrunning = nloops;
+
+    for (i = 0; i < nloops; i++)
+    {
+        struct epoll_event ev;
+
+        loops[i].listenfd = listenfds[i % nlisten];
+        loops[i].cpu = pin ? i : -1;
+        loops[i].dead = NULL;
+        loops[i].connected = NULL;
+        pthread_mutex_init(&loops[i].connLock, NULL);
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+            unix_error("event_run: epoll_create1");
+        if ((loops[i].wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+            unix_error("event_run: eventfd");
+
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenfd,
+            &ev) < 0)
+            unix_error("event_run: epoll_ctl");
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wakeup;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd,
+            &ev) < 0)
+            unix_error("event_run: epoll_ctl");
+    }
+
+    for (i = 0; i < EVENT_CONNECTORS; i++)
+        Pthread_create(&tid, NULL, event_connector, NULL);
+
+    for (i = 0; i < nloops; i++)
+        Pthread_create(&tid, NULL, event_loop, &loops[i]);
+}
+
+/*
+ * event_stop - stop every loop accepting, and wait up to secs seconds
+ * for the connections they have open to finish. Returns 0 once every
+ * loop has exited and -1 if some are still serving.
+ */
+int event_stop (int secs)
+{
+    struct timespec deadline;
+    uint64_t one = 1;
+    int i, rc = 0, left;
+
+    pthread_mutex_lock(&stopLock);
+    stopping = 1;
+    pthread_mutex_unlock(&stopLock);
+
+    for (i = 0; i < nloopsTotal; i++)
+    {
+        if (write(loops[i].wakefd, &one, sizeof(one)) < 0)
+            fprintf(stderr, "Could not wake event loop %d\n", i);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += secs;
+
+    pthread_mutex_lock(&stopLock);
+    while (nrunning > 0 && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&stopped, &stopLock, &deadline);
+    left = nrunning;
+    pthread_mutex_unlock(&stopLock);
+
+    return left ? -1 : 0;
+}
+
+/*
+ * event_loop - wait for socket readiness and advance the connections
+ * it belongs to. Connections closed while handling a batch are freed
+ * only once the whole batch is done, since a later event in the same
+ * batch may still point at them. Returns once stopped with no
+ * connections left.
+ */
+static void *event_loop (void *vargp)
+{
+    struct loop *L = (struct loop *)vargp;
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    int i, n;
+
+    if (L->cpu >= 0)
+        pin_to_cpu(L->cpu);
+
+    while (1)
+    {
+        if ((n = epoll_wait(L->epfd, events, EVENT_MAX_EVENTS, -1)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("event_loop: epoll_wait");
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            struct endpoint *e = events[i].data.ptr;
+
+            if (e == NULL)
+                event_accept(L);
+            else if (e == &wakeup)
+                event_wake(L);
+            else if (e->c->state != CLOSED)
+                conn_step(L, e->c, e->isWeb, events[i].events);
+        }
+
+        while (L->dead)
+        {
+            struct conn *c = L->dead;
+            L->dead = c->nextDead;
+            free(c);
+        }
+
+        if (L->stopping && L->nconns == 0)
+            break;
+    }
+
+    pthread_mutex_lock(&stopLock);
+    nrunning--;
+    pthread_cond_signal(&stopped);
+    pthread_mutex_unlock(&stopLock);
+    return NULL;
+}
+
+/*
+ * event_wake - L's wakefd fired: carry on with the connections the
+ * connectors have handed back, and if event_stop was called, stop
+ * accepting new ones
+ */
+static void event_wake (struct loop *L)
+{
+    struct conn *c;
+    uint64_t n;
+
+    if (read(L->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        return;
+
+    pthread_mutex_lock(&L->connLock);
+    c = L->connected;
+    L->connected = NULL;
+    pthread_mutex_unlock(&L->connLock);
+
+    while (c)
+    {
+        struct conn *next = c->nextConnect;
+        conn_connected(L, c);
+        c = next;
+    }
+
+    pthread_mutex_lock(&stopLock);
+    L->stopping = stopping;
+    pthread_mutex_unlock(&stopLock);
+
+    if (L->stopping)
+        epoll_ctl(L->epfd, EPOLL_CTL_DEL, L->listenfd, NULL);
+}
+
+/*
+ * event_connector - connect the connections on the connect queue to
+ * their web servers one at a time, for as long as the proxy runs, and
+ * hand each back to its loop whether or not that worked
+ */
+static void *event_connector (void *vargp)
+{
+    uint64_t one = 1;
+    int on = 1;
+
+    pthread_detach(pthread_self());
+
+    while (1)
+    {
+        pthread_mutex_lock(&connectLock);
+        while (connectHead == NULL)
+            pthread_cond_wait(&connectReady, &connectLock);
+
+        struct conn *c = connectHead;
+        if ((connectHead = c->nextConnect) == NULL)
+            connectTail = NULL;
+        pthread_mutex_unlock(&connectLock);
+
+        // Nagle off as in connpool_get
+        if ((c->webfd = open_clientfd_r(c->name, c->port)) >= 0
+            && (set_nonblocking(c->webfd) < 0
+            || setsockopt(c->webfd, IPPROTO_TCP, TCP_NODELAY, &on,
+            sizeof(on)) < 0))
+        {
+            close(c->webfd);
+            c->webfd = -1;
+        }
+
+        struct loop *L = c->loop;
+
+        pthread_mutex_lock(&L->connLock);
+        c->nextConnect = L->connected;
+        L->connected = c;
+        pthread_mutex_unlock(&L->connLock);
+
+        if (write(L->wakefd, &one, sizeof(one)) < 0)
+            fprintf(stderr, "Could not wake event loop\n");
+    }
+
+    return NULL;
+}
+
+/*
+ * event_accept - accept every pending connection and start reading
+ * its request
+ */
+static void event_accept (struct loop *L)
+{
+    struct epoll_event ev;
+    int fd;
+
+    while ((fd = accept4(L->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        struct conn *c = calloc(1, sizeof(struct conn));
+
+        if (c == NULL)
+        {
+            fprintf(stderr, "Memory allocation error\n");
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->webfd = -1;
+        c->loop = L;
+        c->pipe[0] = c->pipe[1] = -1;
+        c->state = READ_REQUEST;
+        c->client.c = c;
+        c->client.isWeb = 0;
+        c->web.c = c;
+        c->web.isWeb = 1;
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &c->client;
+
+        if (epoll_ctl(L->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        L->nconns++;
+
+        // Data may have arrived with the handshake
+        conn_step(L, c, 0, EPOLLIN);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr, "Could not accept client connection.\n");
+}
+
+/*
+ * conn_step - advance c as far as its sockets allow. isWeb and events
+ * describe the readiness notification that triggered the step.
+ */
+static void conn_step (struct loop *L, struct conn *c, int isWeb,
+    uint32_t events)
+{
+    int rc = 0;
+
+    switch (c->state)
+    {
+    case READ_REQUEST:
+        if (!isWeb)
+            rc = conn_read_request(L, c);
+        break;
+
+    case SEND_CACHED:
+        if ((rc = conn_flush(c->fd, c)) == 1)
+            rc = -1;    /* whole response sent */
+        break;
+
+    case SEND_FILE:
+        if ((rc = conn_send_file(c)) == 1)
+            rc = -1;
+        break;
+
+    case CONNECTING:
+        // A connector has it until conn_connected
+        break;
+
+    case SEND_REQUEST:
+        if ((rc = conn_flush(c->webfd, c)) != 1)
+            break;
+
+        c->state = RELAY;
+        c->outLen = c->outOff = 0;
+        /* fall through */
+
+    case RELAY:
+        rc = conn_relay(c);
+        break;
+    }
+
+    if (rc < 0)
+        conn_close(L, c);
+}
+
+/*
+ * conn_read_request - read whatever the client has sent and handle the
+ * request once the header block is complete. Returns -1 if the
+ * connection should be closed.
+ */
+static int conn_read_request (struct loop *L, struct conn *c)
+{
+    int n;
+
+    while (1)
+    {
+        if (c->inLen == c->inSize)
+        {
+            if (c->inSize == EVENT_MAX_REQUEST)
+            {
+                clienterror(c->fd, "GET", "400", "Bad Request",
+                    "Request header too large");
+                return -1;
+            }
+
+            int newSize = c->inSize ? 2 * c->inSize : 1024;
+            if (newSize > EVENT_MAX_REQUEST)
+                newSize = EVENT_MAX_REQUEST;
+
+            char *newIn = realloc(c->in, newSize + 1);
+            if (newIn == NULL)
+                return -1;
+            c->in = newIn;
+            c->inSize = newSize;
+        }
+
+        n = read(c->fd, c->in + c->inLen, c->inSize - c->inLen);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        if (n == 0)
+            return -1;
+
+        // Only the newly read bytes (plus 3 for a split "\r\n\r\n") can
+        // complete the header block
+        int from = c->inLen > 3 ? c->inLen - 3 : 0;
+        c->inLen += n;
+        c->in[c->inLen] = '\0';
+
+        if (strstr(c->in + from, "\r\n\r\n"))
+            return conn_handle_request(L, c);
+    }
+}
+
+/*
+ * conn_handle_request - parse the buffered request, then either start
+ * sending the cached response or start connecting to the web server.
+ * Returns -1 if the connection should be closed.
+ */
+static int conn_handle_request (struct loop *L, struct conn *c)
+{
+    char method[MAXLINE], name[MAXLINE], dir[MAXLINE];
+    struct client_hdrs h;
+    struct http_request req;
+
+    if (http_parse_request(c->in, c->inLen, &req) <= 0)
+    {
+        clienterror(c->fd, "GET", "400", "Bad Request",
+            "Invalid syntax: every line must end with \\r\\n");
+        return -1;
+    }
+
+    if (parse_request(c->fd, &req, method, name, dir, &c->port, &h) == -1)
+        return -1;
+
+    if (verbose)
+        printf("Request: %s %s %d\n", name, dir, c->port);
+
+    c->name = strdup(name);
+    c->dir = strdup(dir);
+
+    /* Serve from the cache if we can */
+
+    if ((c->hit = retrieve_cache(name, dir, c->port)) != NULL)
+    {
+        // Sent straight from the entry, which stays pinned until
+        // conn_close, unless it is compressed: then from a copy
+        // unpacked into a buffer of our own
+        int headSize = c->hit->head_size;
+        long stored = c->hit->stored;
+
+        c->out = c->hit->data;
+        c->outLen = c->hit->data_size;
+
+        if (c->hit->plain_size)
+        {
+            if ((c->out = malloc(c->hit->plain_size)) != NULL)
+                c->outLen = web_data_unpack(c->hit, c->out);
+            web_data_release(c->hit);
+            c->hit = NULL;
+
+            if (c->out == NULL || c->outLen < 0)
+                return -1;
+        }
+
+        // The stored head is skipped for a rewritten one, sent first
+        c->outOff = conn_hit_head(c, c->out, headSize, c->outLen, stored);
+        c->state = SEND_CACHED;
+
+        int rc = conn_flush(c->fd, c);
+        return rc == 1 ? -1 : rc;
+    }
+
+    /* Or from the disk tier, kernel to socket */
+
+    if ((c->diskHit = retrieve_disk(name, dir, c->port)) != NULL)
+    {
+        c->fileOff = conn_hit_head(c, disk_data(c->diskHit),
+            disk_head_size(c->diskHit), c->diskHit->dataSize,
+            c->diskHit->stored);
+        c->state = SEND_FILE;
+
+        int rc = conn_send_file(c);
+        return rc == 1 ? -1 : rc;
+    }
+
+    /* Otherwise connect to the web server */
+
+    if (conn_build_request(c, &req) == -1)
+    {
+        clienterror(c->fd, method, "400", "Bad Request",
+            "Request header too large");
+        return -1;
+    }
+
+    c->state = CONNECTING;
+    conn_connect(c);
+    return 0;
+}
+
+/*
+ * conn_build_request - fill c->out with the request line, the headers of
+ * req that forward_header keeps, and the proxy's own headers. Also
+ * allocates the relay and cache buffers. Returns -1 if the request does
+ * not fit.
+ */
+static int conn_build_request (struct conn *c, struct http_request *req)
+{
+    struct client_hdrs h;
+    int size = c->inLen + MAXLINE;
+    int i;
+
+    h.hostSpecified = 0;
+    h.keepAlive = 0;
+
+    if (size < EVENT_BUFSIZE)
+        size = EVENT_BUFSIZE;
+    if ((c->out = malloc(size)) == NULL)
+        return -1;
+
+    int len = snprintf(c->out, size, "GET /%s HTTP/1.0\r\n", c->dir);
+    if (len >= size)
+        return -1;
+
+    for (i = 0; i < req->nheaders; i++)
+    {
+        struct http_header *hd = &req->headers[i];
+
+        if (!forward_header(hd, &h))
+            continue;
+
+        if (len + hd->line.len > size)
+            return -1;
+
+        memcpy(c->out + len, hd->line.p, hd->line.len);
+        len += hd->line.len;
+    }
+
+    int n = format_proxyheaders(c->out + len, size - len - 2,
+        h.hostSpecified, c->name, 0);
+    if (n < 0)
+        return -1;
+    len += n;
+
+    memcpy(c->out + len, "\r\n", 2);
+    c->outLen = len + 2;
+    c->outOff = 0;
+
+    if (verbose)
+        printf("New Request:\n%.*s", c->outLen, c->out);
+
+    c->cacheBuf = web_data_alloc(c->name, c->dir, c->port,
+        MAX_OBJECT_SIZE);
+    c->cacheBufSize = c->cacheBuf ? 0 : -1;
+    return 0;
+}
+
+/*
+ * conn_relay - alternately drain c->out to the client and refill it
+ * from the web server until one of them would block. Caches the
+ * response when the web server closes. Returns -1 if the connection
+ * should be closed (including when the response is complete).
+ */
+static int conn_relay (struct conn *c)
+{
+    int rc, n;
+
+    while (1)
+    {
+        if ((rc = conn_flush(c->fd, c)) != 1)
+            return rc;
+
+        if (c->cacheBufSize == -1)
+            return conn_splice(c);
+
+        n = read(c->webfd, c->out, EVENT_BUFSIZE);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            if (c->diskFill != NULL
+                && c->cacheBufSize == c->diskFill->dataSize)
+            {
+                disk_commit(c->diskFill);
+                c->diskFill = NULL;
+            }
+
+            else if (c->diskFill == NULL && c->cacheBufSize != -1)
+            {
+                c->cacheBuf->data_size = c->cacheBufSize;
+                store_cache(c->cacheBuf);
+                c->cacheBuf = NULL;
+            }
+            return -1;
+        }
+
+        c->outLen = n;
+        c->outOff = 0;
+
+        if (c->cacheBufSize != -1)
+            conn_fill(c, n);
+    }
+}
+
+/*
+ * conn_fill - copy the n bytes just read into c->out to the entry being
+ * cached, moving it to the disk tier if it outgrows MAX_OBJECT_SIZE, or
+ * give up on caching the response if it can't go there either
+ */
+static void conn_fill (struct conn *c, int n)
+{
+    if (c->diskFill == NULL && c->cacheBufSize + n > MAX_OBJECT_SIZE)
+    {
+        if ((c->diskFill = spill_to_disk(c->name, c->dir, c->port,
+            c->cacheBuf->data, c->cacheBufSize)) == NULL)
+        {
+            c->cacheBufSize = -1;
+            return;
+        }
+        free(c->cacheBuf);
+        c->cacheBuf = NULL;
+    }
+
+    if (c->diskFill != NULL)
+    {
+        if (c->cacheBufSize + n <= c->diskFill->dataSize)
+        {
+            memcpy(disk_data(c->diskFill) + c->cacheBufSize, c->out, n);
+            c->cacheBufSize += n;
+        }
+        else
+            c->cacheBufSize = -1;
+    }
+
+    else
+    {
+        memcpy(c->cacheBuf->data + c->cacheBufSize, c->out, n);
+        c->cacheBufSize += n;
+    }
+}
+
+/*
+ * conn_splice - relay the rest of a response that is not being cached
+ * from the web server to the client through a pipe, so it is never
+ * copied into user space. Returns 0 if a socket would block, and -1 on
+ * error or once the web server closes.
+ */
+static int conn_splice (struct conn *c)
+{
+    ssize_t n;
+
+    if (c->pipe[0] < 0 && pipe2(c->pipe, O_NONBLOCK) < 0)
+        return -1;
+
+    while (1)
+    {
+        // Drain the pipe before filling it again
+        if (c->piped > 0)
+            n = splice(c->pipe[0], NULL, c->fd, NULL, c->piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            n = splice(c->webfd, NULL, c->pipe[1], NULL, SPLICE_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        if (c->piped > 0)
+            c->piped -= n;
+        else if (n == 0)
+            return -1;
+        else
+            c->piped = n;
+    }
+}
+
+/*
+ * conn_flush - write the rest of c->head and then of c->out to fd, both
+ * in one call if fd takes them. Returns 1 once they have all been
+ * written, 0 if fd would block, and -1 on error.
+ */
+static int conn_flush (int fd, struct conn *c)
+{
+    struct iovec iov[2];
+    int n, cnt;
+
+    while (c->headOff < c->headLen || c->outOff < c->outLen)
+    {
+        cnt = 0;
+        if (c->headOff < c->headLen)
+        {
+            iov[cnt].iov_base = c->head + c->headOff;
+            iov[cnt++].iov_len = c->headLen - c->headOff;
+        }
+        iov[cnt].iov_base = c->out + c->outOff;
+        iov[cnt++].iov_len = c->outLen - c->outOff;
+
+        n = writev(fd, iov, cnt);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        if (c->headOff + n > c->headLen)
+        {
+            c->outOff += n - (c->headLen - c->headOff);
+            c->headOff = c->headLen;
+        }
+        else
+            c->headOff += n;
+    }
+
+    return 1;
+}
+
+/*
+ * conn_hit_head - set c->head to the client's version of the headLen
+ * byte head of a cached response of size bytes at data, cached at time
+ * stored (see format_response_head). The connection is closed after
+ * the response, so says so. Returns where in data the body starts, or
+ * 0 if the head can't be rewritten and the response is sent as is.
+ */
+static int conn_hit_head (struct conn *c, const char *data, int headLen,
+    int size, long stored)
+{
+    struct response_info r;
+
+    if (headLen <= 0 || (c->head = malloc(MAX_HEAD + MAXLINE)) == NULL)
+        return 0;
+
+    c->headLen = format_response_head(c->head, data, headLen,
+        size - headLen, 0, time(NULL) - stored, &r);
+    c->headOff = 0;
+
+    if (c->headLen < 0)
+    {
+        c->headLen = 0;
+        return 0;
+    }
+    return headLen;
+}
+
+/*
+ * conn_send_file - sendfile the rest of c's disk record to the client.
+ * Returns 1 once it has all gone, 0 if the socket is full, -1 on error.
+ */
+static int conn_send_file (struct conn *c)
+{
+    long end = c->diskHit->dataSize;
+    int rc;
+
+    // Its rewritten head goes first
+    if ((rc = conn_flush(c->fd, c)) != 1)
+        return rc;
+
+    if (disk_sendfile(c->diskHit, c->fd, &c->fileOff, end) < 0
+        && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+
+    return c->fileOff == end;
+}
+
+/*
+ * conn_close - close c's sockets and release its buffers. The struct
+ * itself is freed by event_loop at the end of the current batch.
+ */
+static void conn_close (struct loop *L, struct conn *c)
+{
+    close(c->fd);
+    if (c->webfd >= 0)
+        close(c->webfd);
+
+    free(c->in);
+    free(c->head);
+    if (c->hit)
+        web_data_release(c->hit);
+    else
+        free(c->out);
+    if (c->diskHit)
+        disk_release(c->diskHit);
+    free(c->name);
+    free(c->dir);
+    free(c->cacheBuf);
+    if (c->diskFill)
+        disk_abort(c->diskFill);
+    if (c->pipe[0] >= 0)
+    {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+
+    c->state = CLOSED;
+    c->nextDead = L->dead;
+    L->dead = c;
+    L->nconns--;
+}
+
+/*
+ * conn_connect - queue c for a connector thread to connect it to its web
+ * server. c stays in CONNECTING until its loop gets it back.
+ */
+static void conn_connect (struct conn *c)
+{
+    c->nextConnect = NULL;
+
+    pthread_mutex_lock(&connectLock);
+    if (connectTail)
+        connectTail->nextConnect = c;
+    else
+        connectHead = c;
+    connectTail = c;
+    pthread_cond_signal(&connectReady);
+    pthread_mutex_unlock(&connectLock);
+}
+
+/*
+ * conn_connected - a connector is done with c: send its request if it
+ * got a connection to the web server, or tell the client it didn't
+ */
+static void conn_connected (struct loop *L, struct conn *c)
+{
+    struct epoll_event ev;
+
+    if (c->webfd < 0)
+    {
+        clienterror(c->fd, "GET", "502", "Bad Gateway",
+            "Proxy could not connect to web server");
+        fprintf(stderr, "Error connecting to web server\n");
+        conn_close(L, c);
+        return;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->web;
+
+    if (epoll_ctl(L->epfd, EPOLL_CTL_ADD, c->webfd, &ev) < 0)
+    {
+        conn_close(L, c);
+        return;
+    }
+
+    c->state = SEND_REQUEST;
+    conn_step(L, c, 1, EPOLLOUT);
+}
+
+/* Put fd in non-blocking mode. Returns -1 on error. */
+static int set_nonblocking (int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
@@ -0,0 +1,15 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/* Largest request header block the event engine will buffer */
+#define EVENT_MAX_REQUEST (8 * MAXLINE)
+/* Size of the relay buffer each connection uses once a request is parsed */
+#define EVENT_BUFSIZE (2 * MAXLINE)
+#define EVENT_MAX_EVENTS 256
+/* Threads connecting to web servers on behalf of all the loops */
+#define EVENT_CONNECTORS 16
+
+void event_run (int *listenfds, int nlisten, int nloops, int pin);
+int event_stop (int secs);
+
+#endif
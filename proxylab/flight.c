@@ -0,0 +1,378 @@
+#include "csapp.h"
+#include "flight.h"
+
+static unsigned flight_bucket (char *name, char *dir, int port);
+static void flight_unlink (flights F, struct flight *f);
+static long flight_low (struct flight *f);
+static void flight_wait_readers (struct flight *f, pthread_mutex_t *mutex);
+static void flight_trim (struct flight *f);
+static void flight_unref (struct flight *f);
+
+/*
+ * flights_new - create an empty table of in-flight fetches
+ */
+flights flights_new (void)
+{
+    flights F = calloc(1, sizeof(struct flights_header));
+
+    pthread_mutex_init(&F->mutex, NULL);
+
+    return F;
+}
+
+/*
+ * flight_join - join the fetch of name, dir, port. If there is none,
+ * start one and return it: the caller leads, must append the response
+ * with flight_append as it arrives and then call flight_land. If there
+ * is one, attach to it as a follower, set *reader and return NULL; the
+ * follower reads with flight_read and finishes with flight_leave.
+ * *reader is NULL for leaders.
+ */
+struct flight *flight_join (flights F, char *name, char *dir, int port,
+    struct flight_reader **reader)
+{
+    unsigned b = flight_bucket(name, dir, port);
+    struct flight *f;
+
+    pthread_mutex_lock(&F->mutex);
+
+    for (f = F->buckets[b]; f; f = f->next)
+    {
+        if (f->port == port && !strcmp(f->name, name)
+            && !strcmp(f->dir, dir))
+            break;
+    }
+
+    if (f != NULL)
+    {
+        struct flight_reader *r = Malloc(sizeof(struct flight_reader));
+        r->f = f;
+        r->pos = 0;
+        r->cut = 0;
+        r->next = f->readers;
+        f->readers = r;
+        f->refs++;
+
+        pthread_mutex_unlock(&F->mutex);
+        *reader = r;
+        return NULL;
+    }
+
+    f = Calloc(1, sizeof(struct flight));
+    f->name = strdup(name);
+    f->dir = strdup(dir);
+    f->port = port;
+    f->open = 1;
+    f->refs = 1;
+    pthread_cond_init(&f->grew, NULL);
+    pthread_cond_init(&f->read, NULL);
+    f->next = F->buckets[b];
+    F->buckets[b] = f;
+
+    pthread_mutex_unlock(&F->mutex);
+    *reader = NULL;
+    return f;
+}
+
+/*
+ * flight_append - add len bytes of the response to f and wake its
+ * followers. Once the response outgrows FLIGHT_MAX_SIZE no one else
+ * may attach, and the next miss for the object starts a new flight;
+ * from then on the leader may wait for followers that lag behind.
+ */
+void flight_append (flights F, struct flight *f, const char *data, int len)
+{
+    pthread_mutex_lock(&F->mutex);
+
+    if (f->open && f->total + len > FLIGHT_MAX_SIZE)
+        flight_unlink(F, f);
+
+    if (!f->open)
+        flight_wait_readers(f, &F->mutex);
+
+    while (len > 0)
+    {
+        struct flight_chunk *c = f->tail;
+
+        // Nobody will ever read these bytes
+        if (!f->open && f->readers == NULL)
+        {
+            f->total += len;
+            break;
+        }
+
+        if (c == NULL || c->len == FLIGHT_CHUNK)
+        {
+            c = Malloc(sizeof(struct flight_chunk));
+            c->off = f->total;
+            c->len = 0;
+            c->next = NULL;
+
+            if (f->tail)
+                f->tail->next = c;
+            else
+                f->head = c;
+            f->tail = c;
+        }
+
+        int n = FLIGHT_CHUNK - c->len < len ? FLIGHT_CHUNK - c->len : len;
+        memcpy(c->data + c->len, data, n);
+        c->len += n;
+        f->total += n;
+        data += n;
+        len -= n;
+    }
+
+    flight_trim(f);
+    pthread_cond_broadcast(&f->grew);
+    pthread_mutex_unlock(&F->mutex);
+}
+
+/*
+ * flight_land - called by the leader once its fetch is over. complete
+ * is 0 if the response was cut short. Later misses start a new flight
+ * (or, more likely, hit the cache).
+ */
+void flight_land (flights F, struct flight *f, int complete)
+{
+    pthread_mutex_lock(&F->mutex);
+
+    if (f->open)
+        flight_unlink(F, f);
+
+    f->landed = 1;
+    f->complete = complete;
+    pthread_cond_broadcast(&f->grew);
+    flight_unref(f);
+
+    pthread_mutex_unlock(&F->mutex);
+}
+
+/*
+ * flight_followed - whether anyone may still read more of f: followers
+ * are reading it, or it is still open for them to attach (until it
+ * outgrows FLIGHT_MAX_SIZE). Once it is not, the leader need not keep
+ * appending.
+ */
+int flight_followed (flights F, struct flight *f)
+{
+    int followed;
+
+    pthread_mutex_lock(&F->mutex);
+    followed = f->open || f->readers != NULL;
+    pthread_mutex_unlock(&F->mutex);
+
+    return followed;
+}
+
+/*
+ * flight_read - copy up to n bytes of the response from the follower's
+ * position into buf, waiting for them to arrive. Returns the number of
+ * bytes copied, 0 at the end of a complete response and -1 if the
+ * leader failed or stalled for FLIGHT_WAIT_SECS, or cut the follower off
+ * for lagging.
+ */
+int flight_read (flights F, struct flight_reader *r, char *buf, int n)
+{
+    struct flight *f = r->f;
+    struct flight_chunk *c;
+    struct timespec deadline;
+    int rc = -1;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_WAIT_SECS;
+
+    pthread_mutex_lock(&F->mutex);
+
+    while (r->pos >= f->total && !f->landed && !r->cut)
+    {
+        if (pthread_cond_timedwait(&f->grew, &F->mutex, &deadline)
+            == ETIMEDOUT)
+            break;
+    }
+
+    if (r->cut)
+        ;
+
+    else if (r->pos < f->total)
+    {
+        for (c = f->head; c->off + c->len <= r->pos; c = c->next)
+            ;
+
+        int skip = (int)(r->pos - c->off);
+        rc = c->len - skip < n ? c->len - skip : n;
+        memcpy(buf, c->data + skip, rc);
+        r->pos += rc;
+
+        flight_trim(f);
+        if (!f->open)
+            pthread_cond_signal(&f->read);
+    }
+
+    else if (f->landed && f->complete)
+        rc = 0;
+
+    pthread_mutex_unlock(&F->mutex);
+    return rc;
+}
+
+/*
+ * flight_leave - detach a follower from its flight
+ */
+void flight_leave (flights F, struct flight_reader *r)
+{
+    struct flight *f = r->f;
+    struct flight_reader **link;
+
+    pthread_mutex_lock(&F->mutex);
+
+    if (!r->cut)
+    {
+        for (link = &f->readers; *link != r; link = &(*link)->next)
+            ;
+        *link = r->next;
+        pthread_cond_signal(&f->read);
+    }
+    free(r);
+
+    flight_trim(f);
+    flight_unref(f);
+
+    pthread_mutex_unlock(&F->mutex);
+}
+
+/*
+ * flight_bucket - djb2 hash of name, dir and port
+ */
+static unsigned flight_bucket (char *name, char *dir, int port)
+{
+    unsigned h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    while (*dir)
+        h = h * 33 + (unsigned char)*dir++;
+
+    return (h * 33 + port) % FLIGHT_BUCKETS;
+}
+
+/*
+ * flight_unlink - take f out of the table so no one else attaches.
+ * Caller must hold F->mutex.
+ */
+static void flight_unlink (flights F, struct flight *f)
+{
+    unsigned b = flight_bucket(f->name, f->dir, f->port);
+    struct flight **link;
+
+    for (link = &F->buckets[b]; *link != f; link = &(*link)->next)
+        ;
+    *link = f->next;
+    f->open = 0;
+}
+
+/*
+ * flight_low - the position of f's slowest follower, or f->total if it
+ * has none. Caller must hold F->mutex.
+ */
+static long flight_low (struct flight *f)
+{
+    struct flight_reader *r;
+    long low = f->total;
+
+    for (r = f->readers; r; r = r->next)
+    {
+        if (r->pos < low)
+            low = r->pos;
+    }
+    return low;
+}
+
+/*
+ * flight_wait_readers - hold the leader of f, which no one can attach to
+ * any more, while its slowest follower is over FLIGHT_MAX_LAG behind,
+ * until FLIGHT_LAG_SECS after it first had to; then cut off every
+ * follower still that far behind. A cut follower is taken off f->readers, so the chunks it held
+ * can be freed and, once no one is left, the leader may stop copying.
+ * Caller holds mutex, F->mutex.
+ */
+static void flight_wait_readers (struct flight *f, pthread_mutex_t *mutex)
+{
+    struct flight_reader *r, **link;
+
+    if (f->total - flight_low(f) <= FLIGHT_MAX_LAG)
+        return;
+
+    if (f->lagDeadline.tv_sec == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &f->lagDeadline);
+        f->lagDeadline.tv_sec += FLIGHT_LAG_SECS;
+    }
+
+    while (f->total - flight_low(f) > FLIGHT_MAX_LAG)
+    {
+        if (pthread_cond_timedwait(&f->read, mutex, &f->lagDeadline)
+            == ETIMEDOUT)
+            break;
+    }
+
+    for (link = &f->readers; (r = *link) != NULL; )
+    {
+        if (f->total - r->pos > FLIGHT_MAX_LAG)
+        {
+            *link = r->next;
+            r->cut = 1;
+        }
+        else
+            link = &r->next;
+    }
+
+    // Wake any cut follower waiting in flight_read
+    pthread_cond_broadcast(&f->grew);
+}
+
+/*
+ * flight_trim - once no one else can attach to f, free the chunks every
+ * follower has read past. The tail chunk is kept for the leader to fill.
+ * Caller must hold F->mutex.
+ */
+static void flight_trim (struct flight *f)
+{
+    long low;
+
+    if (f->open)
+        return;
+
+    low = flight_low(f);
+
+    while (f->head && f->head != f->tail
+        && f->head->off + f->head->len <= low)
+    {
+        struct flight_chunk *c = f->head;
+        f->head = c->next;
+        free(c);
+    }
+}
+
+/*
+ * flight_unref - drop one reference to f, freeing it after the last.
+ * Caller must hold F->mutex.
+ */
+static void flight_unref (struct flight *f)
+{
+    if (--f->refs > 0)
+        return;
+
+    while (f->head)
+    {
+        struct flight_chunk *c = f->head;
+        f->head = c->next;
+        free(c);
+    }
+
+    pthread_cond_destroy(&f->grew);
+    pthread_cond_destroy(&f->read);
+    free(f->name);
+    free(f->dir);
+    free(f);
+}
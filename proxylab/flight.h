@@ -0,0 +1,82 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <pthread.h>
+
+/* Followers give up on a leader that sends nothing for this long */
+#define FLIGHT_WAIT_SECS 30
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_CHUNK (64 * 1024)
+/* Followers may attach until this much of a response has arrived. Past
+   it, chunks every follower has read are freed. */
+#define FLIGHT_MAX_SIZE (8 * 1024 * 1024)
+/* Past FLIGHT_MAX_SIZE the leader keeps no further ahead of its slowest
+   follower than this. It waits for followers to catch up for at most
+   FLIGHT_LAG_SECS over the whole fetch, then cuts off any that lag, so a
+   slow client can neither pin the response in memory nor hold the fetch
+   back for long. */
+#define FLIGHT_MAX_LAG (16 * FLIGHT_CHUNK)
+#define FLIGHT_LAG_SECS 5
+
+/* Part of a response, starting off bytes into it */
+struct flight_chunk
+{
+    long off;
+    int len;
+    struct flight_chunk *next;
+    char data[FLIGHT_CHUNK];
+};
+
+struct flight;
+
+/* A follower's place in a flight */
+struct flight_reader
+{
+    struct flight *f;
+    long pos;
+    int cut;                /* fell too far behind and was dropped */
+    struct flight_reader *next;
+};
+
+/* A fetch from a web server whose response other requests are reading
+   as it arrives */
+struct flight
+{
+    char *name;
+    char *dir;
+    int port;
+    int open;               /* still in the table; followers may attach */
+    int landed;             /* the leader has finished */
+    int complete;           /* ... and got the whole response */
+    long total;             /* response bytes appended so far */
+    struct flight_chunk *head, *tail;
+    struct flight_reader *readers;
+    int refs;               /* the leader, if still flying, and readers */
+    pthread_cond_t grew;    /* signalled when bytes arrive or it lands */
+    pthread_cond_t read;    /* signalled when a follower reads or leaves */
+    struct timespec lagDeadline; /* when the leader stops waiting */
+    struct flight *next;
+};
+
+/*  Requests currently being fetched, keyed by server name, directory and
+    port. The first request to miss the cache for a key leads the fetch
+    and appends the raw response as it relays it; later ones follow,
+    tailing that response for their own clients instead of asking the
+    web server again. */
+struct flights_header
+{
+    struct flight *buckets[FLIGHT_BUCKETS];
+    pthread_mutex_t mutex;
+};
+typedef struct flights_header *flights;
+
+flights flights_new (void);
+struct flight *flight_join (flights F, char *name, char *dir, int port,
+    struct flight_reader **reader);
+void flight_append (flights F, struct flight *f, const char *data, int len);
+void flight_land (flights F, struct flight *f, int complete);
+int flight_followed (flights F, struct flight *f);
+int flight_read (flights F, struct flight_reader *r, char *buf, int n);
+void flight_leave (flights F, struct flight_reader *r);
+
+#endif
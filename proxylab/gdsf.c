@@ -0,0 +1,163 @@
+#include "policy.h"
+
+/* Bytes per packet, for the cost of fetching an entry again */
+#define GDSF_PACKET 1460
+
+/*
+ * GreedyDual-Size-Frequency: each entry is worth
+ *
+ *     H = L + uses * cost / size
+ *
+ * and the entry with the lowest H is evicted, raising the clock L to its
+ * H so that entries which stop being used age out. The cost of an entry
+ * is the number of packets it takes to fetch again, so small entries are
+ * kept for their hit ratio while the large ones still used often enough
+ * are kept for the origin traffic they save. Entries are kept in a
+ * binary min-heap on H.
+ */
+struct gdsf
+{
+    web_data *heap;
+    int count;
+    int cap;
+    double clock;   // L
+};
+
+static void gdsf_set (struct gdsf *G, int i, web_data w);
+static void gdsf_up (struct gdsf *G, int i);
+static void gdsf_down (struct gdsf *G, int i);
+static double gdsf_priority (struct gdsf *G, web_data w);
+
+static void *gdsf_new (int capacity)
+{
+    struct gdsf *G = calloc(1, sizeof(struct gdsf));
+
+    G->cap = 64;
+    G->heap = malloc(G->cap * sizeof(web_data));
+    return G;
+}
+
+static void gdsf_free (void *P)
+{
+    struct gdsf *G = P;
+
+    free (G->heap);
+    free (G);
+}
+
+static void gdsf_access (void *P, uint64_t hash)
+{
+}
+
+static void gdsf_hit (void *P, web_data w)
+{
+    struct gdsf *G = P;
+
+    // H only grows, since L never goes down
+    w->freq++;
+    w->priority = gdsf_priority (G, w);
+    gdsf_down (G, w->pos);
+}
+
+static void gdsf_insert (void *P, web_data w)
+{
+    struct gdsf *G = P;
+
+    if (G->count == G->cap)
+    {
+        G->cap *= 2;
+        G->heap = realloc(G->heap, G->cap * sizeof(web_data));
+    }
+
+    w->freq = 1;
+    w->priority = gdsf_priority (G, w);
+    gdsf_set (G, G->count++, w);
+    gdsf_up (G, w->pos);
+}
+
+static web_data gdsf_evict (void *P)
+{
+    struct gdsf *G = P;
+    web_data w = G->heap[0];
+
+    G->clock = w->priority;
+    if (--G->count > 0)
+    {
+        gdsf_set (G, 0, G->heap[G->count]);
+        gdsf_down (G, 0);
+    }
+    return w;
+}
+
+/*
+ * gdsf_priority - H of w at the current clock
+ */
+static double gdsf_priority (struct gdsf *G, web_data w)
+{
+    double size = web_data_size (w);
+    double cost = 1 + w->data_size / GDSF_PACKET;
+
+    return G->clock + w->freq * cost / size;
+}
+
+/*
+ * gdsf_set - put w at place i of the heap
+ */
+static void gdsf_set (struct gdsf *G, int i, web_data w)
+{
+    G->heap[i] = w;
+    w->pos = i;
+}
+
+static void gdsf_up (struct gdsf *G, int i)
+{
+    web_data w = G->heap[i];
+
+    while (i > 0 && G->heap[(i - 1) / 2]->priority > w->priority)
+    {
+        gdsf_set (G, i, G->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    gdsf_set (G, i, w);
+}
+
+static void gdsf_down (struct gdsf *G, int i)
+{
+    web_data w = G->heap[i];
+
+    for (;;)
+    {
+        int c = 2 * i + 1;
+
+        if (c >= G->count)
+            break;
+        if (c + 1 < G->count
+            && G->heap[c + 1]->priority < G->heap[c]->priority)
+            c++;
+        if (G->heap[c]->priority >= w->priority)
+            break;
+
+        gdsf_set (G, i, G->heap[c]);
+        i = c;
+    }
+    gdsf_set (G, i, w);
+}
+
+static void gdsf_remove (void *P, web_data w)
+{
+    struct gdsf *G = P;
+    web_data last = G->heap[--G->count];
+
+    if (last == w)
+        return;
+
+    // The last entry takes w's place and moves whichever way it must
+    gdsf_set (G, w->pos, last);
+    gdsf_up (G, last->pos);
+    gdsf_down (G, last->pos);
+}
+
+const policy_ops_t policy_gdsf = {
+    "gdsf", gdsf_new, gdsf_free, gdsf_access, gdsf_hit, gdsf_insert,
+    gdsf_evict, gdsf_remove
+};
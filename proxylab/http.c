@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+/*
+ * Lines are found a vector at a time: each block of the buffer is
+ * compared against '\n' and ':' at once, and the two bit masks say where
+ * the line ends and where its name does. AVX2 is used if the build
+ * targets it (e.g. -mavx2), SSE2 otherwise, which every x86-64 has; other
+ * targets, and the tail of the buffer, go a byte at a time.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i http_vec;
+#define HTTP_VEC_SIZE 32
+#define http_vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define http_vec_splat(c) _mm256_set1_epi8(c)
+#define http_vec_match(v, c) \
+    ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c)))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i http_vec;
+#define HTTP_VEC_SIZE 16
+#define http_vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define http_vec_splat(c) _mm_set1_epi8(c)
+#define http_vec_match(v, c) \
+    ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, c)))
+#endif
+
+/*
+ * Known header names hash to distinct slots of this table by their
+ * length and first letter (see http_header_id), so telling one apart
+ * takes a single comparison however many there are.
+ */
+#define HTTP_SLOT(len, c) ((((len) << 3) + ((c) | 0x20)) & 15)
+
+static const struct
+{
+    const char *name;
+    int len;
+    int id;
+} http_known[16] = {
+    [HTTP_SLOT(4, 'H')] = { "Host", 4, HTTP_HOST },
+    [HTTP_SLOT(10, 'C')] = { "Connection", 10, HTTP_CONNECTION },
+    [HTTP_SLOT(16, 'P')] = { "Proxy-Connection", 16, HTTP_PROXY_CONNECTION },
+    [HTTP_SLOT(10, 'K')] = { "Keep-Alive", 10, HTTP_KEEP_ALIVE },
+    [HTTP_SLOT(10, 'U')] = { "User-Agent", 10, HTTP_USER_AGENT },
+    [HTTP_SLOT(6, 'A')] = { "Accept", 6, HTTP_ACCEPT },
+    [HTTP_SLOT(15, 'A')] = { "Accept-Encoding", 15, HTTP_ACCEPT_ENCODING },
+};
+
+static const char *http_scan (const char *p, const char *end,
+    const char **colon);
+static int http_request_line (const char *p, const char *eol,
+    struct http_request *req);
+static void http_header (const char *p, const char *eol, const char *colon,
+    struct http_header *hd);
+static const char *http_token (const char *p, const char *end,
+    struct http_slice *s);
+
+/*
+ * http_parse_request - parse the request head at the start of the len
+ * bytes at buf into req, without copying any of it. Returns the length
+ * of the head, blank line included, 0 if buf does not hold all of it, or
+ * -1 if it is malformed or has more than HTTP_MAX_HEADERS headers.
+ */
+int http_parse_request (const char *buf, int len, struct http_request *req)
+{
+    const char *p = buf, *end = buf + len;
+    const char *eol, *colon;
+
+    // Blank lines ahead of the request line are ignored (RFC 7230 3.5)
+    while (end - p >= 2 && p[0] == '\r' && p[1] == '\n')
+        p += 2;
+
+    if ((eol = http_scan (p, end, &colon)) == NULL)
+        return 0;
+    if (http_request_line (p, eol, req) == -1)
+        return -1;
+
+    req->nheaders = 0;
+
+    for (p = eol + 1; (eol = http_scan (p, end, &colon)) != NULL; p = eol + 1)
+    {
+        if (eol == p || (eol == p + 1 && *p == '\r'))
+            return (int)(eol + 1 - buf);
+
+        if (req->nheaders == HTTP_MAX_HEADERS)
+            return -1;
+
+        http_header (p, eol, colon, &req->headers[req->nheaders++]);
+    }
+    return 0;
+}
+
+/*
+ * http_header_id - which of the headers in enum http_header_id the len
+ * bytes at name are, ignoring case, or HTTP_OTHER
+ */
+int http_header_id (const char *name, int len)
+{
+    int slot;
+
+    if (len < 1)
+        return HTTP_OTHER;
+
+    slot = HTTP_SLOT(len, name[0]);
+
+    if (http_known[slot].len == len
+        && strncasecmp (http_known[slot].name, name, len) == 0)
+        return http_known[slot].id;
+    return HTTP_OTHER;
+}
+
+/*
+ * http_slice_prefix - whether s starts with prefix, ignoring case
+ */
+int http_slice_prefix (struct http_slice s, const char *prefix)
+{
+    int n = strlen (prefix);
+
+    return s.len >= n && strncasecmp (s.p, prefix, n) == 0;
+}
+
+/*
+ * http_scan - the first '\n' from p up to end, or NULL, setting *colon
+ * to the first ':' before it, or NULL
+ */
+static const char *http_scan (const char *p, const char *end,
+    const char **colon)
+{
+    *colon = NULL;
+
+#ifdef HTTP_VEC_SIZE
+    const http_vec lf = http_vec_splat ('\n');
+    const http_vec cl = http_vec_splat (':');
+
+    for (; end - p >= HTTP_VEC_SIZE; p += HTTP_VEC_SIZE)
+    {
+        http_vec v = http_vec_load (p);
+        uint32_t lfs = http_vec_match (v, lf);
+        uint32_t cls = *colon ? 0 : http_vec_match (v, cl);
+
+        // Only a colon ahead of the newline counts
+        if (lfs)
+            cls &= (lfs & -lfs) - 1;
+        if (cls)
+            *colon = p + __builtin_ctz (cls);
+        if (lfs)
+            return p + __builtin_ctz (lfs);
+    }
+#endif
+
+    for (; p < end; p++)
+    {
+        if (*p == '\n')
+            return p;
+        if (*p == ':' && *colon == NULL)
+            *colon = p;
+    }
+    return NULL;
+}
+
+/*
+ * http_request_line - split the request line from p to its '\n' at eol
+ * into req's method, uri and version. Returns -1 if one is missing.
+ */
+static int http_request_line (const char *p, const char *eol,
+    struct http_request *req)
+{
+    const char *end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+
+    p = http_token (p, end, &req->method);
+    p = http_token (p, end, &req->uri);
+    http_token (p, end, &req->version);
+
+    return req->version.len ? 0 : -1;
+}
+
+/*
+ * http_header - fill in hd for the header line from p to its '\n' at
+ * eol, whose name ends at colon (NULL if it has none)
+ */
+static void http_header (const char *p, const char *eol, const char *colon,
+    struct http_header *hd)
+{
+    const char *end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    const char *v;
+
+    hd->line.p = p;
+    hd->line.len = (int)(eol + 1 - p);
+    hd->name.p = hd->value.p = p;
+    hd->name.len = hd->value.len = 0;
+    hd->id = HTTP_OTHER;
+
+    if (colon == NULL)
+        return;
+
+    for (v = colon; v > p && (v[-1] == ' ' || v[-1] == '\t'); v--)
+        ;
+    hd->name.len = (int)(v - p);
+    hd->id = http_header_id (p, hd->name.len);
+
+    for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+        ;
+    while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    hd->value.p = v;
+    hd->value.len = (int)(end - v);
+}
+
+/*
+ * http_token - the run of non-blanks from p (after any blanks) up to end
+ * in s, empty if there is none. Returns where it stops.
+ */
+static const char *http_token (const char *p, const char *end,
+    struct http_slice *s)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    s->p = p;
+    while (p < end && *p != ' ' && *p != '\t')
+        p++;
+
+    s->len = (int)(p - s->p);
+    return p;
+}
@@ -0,0 +1,50 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+/* Most header lines a request may have */
+#define HTTP_MAX_HEADERS 64
+
+/* The headers the proxy acts on, told apart by http_header_id */
+enum http_header_id
+{
+	HTTP_OTHER,
+	HTTP_HOST,
+	HTTP_CONNECTION,
+	HTTP_PROXY_CONNECTION,
+	HTTP_KEEP_ALIVE,
+	HTTP_USER_AGENT,
+	HTTP_ACCEPT,
+	HTTP_ACCEPT_ENCODING
+};
+
+/* A run of bytes in a buffer, not '\0'-terminated */
+struct http_slice
+{
+	const char *p;
+	int len;
+};
+
+struct http_header
+{
+	struct http_slice line;     // the whole line, line ending included
+	struct http_slice name;     // trailing blanks trimmed; empty if no ':'
+	struct http_slice value;    // blanks trimmed from both ends
+	int id;                     // enum http_header_id of name
+};
+
+/* A request head, parsed where it lies: every slice points into the
+   buffer it was parsed from, which must outlive it. */
+struct http_request
+{
+	struct http_slice method;
+	struct http_slice uri;
+	struct http_slice version;
+	int nheaders;
+	struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+int http_parse_request (const char *buf, int len, struct http_request *req);
+int http_header_id (const char *name, int len);
+int http_slice_prefix (struct http_slice s, const char *prefix);
+
+#endif
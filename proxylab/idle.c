@@ -0,0 +1,168 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "idle.h"
+
+static void idle_unlink (idlers I, struct idle_conn *c);
+static void idle_expire (idlers I, time_t now);
+static void *idle_poller (void *vargp);
+
+/*
+ * idle_new - start a poller that hands each parked connection to wake
+ * once it has something to read, or closes it after idleSecs
+ */
+idlers idle_new (int idleSecs, void (*wake)(int fd, int served))
+{
+    idlers I = calloc(1, sizeof(struct idle_header));
+    struct epoll_event ev;
+
+    I->epfd = epoll_create1(EPOLL_CLOEXEC);
+    I->stopfd = eventfd(0, EFD_CLOEXEC);
+    I->idleSecs = idleSecs > 0 ? idleSecs : 1;
+    I->wake = wake;
+    pthread_mutex_init(&I->mutex, NULL);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(I->epfd, EPOLL_CTL_ADD, I->stopfd, &ev);
+
+    Pthread_create(&I->poller, NULL, idle_poller, I);
+    return I;
+}
+
+/*
+ * idle_park - watch fd, a client connection that has served requests
+ * and has nothing buffered, until its next request arrives. fd belongs
+ * to the poller from here on; once it is stopping, fd is just closed.
+ */
+void idle_park (idlers I, int fd, int served)
+{
+    struct idle_conn *c = Malloc(sizeof(struct idle_conn));
+    struct epoll_event ev;
+
+    c->fd = fd;
+    c->served = served;
+    c->idleSince = time(NULL);
+    c->next = NULL;
+
+    pthread_mutex_lock(&I->mutex);
+
+    if (I->stopping)
+    {
+        pthread_mutex_unlock(&I->mutex);
+        close(fd);
+        free(c);
+        return;
+    }
+
+    c->prev = I->newest;
+    if (I->newest)
+        I->newest->next = c;
+    else
+        I->oldest = c;
+    I->newest = c;
+
+    // One shot, so that a woken connection is never reported twice
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    epoll_ctl(I->epfd, EPOLL_CTL_ADD, fd, &ev);
+
+    pthread_mutex_unlock(&I->mutex);
+}
+
+/*
+ * idle_stop - stop the poller and close every parked connection. Later
+ * calls to idle_park close their connection straight away.
+ */
+void idle_stop (idlers I)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&I->mutex);
+    I->stopping = 1;
+    pthread_mutex_unlock(&I->mutex);
+
+    if (write(I->stopfd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "Could not stop the idle connection poller\n");
+    pthread_join(I->poller, NULL);
+}
+
+/*
+ * idle_unlink - take c off the list of parked connections and stop
+ * watching it. Caller must hold I->mutex.
+ */
+static void idle_unlink (idlers I, struct idle_conn *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        I->oldest = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        I->newest = c->prev;
+
+    epoll_ctl(I->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+}
+
+/*
+ * idle_expire - close connections parked since before now - idleSecs,
+ * or all of them once stopping. Caller must hold I->mutex.
+ */
+static void idle_expire (idlers I, time_t now)
+{
+    struct idle_conn *c;
+
+    while ((c = I->oldest) != NULL
+        && (I->stopping || now - c->idleSince >= I->idleSecs))
+    {
+        idle_unlink(I, c);
+        close(c->fd);
+        free(c);
+    }
+}
+
+/*
+ * idle_poller - hand readable connections to I->wake and close expired
+ * ones until idle_stop
+ */
+static void *idle_poller (void *vargp)
+{
+    idlers I = (idlers)vargp;
+    struct epoll_event events[IDLE_EVENTS];
+    int n, i;
+
+    while (1)
+    {
+        n = epoll_wait(I->epfd, events, IDLE_EVENTS, 1000);
+
+        for (i = 0; i < n; i++)
+        {
+            struct idle_conn *c = events[i].data.ptr;
+
+            // The stop eventfd
+            if (c == NULL)
+                continue;
+
+            pthread_mutex_lock(&I->mutex);
+            idle_unlink(I, c);
+            int stopping = I->stopping;
+            pthread_mutex_unlock(&I->mutex);
+
+            if (stopping)
+                close(c->fd);
+            else
+                I->wake(c->fd, c->served);
+            free(c);
+        }
+
+        pthread_mutex_lock(&I->mutex);
+        idle_expire(I, time(NULL));
+        if (I->stopping)
+        {
+            pthread_mutex_unlock(&I->mutex);
+            return NULL;
+        }
+        pthread_mutex_unlock(&I->mutex);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <pthread.h>
+#include <time.h>
+
+/* Most wakeups the poller handles per epoll_wait */
+#define IDLE_EVENTS 64
+
+/* A kept-alive client connection waiting for its next request */
+struct idle_conn
+{
+    int fd;
+    int served;             /* requests it has carried so far */
+    time_t idleSince;
+    struct idle_conn *prev, *next;
+};
+
+/*  Kept-alive client connections between requests, watched by one
+    poller thread instead of each holding a worker. A connection that
+    becomes readable is handed to wake, and one that stays idle for
+    idleSecs is closed. Connections are listed oldest first, which is
+    also the order they expire in. */
+struct idle_header
+{
+    int epfd;
+    int stopfd;             /* eventfd that tells the poller to stop */
+    int idleSecs;
+    int stopping;
+    struct idle_conn *oldest, *newest;
+    void (*wake)(int fd, int served);
+    pthread_mutex_t mutex;
+    pthread_t poller;
+};
+typedef struct idle_header *idlers;
+
+idlers idle_new (int idleSecs, void (*wake)(int fd, int served));
+void idle_park (idlers I, int fd, int served);
+void idle_stop (idlers I);
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+static unsigned char *lz_put_length (unsigned char *op, int len);
+static int lz_get_length (const unsigned char **ip,
+    const unsigned char *iend, int len);
+
+/*
+ * lz_bound - the most lz_compress can turn n bytes into
+ */
+int lz_bound (int n)
+{
+    return n + n / 255 + 16;
+}
+
+/*
+ * lz_compress - compress n bytes from src into dst, which holds cap.
+ * Returns the compressed size, or -1 if it doesn't fit.
+ */
+int lz_compress (const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *end = base + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    // Last position of each hashed 4 bytes, plus one; 0 is empty
+    uint32_t table[1 << LZ_HASH_BITS];
+    int misses = 0;
+
+    memset (table, 0, sizeof(table));
+
+    while (end - ip >= LZ_MIN_MATCH)
+    {
+        uint32_t v, h;
+        const unsigned char *ref;
+
+        memcpy (&v, ip, 4);
+        h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+        ref = table[h] ? base + table[h] - 1 : NULL;
+        table[h] = (uint32_t)(ip - base) + 1;
+
+        if (ref == NULL || ip - ref > LZ_MAX_OFFSET || memcmp (ref, ip, 4))
+        {
+            // Skip faster through data that isn't compressing
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < end && ref[len] == ip[len])
+            len++;
+
+        int lits = (int)(ip - anchor);
+        int off = (int)(ip - ref);
+
+        if (oend - op < 1 + lits + lits / 255 + 3 + len / 255 + 1)
+            return -1;
+
+        unsigned char *token = op++;
+        *token = (lits < 15 ? lits : 15) << 4;
+        op = lz_put_length (op, lits);
+        memcpy (op, anchor, lits);
+        op += lits;
+
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        *token |= len - LZ_MIN_MATCH < 15 ? len - LZ_MIN_MATCH : 15;
+        op = lz_put_length (op, len - LZ_MIN_MATCH);
+
+        ip += len;
+        anchor = ip;
+    }
+
+    // The rest goes out as literals
+    int lits = (int)(end - anchor);
+
+    if (oend - op < 1 + lits + lits / 255 + 1)
+        return -1;
+
+    *op++ = (lits < 15 ? lits : 15) << 4;
+    op = lz_put_length (op, lits);
+    memcpy (op, anchor, lits);
+    op += lits;
+
+    return (int)(op - (unsigned char *)dst);
+}
+
+/*
+ * lz_decompress - decompress n bytes from src into dst, which holds
+ * cap. Returns the decompressed size, or -1 if src is not a block that
+ * fits.
+ */
+int lz_decompress (const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+
+    while (ip < iend)
+    {
+        int token = *ip++;
+        int lits = lz_get_length (&ip, iend, token >> 4);
+
+        if (lits < 0 || iend - ip < lits || oend - op < lits)
+            return -1;
+        memcpy (op, ip, lits);
+        ip += lits;
+        op += lits;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        int len = lz_get_length (&ip, iend, token & 15);
+        if (len < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+
+        if (off == 0 || off > op - (unsigned char *)dst || oend - op < len)
+            return -1;
+
+        // Byte by byte, as the match may overlap what it produces
+        const unsigned char *ref = op - off;
+        while (len-- > 0)
+            *op++ = *ref++;
+    }
+
+    return (int)(op - (unsigned char *)dst);
+}
+
+/*
+ * lz_put_length - the bytes that follow a nibble of 15 for len
+ */
+static unsigned char *lz_put_length (unsigned char *op, int len)
+{
+    if (len < 15)
+        return op;
+
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/*
+ * lz_get_length - a length whose nibble was len, reading any bytes that
+ * follow it. Returns -1 if they run past iend.
+ */
+static int lz_get_length (const unsigned char **ip,
+    const unsigned char *iend, int len)
+{
+    int b;
+
+    if (len < 15)
+        return len;
+
+    do
+    {
+        if (*ip == iend)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+
+    return len;
+}
@@ -0,0 +1,22 @@
+#ifndef LZ_H
+#define LZ_H
+
+/* A small LZ77 codec in the style of LZ4: no entropy coding, so it
+   compresses text a few times over at memory speed in both directions.
+
+   A block is a run of sequences, each a token byte whose high nibble is
+   a count of literals and low nibble a match length less LZ_MIN_MATCH
+   (15 in either means more follows, in bytes of 255 and a last one
+   below it), the literals, a 2-byte little-endian offset back into the
+   output and any extra match length. The last sequence has only
+   literals. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+int lz_bound (int n);
+int lz_compress (const char *src, int n, char *dst, int cap);
+int lz_decompress (const char *src, int n, char *dst, int cap);
+
+#endif
@@ -0,0 +1,119 @@
+#include <string.h>
+#include "policy.h"
+
+static const policy_ops_t *policies[] = {
+    &policy_lru, &policy_s3fifo, &policy_tinylfu, &policy_gdsf
+};
+
+/*
+ * policy_find - the policy called name, or NULL if there is none
+ */
+const policy_ops_t *policy_find (const char *name)
+{
+    int i;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        if (!strcmp (policies[i]->name, name))
+            return policies[i];
+    }
+    return NULL;
+}
+
+/*
+ * policy_queue_push - put w at the head of Q
+ */
+void policy_queue_push (struct policy_queue *Q, web_data w)
+{
+    w->prev = NULL;
+    w->next = Q->head;
+
+    if (Q->head)
+        Q->head->prev = w;
+    else
+        Q->tail = w;
+
+    Q->head = w;
+    Q->bytes += web_data_size (w);
+}
+
+/*
+ * policy_queue_remove - take w off Q
+ */
+void policy_queue_remove (struct policy_queue *Q, web_data w)
+{
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        Q->head = w->next;
+
+    if (w->next)
+        w->next->prev = w->prev;
+    else
+        Q->tail = w->prev;
+
+    w->prev = w->next = NULL;
+    Q->bytes -= web_data_size (w);
+}
+
+/*
+ * LRU: one recency queue. A hit moves the entry to the head and the tail
+ * is evicted. Entries are stamped with a logical tick on every use.
+ */
+struct lru
+{
+    struct policy_queue q;
+    unsigned long tick;
+};
+
+static void *lru_new (int capacity)
+{
+    return calloc(1, sizeof(struct lru));
+}
+
+static void lru_free (void *P)
+{
+    free (P);
+}
+
+static void lru_access (void *P, uint64_t hash)
+{
+}
+
+static void lru_hit (void *P, web_data w)
+{
+    struct lru *L = P;
+
+    web_data_update_acc_time (w, ++L->tick);
+    policy_queue_remove (&L->q, w);
+    policy_queue_push (&L->q, w);
+}
+
+static void lru_insert (void *P, web_data w)
+{
+    struct lru *L = P;
+
+    web_data_update_acc_time (w, ++L->tick);
+    policy_queue_push (&L->q, w);
+}
+
+static web_data lru_evict (void *P)
+{
+    struct lru *L = P;
+    web_data w = L->q.tail;
+
+    policy_queue_remove (&L->q, w);
+    return w;
+}
+
+static void lru_remove (void *P, web_data w)
+{
+    struct lru *L = P;
+
+    policy_queue_remove (&L->q, w);
+}
+
+const policy_ops_t policy_lru = {
+    "lru", lru_new, lru_free, lru_access, lru_hit, lru_insert, lru_evict,
+    lru_remove
+};
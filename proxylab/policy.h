@@ -0,0 +1,49 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdlib.h>
+#include "web_data.h"
+
+/* An eviction policy decides which entry of a cache shard goes when the
+   shard is full. Each shard has its own state, made by new for a shard
+   of capacity bytes, and every call on it is made under the shard's
+   lock. Entries are linked into the policy's queues through their own
+   prev/next fields, so no call allocates. */
+typedef struct policy_ops {
+    const char *name;
+    void *(*new)(int capacity);
+    void (*free)(void *P);
+    /* Every lookup of the key that hashes to hash, hit or miss */
+    void (*access)(void *P, uint64_t hash);
+    /* A lookup found w */
+    void (*hit)(void *P, web_data w);
+    /* w was added to the shard */
+    void (*insert)(void *P, web_data w);
+    /* Take the next entry to evict off the policy's queues and return
+       it; only called while the shard holds entries */
+    web_data (*evict)(void *P);
+    /* Take w, evicted for some other reason, off the policy's queues */
+    void (*remove)(void *P, web_data w);
+} policy_ops_t;
+
+extern const policy_ops_t policy_lru;
+extern const policy_ops_t policy_s3fifo;
+extern const policy_ops_t policy_tinylfu;
+extern const policy_ops_t policy_gdsf;
+
+#define POLICY_DEFAULT (&policy_lru)
+
+const policy_ops_t *policy_find (const char *name);
+
+/* A doubly-linked queue of entries, newest at the head */
+struct policy_queue
+{
+    web_data head;
+    web_data tail;
+    long bytes;     // web_data_size of the entries on it
+};
+
+void policy_queue_push (struct policy_queue *Q, web_data w);
+void policy_queue_remove (struct policy_queue *Q, web_data w);
+
+#endif
@@ -4,112 +4,398 @@ Description: A simple HTTP proxy that supports GET requests
 and caches web data
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <assert.h>
+#include <sched.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 #include "csapp.h"
 #include "cache.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "tpool.h"
+#include "proxy.h"
+#include "event.h"
+#include "uring.h"
+#include "connpool.h"
+#include "dns.h"
+#include "flight.h"
+#include "snapshot.h"
+#include "idle.h"
 
 /* Core functions */
-void process(int fd);
-void *thread (void *vargp);
+int process(rio_t *rio, int fd, int mayKeepAlive);
+int fetch_from_web(int fd, char *method, char *name, char *dir, int port,
+    const char *hdrs, int hdrsLen, struct client_hdrs *h, int keepAlive,
+    struct flight *fl);
+void serve_client(int fd, int served);
+void client_wake(int fd, int served);
+void shed_client(int fd);
+int client_wait(rio_t *rio, int secs);
+void *accept_loop(void *vargp);
+void *snapshot_loop(void *vargp);
 
 /* Network communication functions */
-int send_request(int fd, char *dir);
-int send_proxyheaders(int webfd, int hostSpecified, const char *name);
-int client_to_web(rio_t rio, int webfd, int *hostSpecified);
-int web_to_client(int webfd, int fd, char *name, char *dir, int port);
-int cache_to_client(const char* data, int dataSize, int fd);
+struct fill;
+int send_upstream(int webfd, char *dir, const char *hdrs, int hdrsLen,
+    struct client_hdrs *h, const char *name);
+int web_to_client(int webfd, int fd, char *name, char *dir, int port,
+    int keepAlive, int *webReusable, struct flight *fl);
+int splice_to_client(int webfd, int fd, long left, long *relayed);
+void fill_start(struct fill *f, char *name, char *dir, int port,
+    int headLen, long contentLength, struct flight *fl);
+char *fill_buffer(void);
+void fill_append(void *vargp, const char *data, int len);
+int fill_wanted(struct fill *f);
+void fill_finish(struct fill *f, int ok);
+int cache_to_client(const char *data, int dataSize, int headLen, long age,
+    int fd, int keepAlive);
+int send_iov(int fd, struct iovec *iov, int n, int flags, unsigned *sends);
+int zerocopy_wait(int fd, unsigned sends);
+int disk_to_client(disk_rec rec, int fd, int keepAlive);
+int flight_to_client(struct flight_reader *r, int fd, int keepAlive);
+int send_response_head(int fd, const char *head, int headLen, int bodyLen,
+    int keepAlive, long age, struct response_info *r);
 
 /* Signal Handling */
-void sigint_handler(int sig);
-
-/* Cache Functions */
-const char *retrieve_cache(char *name, char *dir, int port, int *dataSize); 
+struct listener;
+void wait_for_shutdown(sigset_t *signals, struct listener *listeners,
+    pthread_t *acceptors, int nlisten, int useEpoll);
 
 /* String Parsing Functions */
 char *get_website(char *uri);
 void get_uri_info(char *uri, char *name, char *dir, int *port);
 void strip_space (char *s);
 int in_list (const char *s, const char **slist, int listSize);
+long parse_length (const char *s, const char *eol);
 
 /* Utilities */
+int cached_getaddrinfo(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res);
+void usage(char *prog);
 int min (int x, int y);
-void clienterror(int fd, char *cause, char *errnum, 
-         char *shortmsg, char *longmsg);
 
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
 static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
 static const char *connect_hdr = "Connection: close\r\n";
 static const char *proxy_connect_hdr = "Proxy-Connection: close\r\n";
-static const char *change_headers[5] = {"User-Agent", "Accept", 
-    "Accept-Encoding", "Connection", "Proxy-Connection"};
+static const char *keepalive_connect_hdr = "Connection: keep-alive\r\n";
+static const char *keepalive_proxy_connect_hdr =
+    "Proxy-Connection: keep-alive\r\n";
+static const char *hop_headers[3] = {"Connection", "Proxy-Connection",
+    "Keep-Alive"};
 
 const int verbose = 0;
 
-/* The cache stores recently accessed web content for fast retrieval */
+/* Set when the threaded engine does its I/O through io_uring */
+int useUring = 0;
+
+/* Set with -Z to send big cache hits with MSG_ZEROCOPY */
+int zeroCopy = 0;
+
+/* Client keep-alive: how long an idle connection is held open, and how
+   many requests it may carry. keepAliveSecs 0 turns keep-alive off. */
+int keepAliveSecs = KEEPALIVE_SECS;
+int keepAliveMax = KEEPALIVE_MAX;
+
+/* An accept loop and the CPU it is pinned to (-1 if not pinned) */
+struct listener
+{
+    int fd;
+    int cpu;
+};
+
+/* Response bytes collected for the cache (and any followers) while
+   they are relayed: straight into the entry that will be cached when
+   the response says how long it is, otherwise into the worker's fill
+   buffer until that is known */
+struct fill
+{
+    web_data entry;
+    char *buf;      /* entry's data, or the fill buffer if no entry */
+    int capacity;   /* bytes buf holds */
+    disk_rec disk;  /* or, for one too big for memory, its disk record */
+    int size;       /* -1 once the response is too big to cache */
+    long total;     /* bytes seen, whether cached or not */
+    struct flight *flight;
+    char *name, *dir;
+    int port;
+};
+
+/* Each worker's fill buffer, made the first time it is needed and
+   freed with the worker */
+static pthread_key_t fillKey;
+static __thread char *fillBuf;
+
+/* The cache stores recently accessed web content for fast retrieval.
+   It does its own (per-shard) locking. */
 cache webStore;
-sem_t read_m, write_m;
-int read_cnt;
+
+/* Where the cache is saved on exit, and every snapshotSecs seconds if
+   that is not 0, and loaded from at startup; NULL if it is not */
+char *snapshotPath = NULL;
+int snapshotSecs = 0;
+
+/* Set once SIGINT or SIGTERM arrives, under stopLock, which stopCond
+   is broadcast with; threads that poll it read it with __atomic_load_n */
+int stopping = 0;
+pthread_mutex_t stopLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stopCond = PTHREAD_COND_INITIALIZER;
+
+/* Saves the cache every snapshotSecs seconds, if it is running */
+pthread_t snapshotThread;
+
+/* Workers that serve accepted connections in the threaded engine */
+tpool workers;
+
+/* Kept-alive client connections waiting for their next request, which
+   hold no worker meanwhile. NULL if keep-alive is off. */
+idlers parked;
+
+/* Idle connections to web servers, kept for the next request to the
+   same origin. poolIdle 0 turns pooling off. Requests wait for one of
+   poolActive connections to an origin; 0 lets them open any number. */
+connpool origins;
+int poolIdle = CONNPOOL_MAX_IDLE;
+int poolSecs = CONNPOOL_IDLE_SECS;
+int poolActive = CONNPOOL_MAX_ACTIVE;
+
+/* Resolved names of web servers */
+dns resolver;
+
+/* Cache misses being fetched, which later misses for the same object
+   wait on */
+flights inflight;
 
 int main(int argc, char **argv)
 {
-    int listenfd, port, clientlen;
-    int *connfdp;
-    pthread_t tid;
-    struct sockaddr_in clientaddr;
+    int port, opt, i;
+    sigset_t signals;
+
+    int minThreads = TPOOL_MIN_THREADS;
+    int maxThreads = TPOOL_MAX_THREADS;
+    int queueDepth = TPOOL_QUEUE_DEPTH;
+    int idleSecs = TPOOL_IDLE_SECS;
+    int useEpoll = 0;
+    int nloops = 0;
+    int nlisten = 1;
+    int reusePort = 0;
+    int pinCpus = 0;
+    int dnsTtl = DNS_TTL;
+    const policy_ops_t *policy = POLICY_DEFAULT;
+    int admitWindow = DOORKEEPER_WINDOW;
+    int slabbed = 1;
+    int compress = 0;
+    char *diskPath = NULL;
+    long diskMb = DISK_TIER_MB;
+
+    /* SIGINT and SIGTERM are blocked here, before any thread starts, so
+       that every thread inherits the mask and they are only ever taken
+       by wait_for_shutdown, never in the middle of a request */
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* Check command line args */
+    while ((opt = getopt(argc, argv,
+        "t:T:q:i:e:n:ul:pk:K:c:C:A:D:P:a:Hzd:M:s:S:Z")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            minThreads = atoi(optarg);
+            break;
+        case 'T':
+            maxThreads = atoi(optarg);
+            break;
+        case 'q':
+            queueDepth = atoi(optarg);
+            break;
+        case 'i':
+            idleSecs = atoi(optarg);
+            break;
+        case 'e':
+            if (!strcmp(optarg, "epoll"))
+                useEpoll = 1;
+            else if (strcmp(optarg, "threads"))
+                usage(argv[0]);
+            break;
+        case 'n':
+            nloops = atoi(optarg);
+            break;
+        case 'u':
+            useUring = 1;
+            break;
+        case 'l':
+            reusePort = 1;
+            nlisten = atoi(optarg);
+            break;
+        case 'p':
+            pinCpus = 1;
+            break;
+        case 'k':
+            keepAliveSecs = atoi(optarg);
+            break;
+        case 'K':
+            keepAliveMax = atoi(optarg);
+            break;
+        case 'c':
+            poolIdle = atoi(optarg);
+            break;
+        case 'C':
+            poolSecs = atoi(optarg);
+            break;
+        case 'A':
+            poolActive = atoi(optarg);
+            break;
+        case 'D':
+            dnsTtl = atoi(optarg);
+            break;
+        case 'P':
+            if ((policy = policy_find(optarg)) == NULL)
+                usage(argv[0]);
+            break;
+        case 'a':
+            admitWindow = atoi(optarg);
+            break;
+        case 'H':
+            slabbed = 0;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'd':
+            diskPath = optarg;
+            break;
+        case 'M':
+            diskMb = atol(optarg);
+            break;
+        case 's':
+            snapshotPath = optarg;
+            break;
+        case 'S':
+            snapshotSecs = atoi(optarg);
+            break;
+        case 'Z':
+            zeroCopy = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    /* Install custom signal handlers */
+    if (optind != argc - 1)
+        usage(argv[0]);
 
-    Signal(SIGINT,  sigint_handler);
-    Signal(SIGPIPE, SIG_IGN);
+    port = atoi(argv[optind]);
 
-    /* Set up cache and semaphores for threading */
-    webStore = cache_new();
-    sem_init(&read_m, 0, 1);
-    sem_init(&write_m, 0, 1);
-    read_cnt = 0;
+    /* Set up cache */
+    webStore = cache_new(CACHE_SHARDS, policy, admitWindow, slabbed,
+        compress);
 
-    /* Check command line args */
-    if (argc != 2) 
+    if (diskPath != NULL
+        && cache_open_disk(webStore, diskPath, diskMb << 20) == -1)
+        unix_error("Could not set up the disk cache tier");
+
+    /* Start warm from the last snapshot, if there is one */
+
+    if (snapshotPath != NULL)
+    {
+        if (snapshot_load(webStore, snapshotPath) == -1 && errno != ENOENT)
+            fprintf(stderr, "Ignoring cache snapshot %s: %s\n",
+                snapshotPath, strerror(errno));
+
+        if (snapshotSecs > 0)
+            Pthread_create(&snapshotThread, NULL, snapshot_loop, NULL);
+    }
+
+    /* Listen for client connections, either on one socket shared by
+       every accept loop or with -l on one SO_REUSEPORT socket each */
+
+    if (reusePort && nlisten <= 0)
+        nlisten = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nlisten <= 0)
+        nlisten = 1;
+
+    struct listener *listeners = Malloc(nlisten * sizeof(struct listener));
+
+    for (i = 0; i < nlisten; i++)
     {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(1);
+        listeners[i].fd = reusePort ? Open_listenfd_reuseport(port)
+            : Open_listenfd(port);
+        listeners[i].cpu = pinCpus ? i : -1;
     }
 
-    port = atoi(argv[1]);
+    /* Resolve web servers through the DNS cache unless -D 0 */
 
-    /* Listen for client connections */
+    if (dnsTtl > 0)
+    {
+        resolver = dns_new(dnsTtl, DNS_NEG_TTL, NULL);
+        io_ops.getaddrinfo = cached_getaddrinfo;
+        io_ops.freeaddrinfo = dns_freeaddrinfo;
+    }
 
-    listenfd = Open_listenfd(port);
-    clientlen = sizeof(clientaddr);
+    /* The event engine replaces the worker pool entirely */
 
-    while (1) 
+    if (useEpoll)
     {
-		if ((connfdp = malloc(sizeof(int))) == NULL)
-		{
-			fprintf(stderr, "Memory allocation error\n");
-		}
+        int *listenfds = Malloc(nlisten * sizeof(int));
+
+        for (i = 0; i < nlisten; i++)
+            listenfds[i] = listeners[i].fd;
+
+        // One loop per listener when each has its own socket
+        if (reusePort)
+            nloops = nlisten;
+
+        event_run(listenfds, nlisten, nloops, pinCpus);
+        wait_for_shutdown(&signals, listeners, NULL, nlisten, 1);
+        return 0;
+    }
+
+    /* Route socket I/O through io_uring if the kernel supports it */
 
-		else
-		{
-			if ((*connfdp = Accept(listenfd, (SA *)&clientaddr, 
-				  (socklen_t *)&clientlen)) < 0)
-			{
-				fprintf(stderr, "Could not accept client connection.\n");
-			}
+    if (useUring && uring_init() == -1)
+    {
+        fprintf(stderr, "io_uring unavailable, using read/write\n");
+        useUring = 0;
+    }
 
-			else
-			{
-				pthread_create(&tid, NULL, thread, (void *)connfdp);
-			}
-		}
+    if (useUring)
+    {
+        io_ops.read = uring_read;
+        io_ops.write = uring_write;
     }
 
+    /* Coalesce concurrent misses for the same object */
+
+    inflight = flights_new();
+
+    /* Keep connections to web servers open between requests */
+
+    origins = connpool_new(poolIdle, poolSecs, poolActive);
+
+    /* Start the worker pool */
+
+    pthread_key_create(&fillKey, free);
+
+    workers = tpool_new(minThreads, maxThreads, queueDepth, idleSecs,
+        serve_client);
+
+    if (keepAliveSecs > 0)
+        parked = idle_new(keepAliveSecs, client_wake);
+
+    /* Run one accept loop per listener, and wait for a signal to stop */
+
+    pthread_t *acceptors = Malloc(nlisten * sizeof(pthread_t));
+
+    for (i = 0; i < nlisten; i++)
+        Pthread_create(&acceptors[i], NULL, accept_loop, &listeners[i]);
+
+    wait_for_shutdown(&signals, listeners, acceptors, nlisten, 0);
     return 0;
 }
 
@@ -117,355 +403,1262 @@ int main(int argc, char **argv)
  * Core Functions
  *****************/
 
-/*  New threads that handle client requests should start here.
-    vargp should point to an integer containing the file descriptor
-    for the new network connection. */
-void *thread (void *vargp)
+/*  Accepts connections on one listener and hands them to the worker
+    pool. vargp points to the struct listener to serve. */
+void *accept_loop(void *vargp)
+{
+    struct listener *l = (struct listener *)vargp;
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    int connfd;
+
+    if (l->cpu >= 0)
+        pin_to_cpu(l->cpu);
+
+    while (1) 
+    {
+        clientlen = sizeof(clientaddr);
+
+        if (useUring)
+            connfd = uring_accept(l->fd);
+        else
+            connfd = accept(l->fd, (SA *)&clientaddr, &clientlen);
+
+        // wait_for_shutdown shuts the listener down to get us here
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+        {
+            if (connfd >= 0)
+                close(connfd);
+            return NULL;
+        }
+
+        if (connfd < 0)
+        {
+            fprintf(stderr, "Could not accept client connection.\n");
+            continue;
+        }
+
+        /* Shed load rather than queue without bound */
+        if (tpool_submit(workers, connfd, 0) == -1)
+            shed_client(connfd);
+    }
+
+    return NULL;
+}
+
+/*  Worker pool handler for a client connection, newly accepted or
+    woken from parked with its next request, that has already carried
+    served requests. Serves requests while they keep coming, then
+    parks connfd until the next one arrives, or closes it once the
+    client or a response asks to close, keepAliveMax requests have
+    been served or the proxy is shutting down. */
+void serve_client(int connfd, int served)
 {
-	pthread_detach(pthread_self());
-	int connfd = *((int *)vargp);
-	free(vargp);
-	process(connfd);
+    rio_t rio;
+
+    rio_readinitb(&rio, connfd);
+
+    // The last request allowed on a connection is answered with close
+    while (process(&rio, connfd, keepAliveSecs > 0
+        && served + 1 < keepAliveMax)
+        && ++served < keepAliveMax
+        && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    {
+        // Nothing buffered or waiting, so no sense holding a worker
+        if (!client_wait(&rio, 0))
+        {
+            idle_park(parked, connfd, served);
+            return;
+        }
+    }
+
 	close(connfd);
-	return NULL;
+}
+
+/*  Called by the idle poller when a parked connection has something
+    to read: queues it for a worker again, shedding it like a new
+    connection if the queue is full. */
+void client_wake(int fd, int served)
+{
+    if (tpool_submit(workers, fd, served) == -1)
+        shed_client(fd);
+}
+
+/*  Turns away a client connection the worker pool has no room for:
+    answers 503 only if the socket takes the whole response at once,
+    so that the accepting thread or the idle poller never waits on a
+    client, and closes it. */
+void shed_client(int fd)
+{
+    static const char body[] = "<html><title>Proxy Error</title>"
+        "<body bgcolor=ffffff>\r\n"
+        "503: Service Unavailable\r\n"
+        "<p>Proxy is overloaded, try again later\r\n"
+        "<hr><em>The Tiny Web server</em>\r\n";
+    char buf[MAXLINE];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "HTTP/1.0 503 Service Unavailable\r\n"
+        "Content-type: text/html\r\n"
+        "Content-length: %d\r\n\r\n%s", (int)strlen(body), body);
+
+    if (send(fd, buf, n, MSG_DONTWAIT) != n && verbose)
+        printf("Could not tell a shed client why\n");
+    close(fd);
+}
+
+/*  Waits up to secs seconds for the next request on a kept-alive
+    connection. Returns 1 if there is something to read. */
+int client_wait(rio_t *rio, int secs)
+{
+    struct pollfd pfd;
+
+    // A pipelined request may already be buffered
+    if (rio->rio_cnt > 0)
+        return 1;
+
+    pfd.fd = rio->rio_fd;
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, secs * 1000) == 1;
 }
 
 /*  Core proxy function. Retrieves HTTP request from client and
     serves webpage (from cache if it already exists, and from
     the server otherwise).
-    fd should be the file descriptor of a socket connected to
-    the client. */
-void process(int fd)
+    rio is the RIO state of fd, a socket connected to the client.
+    mayKeepAlive is 0 if the connection must close after this request.
+    Returns 1 if the connection can carry another request and 0 if
+    it should be closed. */
+int process(rio_t *rio, int fd, int mayKeepAlive)
 {
-   	char buf[MAXLINE];
-    rio_t rio;
-    rio_readinitb(&rio, fd);
+    char head[MAX_HEAD];
+    struct http_request req;
+    int rc;
 
-    /* Read Request Line */
+    /* Read the request head and parse it where it lies */
 
-    if (rio_readlineb(&rio, buf, MAXLINE) <= 2)
+    if ((rc = rio_readheadb(rio, head, MAX_HEAD)) <= 0
+        || http_parse_request(head, rc, &req) <= 0)
 	{
+        // The client closed an idle connection
+        if (rc == 0)
+            return 0;
+
         clienterror(fd, "GET", "400", "Bad Request",
                 "Invalid syntax: every line must end with \\r\\n");
-        fprintf(stderr, "Could not read client request line\n");
-		return;
+        fprintf(stderr, "Could not read client request head\n");
+		return 0;
 	}
 
 	/* Extract information from header */
 
-	char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	char method[MAXLINE], name[MAXLINE], dir[MAXLINE];
+	int port;
+	struct client_hdrs h;
 
-	if (sscanf(buf, "%s %s %s", method, uri, version) < 3)
-	{
-		clienterror(fd, method, "400", "Bad Request",
-                "Invalid syntax for GET request");
-        fprintf(stderr, "Invalid header format %s\n", buf);
-		return;
-	}
+	if (parse_request(fd, &req, method, name, dir, &port, &h) == -1)
+		return 0;
 
-	if (strcasecmp(method, "GET"))
-	{ 
-        clienterror(fd, method, "501", "Not Implemented",
-                "Proxy only supports the GET method");
-        fprintf(stderr, "Invalid header format: %s\n", buf);
-        return;
-    }
+    if (verbose)
+    	printf("Request: %s %s %d\n", name, dir, port);
 
-    /* Get hostname and port from URI */
+    /* Keep the headers that are forwarded so the request can be resent
+       on a fresh connection */
 
-    char name[MAXLINE], dir[MAXLINE];
-    int port;
-    get_uri_info(uri, name, dir, &port);
+    char hdrs[MAX_HEAD];
+    int hdrsLen = 0, i;
 
-    if (verbose)
-    	printf("Request: %s %s %d\n", name, dir, port);
+    for (i = 0; i < req.nheaders; i++)
+    {
+        if (!forward_header(&req.headers[i], &h))
+            continue;
 
-    /* Check cache for desried content */
+        memcpy(hdrs + hdrsLen, req.headers[i].line.p,
+            req.headers[i].line.len);
+        hdrsLen += req.headers[i].line.len;
+    }
+
+    /* Check cache for desried content. If another request is already
+       fetching it, follow that fetch as the response arrives. */
+
+    struct flight *fl = NULL;
+    struct flight_reader *reader;
+    web_data hit = retrieve_cache(name, dir, port);
+    disk_rec diskHit;
+
+    /* Objects evicted from memory, or too big for it, may be on disk */
 
-    int dataSize;
-    const char *data = retrieve_cache(name, dir, port, &dataSize);
-    
-    if (data != NULL)
+    if (hit == NULL && (diskHit = retrieve_disk(name, dir, port)) != NULL)
     {
-        /* Read rest of HTTP request from client */
-        while (rio_readlineb(&rio, buf, MAXLINE) > 2) {}
+        rc = disk_to_client(diskHit, fd, mayKeepAlive && h.keepAlive);
+        disk_release(diskHit);
 
-        if (cache_to_client(data, dataSize, fd) == -1)
-            fprintf(stderr, "Error sending data from cache to client\n");
+        if (rc == -1)
+            fprintf(stderr, "Error sending data from disk cache to client\n");
 
-        return;
+        return rc == 1;
     }
 
-    /* Connect to website server */
+    if (hit == NULL)
+    {
+        fl = flight_join(inflight, name, dir, port, &reader);
+
+        if (reader != NULL)
+        {
+            rc = flight_to_client(reader, fd, mayKeepAlive && h.keepAlive);
+            flight_leave(inflight, reader);
 
-    int webfd = open_clientfd_r(name, port);
+            if (rc == -1)
+                fprintf(stderr, "Error relaying fetch in progress\n");
+            if (rc != -2)
+                return rc == 1;
+        }
 
-    if (webfd < 0)
-    {
-        clienterror(fd, method, "502", "Bad Gateway",
-                "Proxy could not connect to web server");
-        fprintf(stderr, "Error connecting to web server\n");
-        return;
+        // The fetch that filled the cache may have landed between the
+        // miss above and the join, so look again before fetching. A
+        // flight led for nothing is landed at once; anyone who attached
+        // meanwhile finds it failed and looks again too.
+        if ((hit = cache_recheck(webStore, name, dir, port)) != NULL
+            && fl != NULL)
+        {
+            flight_land(inflight, fl, 0);
+            fl = NULL;
+        }
     }
 
-    /* Send http request line */
 
-    if (send_request(webfd, dir) == -1)
+    if (hit != NULL)
     {
-        clienterror(fd, method, "502", "Bad Gateway",
-                "Proxy could not send HTTP request to web server.");
-        fprintf(stderr, "Error writing request to web server\n");
-        return;
-    }
+        /* A compressed entry is unpacked into a buffer of our own */
+        const char *data = hit->data;
+        int dataSize = hit->data_size;
+        char *plain = NULL;
 
-    /* Read from client and send http to web server */
+        if (hit->plain_size)
+        {
+            data = plain = Malloc(hit->plain_size);
+            dataSize = web_data_unpack(hit, plain);
+        }
 
-    int hostSpecified = 0;
+        rc = dataSize < 0 ? -1 : cache_to_client(data, dataSize,
+            hit->head_size, time(NULL) - hit->stored, fd,
+            mayKeepAlive && h.keepAlive);
+        web_data_release(hit);
+        free(plain);
 
-    if (client_to_web(rio, webfd, &hostSpecified) == -1)
-    {
-        clienterror(fd, method, "502", "Bad Gateway",
-                "Proxy could not write data to web server");
-        fprintf(stderr, "Error forwarding client HTTP to web\n");
-        return;
+        if (rc == -1)
+            fprintf(stderr, "Error sending data from cache to client\n");
+
+        return rc == 1;
     }
 
-    /* Write headers to web server */
+    // A follower whose leader failed before sending anything ends up
+    // here too, fetching on its own
+    rc = fetch_from_web(fd, method, name, dir, port, hdrs, hdrsLen, &h,
+        mayKeepAlive && h.keepAlive, fl);
+
+    if (fl != NULL)
+        flight_land(inflight, fl, rc >= 0);
+
+    return rc == 1;
+}
+
+/*  Fetches dir from the web server name:port for the client on fd,
+    sending the client's headers in hdrs along with our own, and
+    relays (and caches) the response, appending it to fl for any
+    followers if fl is not NULL. A pooled connection the server has
+    since closed or reset fails before any response arrives, in which
+    case the request is sent again on another connection.
+    Returns -1 on error, otherwise 1 if the client connection can carry
+    another request and 0 if it should be closed. */
+int fetch_from_web(int fd, char *method, char *name, char *dir, int port,
+    const char *hdrs, int hdrsLen, struct client_hdrs *h, int keepAlive,
+    struct flight *fl)
+{
+    int webfd, reused, webReusable = 0;
+    int rc;
 
-    if (send_proxyheaders(webfd, hostSpecified, name) == -1) //Other headers
+    while (1)
     {
-        clienterror(fd, method, "502", "Bad Gateway",
-                "Proxy could not write header data to web server");
-        fprintf(stderr, "Error sending proxy headers to server\n");
-        return;
-    }
+        if ((webfd = connpool_get(origins, name, port, &reused)) < 0)
+        {
+            clienterror(fd, method, "502", "Bad Gateway",
+                    "Proxy could not connect to web server");
+            fprintf(stderr, "Error connecting to web server\n");
+            return -1;
+        }
 
-	//Send terminating line to web server
-	rio_writen(webfd, "\r\n", strlen("\r\n"));	
+        if (send_upstream(webfd, dir, hdrs, hdrsLen, h, name) == -1)
+        {
+            connpool_drop(origins, name, port, webfd);
 
-    /* Forward server data to client */
+            if (reused)
+                continue;
 
-    if (verbose)
-    	printf("Awaiting website response\n");
+            clienterror(fd, method, "502", "Bad Gateway",
+                    "Proxy could not send HTTP request to web server.");
+            fprintf(stderr, "Error writing request to web server\n");
+            return -1;
+        }
+
+        /* Forward server data to client */
+
+        if (verbose)
+            printf("Awaiting website response\n");
+
+        rc = web_to_client(webfd, fd, name, dir, port, keepAlive,
+            &webReusable, fl);
+
+        if (rc == -2 && reused)
+        {
+            connpool_drop(origins, name, port, webfd);
+            continue;
+        }
 
-    if (web_to_client(webfd, fd, name, dir, port) == -1)
+        break;
+    }
+
+    if (rc < 0)
     {
         clienterror(fd, method, "502", "Bad Gateway",
                 "Proxy could not read web data from web server");
         fprintf(stderr, "Error forwarding web data to client\n");
-        return;
+        connpool_drop(origins, name, port, webfd);
+        return -1;
     }
 
     if (verbose)
     	printf("Served webpage\n");
 
-    close(webfd);
+    if (webReusable)
+        connpool_put(origins, name, port, webfd);
+    else
+        connpool_drop(origins, name, port, webfd);
+
+    return rc;
 }
 
 /*******************
  * Web Communication
  *******************/
 
-/*  Send the HTTP request line to the web server.
-    fd is a file descriptor to the web server.
-    dir is the directory of the file the client wants */
-int send_request(int fd, char *dir)
+/*  Sends a request for dir to the web server on webfd: the request
+    line, the client's headers in hdrs, the proxy's own headers and
+    the terminating blank line. The server is asked to keep the
+    connection open when connections are pooled. The request is built
+    whole and sent in one write, so it leaves in as few segments as it
+    fits in (the socket has TCP_NODELAY set; see connpool_get).
+    Returns -1 on error. */
+int send_upstream(int webfd, char *dir, const char *hdrs, int hdrsLen,
+    struct client_hdrs *h, const char *name)
 {
-    char request[MAXLINE] = "GET /";
-    strcat(request, dir);
-    strcat(request, " HTTP/1.0\r\n");
-    int reqLen = strlen(request);
+    char req[MAXLINE + MAX_HEAD + MAXLINE];
+    int len, n;
+
+    len = snprintf(req, MAXLINE, "GET /%s HTTP/1.0\r\n", dir);
+    if (len >= MAXLINE || hdrsLen > MAX_HEAD)
+        return -1;
 
-    if (reqLen != rio_writen(fd, request, reqLen))
+    memcpy(req + len, hdrs, hdrsLen);
+    len += hdrsLen;
+
+    n = format_proxyheaders(req + len, sizeof(req) - len - 2,
+        h->hostSpecified, name, poolIdle > 0);
+    if (n < 0)
         return -1;
+    len += n;
+
+    //Terminating line
+    memcpy(req + len, "\r\n", 2);
+    len += 2;
 
     if (verbose)
-        printf("New Request:\n%s", request);
+        printf("New Request:\n%.*s", len, req);
 
-    return 0;
+    return rio_writen(webfd, req, len) == len ? 0 : -1;
+}
+
+/*  Decides whether a client header should be forwarded to the web
+    server. Returns 0 for headers the proxy replaces with its own
+    (User-Agent, Accept, Accept-Encoding, Connection and
+    Proxy-Connection), and for Keep-Alive, which like them only
+    concerns the client's own connection, and 1 otherwise. Notes a
+    Host header and the client's keep-alive preference in h. */
+int forward_header(const struct http_header *hd, struct client_hdrs *h)
+{
+    switch (hd->id)
+    {
+    case HTTP_HOST:
+        h->hostSpecified = 1;
+        return 1;
+
+    case HTTP_CONNECTION:
+    case HTTP_PROXY_CONNECTION:
+        if (http_slice_prefix(hd->value, "close"))
+            h->keepAlive = 0;
+        else if (http_slice_prefix(hd->value, "keep-alive"))
+            h->keepAlive = 1;
+        return 0;
+
+    case HTTP_KEEP_ALIVE:
+    case HTTP_USER_AGENT:
+    case HTTP_ACCEPT:
+    case HTTP_ACCEPT_ENCODING:
+        return 0;
+
+    default:
+        return 1;
+    }
 }
 
-/*  Send the proxy headers to the web server
-    webfd is a file descriptor to the web server
-    hostSpecified is true iff the client has already specified a
-        host (in which case we simply use the host the client specified)
-    name is the name of the web server */
-int send_proxyheaders(int webfd, int hostSpecified, const char *name)
+/*  Formats the headers the proxy adds to every request into buf,
+    which has room for size bytes, including the Host header if the
+    client did not send one. keepAlive asks the server to keep the
+    connection open. Returns the length written or -1 if buf is too
+    small. */
+int format_proxyheaders(char *buf, int size, int hostSpecified,
+    const char *name, int keepAlive)
 {
+    int len = snprintf(buf, size, "%s%s%s%s%s%s%s%s",
+        hostSpecified ? "" : "Host: ", hostSpecified ? "" : name,
+        hostSpecified ? "" : "\r\n", user_agent_hdr, accept_hdr,
+        accept_encoding_hdr, keepAlive ? keepalive_connect_hdr : connect_hdr,
+        keepAlive ? keepalive_proxy_connect_hdr : proxy_connect_hdr);
 
-/* Error handled macro that saves a lot of repetitive code.
-Sends msg to fd, returns -1 on error. */
-#define RIO_WRITEN(FD, MSG) \
-{ \
-    strcpy(buf, MSG); \
-    int msgsize = strlen(buf); \
-    if (rio_writen(FD, buf, msgsize) != msgsize) \
-        return -1; \
-    if (verbose) \
-        printf("%s", buf); \
+    if (len < 0 || len >= size)
+        return -1;
+    return len;
 }
 
+/*  Forwards web page from web server to client.
+    Caches web data if it fits within MAX_OBJECT_SIZE
+    webfd is file descriptor for web server.
+    fd is file descriptor for client.
+    name, dir, port are the server's name, directory, port
+    keepAlive is set if the client asked to keep its connection.
+    fl, if not NULL, is the flight other requests follow.
+    A body with a Content-Length is read no further than that, and
+    *webReusable is set if webfd can then carry another request.
+    A head too big to rewrite is passed on as it is, and the rest of
+    the response after it up to EOF.
+    Returns -2 if the server closed or the read failed before any of
+    the response arrived, -1 on any other error, otherwise 1 if the
+    response was framed so that the client connection can be reused
+    and 0 if not. */
+int web_to_client(int webfd, int fd, char *name, char *dir, int port,
+    int keepAlive, int *webReusable, struct flight *fl)
+{
+    struct fill f;
+    struct response_info r = { -1, 0 };
+    char head[MAX_HEAD];
     char buf[MAXLINE];
-    
-    if (!hostSpecified) //Host header
-    {
-        strcpy(buf, "Host: ");
-        strcat(buf, name);
-        strcat(buf, "\r\n");
-        int msgsize = strlen(buf);
-        
-        if (rio_writen(webfd, buf, msgsize) != msgsize)
-            return -1;
-        if (verbose)
-            printf("%s", buf);
+    int headLen = 0, headDone = 0, over = 0;
+    int len, rc = 0, wanted = 1;
+    long left;
+    rio_t rioWeb;
+
+    *webReusable = 0;
+
+    /* Read the response head so it can be rewritten for the client */
+
+    rio_readinitb(&rioWeb, webfd);
+
+    while (!headDone && (len = rio_readlineb(&rioWeb, buf, MAXLINE)) > 0)
+    {
+        // The line that doesn't fit follows what does
+        if (headLen + len > MAX_HEAD)
+        {
+            over = len;
+            break;
+        }
+
+        memcpy(head + headLen, buf, len);
+        headLen += len;
+        headDone = !strcmp(buf, "\r\n") || !strcmp(buf, "\n");
     }
 
-    RIO_WRITEN(webfd, user_agent_hdr);
-    RIO_WRITEN(webfd, accept_hdr);
-    RIO_WRITEN(webfd, accept_encoding_hdr);
-    RIO_WRITEN(webfd, connect_hdr);
-    RIO_WRITEN(webfd, proxy_connect_hdr);
-    return 0;
+    if (headLen == 0)
+        return -2;
 
-#undef RIO_WRITEN
-}
+    if (headDone)
+        len = send_response_head(fd, head, headLen, -1, keepAlive, -1, &r);
+    else
+        len = rio_writen(fd, head, headLen) == headLen
+            && rio_writen(fd, buf, over) == over ? 0 : -1;
 
-/*  forwards data from client to web server, hostSpecified
-    is set to 1 if the client specifies the host and 0 otherwise.
-    Ignores headers defined in change_headers
-    rio is RIO state for the client.
-    webfd is a file descriptor for the webserver. */
-int client_to_web(rio_t rio, int webfd, int *hostSpecified)
-{
-    char* headIdx;
-    char header[MAXLINE];
-    char buf[MAXLINE];
-    int len;
-    *hostSpecified = 0;
+    if (len == -1)
+        return -1;
 
-    while ((len = rio_readlineb(&rio, buf, MAXLINE)) != 2)
+    fill_start(&f, name, dir, port, headLen, r.contentLength, fl);
+    fill_append(&f, head, headLen);
+    if (over > 0)
+        fill_append(&f, buf, over);
+
+    /* Relay the body, up to its Content-Length if it has one */
+
+    left = r.contentLength;
+
+    if (useUring)
     {
-        if (len < 2)
-            return -1;
+        // Part of the body may already be sitting in rioWeb's buffer
+        if ((len = rioWeb.rio_cnt) > 0)
+        {
+            if (left >= 0 && len > left)
+                len = left;
+            if (rio_writen(fd, rioWeb.rio_bufptr, len) != len)
+                rc = -1;
+            fill_append(&f, rioWeb.rio_bufptr, len);
+            if (left >= 0)
+                left -= len;
+        }
+
+        if (rc == 0)
+            rc = uring_relay(webfd, fd, left, fill_append, &f);
+    }
 
-        //Process header
+    else
+    {
+        while (left != 0 && (wanted = fill_wanted(&f))
+            && (len = rio_readnb(&rioWeb, buf,
+                left >= 0 && left < MAXLINE ? left : MAXLINE)) != 0)
+        {
+            if (len < 0 || len != rio_writen(fd, buf, len))
+            {
+                rc = -1;
+                break;
+            }
 
-        headIdx = strchr(buf, ':');
+            fill_append(&f, buf, len);
+            if (left >= 0)
+                left -= len;
+        }
 
-        if (headIdx)
+        // Once no one needs a copy, the rest goes socket to socket,
+        // starting with whatever rioWeb has read ahead
+        if (rc == 0 && left != 0 && !wanted)
         {
-            //Extract the header
-            size_t headSize = (size_t)(headIdx-buf);
-            strncpy(header, buf, headSize);
-            header[headSize] = '\0';
-            strip_space(header);
+            len = rioWeb.rio_cnt;
+            if (left >= 0 && len > left)
+                len = left;
 
-            if (!strcasecmp(header, "Host"))
-                *hostSpecified = 1;
+            if (len > 0 && rio_writen(fd, rioWeb.rio_bufptr, len) != len)
+                rc = -1;
+            else
+            {
+                f.total += len;
+                if (left >= 0)
+                    left -= len;
+                rc = splice_to_client(webfd, fd, left, &f.total);
+            }
+        }
+    }
+
+    fill_finish(&f, rc == 0);
+
+    if (rc == -1)
+        return -1;
+
+    // Only a body of exactly the advertised length keeps the client
+    // (and the server) in sync for the next request
+    int complete = r.contentLength >= 0
+        && f.total - headLen == r.contentLength;
+
+    *webReusable = complete && r.keepAlive;
+    return keepAlive && complete;
+}
+
+/*  Relays a body no one keeps a copy of from webfd to the client on
+    fd through a pipe, so that it is never copied into user space:
+    left bytes of it, or all of it up to EOF if left is -1. Adds the
+    bytes relayed to *relayed. Returns -1 on error, otherwise 0. */
+int splice_to_client(int webfd, int fd, long left, long *relayed)
+{
+    int p[2], rc = 0;
+    ssize_t n, out;
+
+    if (pipe(p) < 0)
+        return -1;
+
+    while (rc == 0 && left != 0)
+    {
+        n = splice(webfd, NULL, p[1], NULL,
+            left >= 0 && left < SPLICE_CHUNK ? left : SPLICE_CHUNK,
+            SPLICE_F_MOVE);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            rc = n < 0 ? -1 : 0;
+            break;
+        }
 
-            if (in_list(header, change_headers, 5))
+        // Drain the pipe before filling it again
+        while (n > 0)
+        {
+            out = splice(p[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+
+            if (out < 0 && errno == EINTR)
                 continue;
+            if (out <= 0)
+            {
+                rc = -1;
+                break;
+            }
+
+            n -= out;
+            *relayed += out;
+            if (left >= 0)
+                left -= out;
         }
+    }
 
-        if (verbose)
-            printf("%s", buf);
+    close(p[0]);
+    close(p[1]);
+    return rc;
+}
 
-        //Forward line to web server
+/*  Whether a response of total bytes, head included, could be cached
+    at all: in memory, or failing that in the disk tier */
+int cacheable_size(long total)
+{
+    return total <= MAX_OBJECT_SIZE || (webStore->disk != NULL
+        && total <= disk_max_object(webStore->disk));
+}
 
-        if (len != rio_writen(webfd, buf, len))
-            return -1;
+/*  Sets f up to collect the response to a request for name, dir, port,
+    whose head is headLen bytes and whose body is contentLength bytes
+    (-1 if unknown), for the cache and for followers of fl (if not
+    NULL). A response that fits in memory goes into the entry it will
+    be cached in, reserved up front if the cache has room for it
+    without evicting anything, and otherwise into the worker's fill
+    buffer, to be given room once it is complete; one the cache would
+    turn away for its size is not collected at all. A slow fetch thus
+    holds only memory that was free, and a failed one evicts nothing. */
+void fill_start(struct fill *f, char *name, char *dir, int port,
+    int headLen, long contentLength, struct flight *fl)
+{
+    long total = contentLength >= 0 ? headLen + contentLength : -1;
+
+    f->entry = NULL;
+    f->disk = NULL;
+    f->size = 0;
+    f->total = 0;
+    f->flight = fl;
+    f->name = name;
+    f->dir = dir;
+    f->port = port;
+
+    if (total >= 0 && !cacheable_size(total))
+        f->size = -1;
+
+    else if (total >= 0 && total <= MAX_OBJECT_SIZE
+        && (f->entry = reserve_cache(name, dir, port, total, 0)) != NULL)
+    {
+        f->buf = f->entry->data;
+        f->capacity = total;
     }
 
-    return 0;
+    // Bigger ones only get here with a disk tier to spill to
+    else
+    {
+        f->buf = fill_buffer();
+        f->capacity = MAX_OBJECT_SIZE;
+    }
 }
 
-/*  Forwards web page from web server to client.
-    Caches web data if it fits within MAX_OBJECT_SIZE
-    webfd is file descriptor for web server.
-    fd is file descriptor for client.
-    name, dir, port are the server's name, directory, port */
-int web_to_client(int webfd, int fd, char *name, char *dir, int port)
+/*  The calling worker's fill buffer, MAX_OBJECT_SIZE bytes kept from
+    one response to the next */
+char *fill_buffer(void)
 {
-    rio_t rioWeb;
-    rio_readinitb(&rioWeb, webfd);
-    char buf[MAXLINE];
-    int len;
+    if (fillBuf == NULL)
+    {
+        fillBuf = Malloc(MAX_OBJECT_SIZE);
+        pthread_setspecific(fillKey, fillBuf);
+    }
+    return fillBuf;
+}
+
+/*  Appends len bytes of a response to the fill vargp, or gives up on
+    caching the response once it outgrows f->capacity (or the length of
+    its disk record). Followers of the fetch see every byte either
+    way. */
+void fill_append(void *vargp, const char *data, int len)
+{
+    struct fill *f = (struct fill *)vargp;
+
+    f->total += len;
 
-    char *cacheBuf = malloc(MAX_OBJECT_SIZE);
-    char *cacheBufHead = cacheBuf;
-    int cacheBufSize = 0;
+    if (f->flight != NULL)
+        flight_append(inflight, f->flight, data, len);
+
+    if (f->size == -1)
+        return;
 
-    while ((len = rio_readnb(&rioWeb, buf, MAXLINE)) != 0)
+    // Only the fill buffer can spill over
+    if (f->disk == NULL && f->size + len > f->capacity)
     {
-        if (len < 0)
+        if (f->entry != NULL || (f->disk = spill_to_disk(f->name, f->dir,
+            f->port, f->buf, f->size)) == NULL)
         {
-            free(cacheBuf);
-            return -1;
+            f->size = -1;
+            return;
         }
+    }
 
-        if (len != rio_writen(fd, buf, len))
+    if (f->disk != NULL)
+    {
+        if (f->size + len <= f->disk->dataSize)
         {
-            free(cacheBuf);
-            return -1;
+            memcpy(disk_data(f->disk) + f->size, data, len);
+            f->size += len;
         }
+        else
+            f->size = -1;
+    }
 
-        if (cacheBufSize != -1)
-        {
-            cacheBufSize += len;
+    else
+    {
+        memcpy(f->buf + f->size, data, len);
+        f->size += len;
+    }
+}
 
-            if (cacheBufSize <= MAX_OBJECT_SIZE)
-            {
-                memcpy(cacheBufHead, buf, len);
-                cacheBufHead += len;
-            }
+/*  Whether anyone still wants a copy of the response being relayed
+    into f: the cache, or followers of its flight, including any that
+    may yet attach to it. A response too big to cache keeps going
+    through the flight for them until it is no longer followed. */
+int fill_wanted(struct fill *f)
+{
+    return f->size != -1
+        || (f->flight != NULL && flight_followed(inflight, f->flight));
+}
 
-            else
-                cacheBufSize = -1;
+/*  Hands what f collected over to the cache if ok, i.e. the response
+    ended cleanly, and it is all there: one in the fill buffer through
+    an entry reserved now that its size is known (or, if the cache
+    won't reserve one, for it to copy and count), one on disk by
+    committing its record. Otherwise lets go of what f holds. */
+void fill_finish(struct fill *f, int ok)
+{
+    if (f->disk != NULL)
+    {
+        if (ok && f->size == f->disk->dataSize)
+            disk_commit(f->disk);
+        else
+            disk_abort(f->disk);
+        return;
+    }
+
+    if (!ok || f->size == -1)
+    {
+        if (f->entry != NULL)
+            web_data_release(f->entry);
+        return;
+    }
+
+    if (f->entry == NULL)
+    {
+        if ((f->entry = reserve_cache(f->name, f->dir, f->port,
+            f->size, 1)) == NULL)
+        {
+            cache_insert(webStore, f->name, f->dir, f->port, f->buf,
+                f->size);
+            return;
         }
+        memcpy(f->entry->data, f->buf, f->size);
+    }
+
+    f->entry->data_size = f->size;
+    store_cache(f->entry);
+}
+
+/*  Moves the start of a response that has outgrown MAX_OBJECT_SIZE,
+    the size bytes at data, to a record for name, dir, port in the disk
+    tier for the rest to be appended to. Only a response whose head
+    gives its Content-Length, so that the record can be sized up front,
+    and that fits the tier is kept. Returns the record, pinned, or
+    NULL. */
+disk_rec spill_to_disk(char *name, char *dir, int port, const char *data,
+    int size)
+{
+    const char *end, *p;
+    long total = -1;
+    disk_rec rec;
+
+    if (webStore->disk == NULL
+        || (end = memmem(data, size, "\r\n\r\n", 4)) == NULL)
+        return NULL;
+
+    for (p = data; p != NULL && p < end; )
+    {
+        const char *eol = memchr(p, '\n', end - p);
+
+        if (!strncasecmp(p, "Content-Length:", 15)
+            && (total = parse_length(p + 15, eol ? eol : end)) >= 0)
+            total += end + 4 - data;
+        if ((p = eol) != NULL)
+            p++;
+    }
+
+    if (total <= size || total > disk_max_object(webStore->disk)
+        || (rec = disk_begin(webStore->disk, name, dir, port,
+            total)) == NULL)
+        return NULL;
+
+    memcpy(disk_data(rec), data, size);
+    return rec;
+}
+
+/*  Sends dataSize bytes of a cached response from data to the client,
+    specified by file descriptor fd. The first headLen bytes are the
+    response head, which is rewritten for the client; since the whole
+    body is known it is always framed with an exact Content-Length, and
+    the response is age seconds old. The head and the body go out in
+    one write if the socket takes them. Returns -1 on error, otherwise
+    1 if the client connection can be reused and 0 if not. */
+int cache_to_client(const char *data, int dataSize, int headLen, long age,
+    int fd, int keepAlive)
+{
+    struct response_info r;
+    char head[MAX_HEAD + MAXLINE];
+    struct iovec iov[2];
+    int i, n = 0, outLen, flags = 0, one = 1, reusable = 0;
+    unsigned sends = 0;
+
+    if (headLen > 0 && (outLen = format_response_head(head, data, headLen,
+        dataSize - headLen, keepAlive, age, &r)) >= 0)
+    {
+        iov[n].iov_base = head;
+        iov[n++].iov_len = outLen;
+        reusable = keepAlive && r.contentLength >= 0;
+        data += headLen;
+        dataSize -= headLen;
+    }
+
+    // Otherwise the response goes as it is
+    iov[n].iov_base = (void *)data;
+    iov[n++].iov_len = dataSize;
+
+    if (useUring)
+    {
+        for (i = 0; i < n; i++)
+            if (rio_writen(fd, iov[i].iov_base, iov[i].iov_len)
+                != (ssize_t)iov[i].iov_len)
+                return -1;
+        return reusable;
+    }
+
+    if (zeroCopy && dataSize >= ZEROCOPY_MIN
+        && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+        flags = MSG_ZEROCOPY;
+
+    if (send_iov(fd, iov, n, flags, &sends) == 0
+        && (sends == 0 || zerocopy_wait(fd, sends) == 0))
+        return reusable;
+
+    // The kernel may still be sending from data, which the caller is
+    // about to let go of, so the connection is reset rather than left
+    // to send whatever takes its place
+    if (sends > 0)
+    {
+        struct linger reset = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
     }
+    return -1;
+}
 
+/*  Writes n buffers from iov to fd in as few calls as the socket will
+    take them in, usually one, with send flags. *sends counts the calls
+    made with MSG_ZEROCOPY, which is dropped from flags if the kernel
+    runs out of room to pin pages for it. Modifies iov.
+    Returns -1 on error. */
+int send_iov(int fd, struct iovec *iov, int n, int flags, unsigned *sends)
+{
+    struct msghdr msg;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
 
-    if (cacheBufSize != -1)
+    while (msg.msg_iovlen > 0)
     {
-        P(&write_m);
-        cache_insert(webStore, name, dir, port, cacheBuf, cacheBufSize);
-        V(&write_m);
+        if ((len = sendmsg(fd, &msg, flags)) < 0)
+        {
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+                flags &= ~MSG_ZEROCOPY;
+            else if (errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        if (flags & MSG_ZEROCOPY)
+            (*sends)++;
+
+        // Skip what was sent
+        while (msg.msg_iovlen > 0 && len >= (ssize_t)msg.msg_iov->iov_len)
+        {
+            len -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + len;
+            msg.msg_iov->iov_len -= len;
+        }
     }
 
-    free(cacheBuf);
     return 0;
 }
 
-/*  Sends dataSize bytes from data to the client, specified by
-    file descriptor fd */
-int cache_to_client(const char* data, int dataSize, int fd)
+/*  Waits until the kernel has said, on fd's error queue, that it is
+    done with the buffers of all sends calls made with MSG_ZEROCOPY.
+    Returns -1 on error or if that takes ZEROCOPY_WAIT_MS at a time. */
+int zerocopy_wait(int fd, unsigned sends)
 {
-    int dataTransfer = 0;
-    int len;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *err;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    unsigned done = 0;
 
-    while (dataTransfer < dataSize)
+    while (done < sends)
     {
-        len = min(MAXLINE, dataSize-dataTransfer);
+        // A notification makes fd report an error
+        struct pollfd p = { fd, 0, 0 };
+        int ready = poll(&p, 1, ZEROCOPY_WAIT_MS);
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            return -1;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-        if (len != rio_writen(fd, (void *)data, len))
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
             return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            err = (struct sock_extended_err *)CMSG_DATA(cm);
 
-        data += len;
-        dataTransfer += len;
+            // Each covers a range of calls, numbered by the kernel
+            if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0)
+                done += err->ee_data - err->ee_info + 1;
+        }
     }
 
-    assert(dataTransfer == dataSize);
     return 0;
 }
 
+/*  Sends the response in disk record rec to the client on fd, its
+    head rewritten like cache_to_client's and its body straight from
+    the disk tier's file with sendfile. Returns -1 on error, otherwise
+    1 if the client connection can be reused and 0 if not. */
+int disk_to_client(disk_rec rec, int fd, int keepAlive)
+{
+    struct response_info r;
+    long off = disk_head_size(rec);
+    int reusable = 0;
+
+    if (off > 0)
+    {
+        if (send_response_head(fd, disk_data(rec), off, rec->dataSize - off,
+            keepAlive, time(NULL) - rec->stored, &r) == -1)
+            return -1;
+
+        reusable = keepAlive && r.contentLength >= 0;
+    }
+
+    while (off < rec->dataSize)
+    {
+        if (disk_sendfile(rec, fd, &off, rec->dataSize) <= 0)
+            return -1;
+    }
+
+    return reusable;
+}
+
+/*  Bytes of the response in disk record rec up to and including the
+    blank line after its head, or 0 if it has none within MAX_HEAD */
+int disk_head_size(disk_rec rec)
+{
+    const char *data = disk_data(rec);
+    const char *end = memmem(data, min(rec->dataSize, MAX_HEAD),
+        "\r\n\r\n", 4);
+
+    return end ? end + 4 - data : 0;
+}
+
+/*  Relays a response another request is fetching to the client on fd,
+    as it arrives. r is the follower's place in that fetch. The head is
+    rewritten for the client like any other.
+    Returns -2 if the fetch failed before anything was sent, so the
+    caller may fetch for itself, -1 on any other error, otherwise 1 if
+    the client connection can be reused and 0 if not. */
+int flight_to_client(struct flight_reader *r, int fd, int keepAlive)
+{
+    struct response_info info = { -1, 0 };
+    char head[MAX_HEAD];
+    char buf[MAXLINE];
+    const char *end = NULL;
+    int headLen = 0, len = 0;
+    long body;
+
+    /* Collect the head; the last read may run into the body */
+
+    while (headLen < MAX_HEAD
+        && !(end = memmem(head, headLen, "\r\n\r\n", 4)))
+    {
+        if ((len = flight_read(inflight, r, head + headLen,
+            MAX_HEAD - headLen)) <= 0)
+            break;
+        headLen += len;
+    }
+
+    if (len < 0 || headLen == 0)
+        return -2;
+
+    if (end != NULL)
+    {
+        int n = (int)(end + 4 - head);
+
+        if (send_response_head(fd, head, n, -1, keepAlive, -1, &info) == -1)
+            return -1;
+        if (rio_writen(fd, head + n, headLen - n) != headLen - n)
+            return -1;
+        body = headLen - n;
+    }
+
+    // Not a head we can rewrite, so pass it on and close afterwards
+    else
+    {
+        if (rio_writen(fd, head, headLen) != headLen)
+            return -1;
+        body = 0;
+    }
+
+    /* Relay the rest */
+
+    while ((len = flight_read(inflight, r, buf, MAXLINE)) > 0)
+    {
+        if (rio_writen(fd, buf, len) != len)
+            return -1;
+        body += len;
+    }
+
+    if (len < 0)
+        return -1;
+
+    return keepAlive && info.contentLength >= 0
+        && body == info.contentLength;
+}
+
+/*  Sends a response head (status line and headers, ending with the
+    blank line) to the client on fd, rewritten by format_response_head,
+    or as it is if it can't be. Returns -1 on error. */
+int send_response_head(int fd, const char *head, int headLen, int bodyLen,
+    int keepAlive, long age, struct response_info *r)
+{
+    char out[MAX_HEAD + MAXLINE];
+    int outLen = format_response_head(out, head, headLen, bodyLen,
+        keepAlive, age, r);
+
+    if (outLen < 0)
+        return rio_writen(fd, (void *)head, headLen) == headLen ? 0 : -1;
+
+    return rio_writen(fd, out, outLen) == outLen ? 0 : -1;
+}
+
+/*  Rewrites a response head for the client into out, which has room
+    for MAX_HEAD + MAXLINE bytes. Hop-by-hop headers are dropped
+    and replaced by a Connection header of our own: keep-alive if the
+    client asked for it (keepAlive) and the body is framed by a
+    Content-Length, close otherwise. If bodyLen >= 0 the Content-Length
+    is set to it; one that is not a number is dropped, and the body
+    taken to run to EOF. If age >= 0 the response comes from the cache, where
+    it has been for age seconds: it gets a Via header and an Age header
+    that counts those too. Stores the body length the client will
+    expect in r->contentLength (-1 if it reads to EOF) and whether the
+    server means to keep its connection open in r->keepAlive.
+    Returns the length of the head in out, or -1 if head is not one
+    that can be rewritten. */
+int format_response_head(char *out, const char *head, int headLen,
+    int bodyLen, int keepAlive, long age, struct response_info *r)
+{
+    char line[MAXLINE];
+    const char *p = head, *end = head + headLen;
+    int outLen = 0, status = 0, first = 1, badLength = 0;
+
+    r->contentLength = -1;
+    r->keepAlive = 0;
+
+    // Not an HTTP/1.x head we can safely rewrite
+    if (headLen > MAX_HEAD || strncmp(head, "HTTP/", 5)
+        || sscanf(head, "%*s %d", &status) != 1)
+        return -1;
+
+    // HTTP/1.1 servers keep connections open unless they say otherwise
+    r->keepAlive = strncmp(head, "HTTP/1.0", 8) != 0;
+
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        int lineLen = eol ? (int)(eol - p) + 1 : (int)(end - p);
+        int copy = min(lineLen, MAXLINE - 1);
+
+        memcpy(line, p, copy);
+        line[copy] = '\0';
+        p += lineLen;
+
+        // The blank line is added back after our own headers
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n"))
+            break;
+
+        // Everything after the status line is a header
+        char *colon = first ? NULL : strchr(line, ':');
+        first = 0;
+
+        if (colon)
+        {
+            char header[MAXLINE];
+            int headSize = (int)(colon - line);
+            strncpy(header, line, headSize);
+            header[headSize] = '\0';
+            strip_space(header);
+
+            if (!strcasecmp(header, "Connection"))
+            {
+                const char *value = colon + 1 + strspn(colon + 1, " \t");
+
+                if (!strncasecmp(value, "close", 5))
+                    r->keepAlive = 0;
+                else if (!strncasecmp(value, "keep-alive", 10))
+                    r->keepAlive = 1;
+            }
+
+            if (in_list(header, hop_headers, 3))
+                continue;
+
+            // Age it had upstream, to add ours to
+            if (age >= 0 && !strcasecmp(header, "Age"))
+            {
+                age += atol(colon + 1);
+                continue;
+            }
+
+            // A length that doesn't parse can't frame the body, which
+            // then runs to EOF on a connection that is not kept
+            if (!strcasecmp(header, "Content-Length"))
+            {
+                if (bodyLen >= 0)
+                    continue;
+                if ((r->contentLength = parse_length(colon + 1,
+                    line + copy)) < 0)
+                {
+                    badLength = 1;
+                    continue;
+                }
+            }
+        }
+
+        memcpy(out + outLen, line, copy);
+        outLen += copy;
+    }
+
+    // These never carry a body
+    if (status == 204 || status == 304 || (status >= 100 && status < 200))
+        r->contentLength = 0;
+
+    else if (badLength)
+    {
+        r->contentLength = -1;
+        r->keepAlive = 0;
+    }
+
+    else if (bodyLen >= 0)
+    {
+        r->contentLength = bodyLen;
+        outLen += sprintf(out + outLen, "Content-Length: %d\r\n", bodyLen);
+    }
+
+    if (age >= 0)
+        outLen += sprintf(out + outLen, "Age: %ld\r\nVia: 1.1 %s\r\n",
+            age, VIA_NAME);
+
+    outLen += sprintf(out + outLen, "Connection: %s\r\n\r\n",
+        keepAlive && r->contentLength >= 0 ? "keep-alive" : "close");
+
+    if (verbose)
+        printf("Response head:\n%s", out);
+
+    return outLen;
+}
+
 /*****************
  * Signal Handling
  *****************/
 
-/* Custom sig-int handler to free cache memory and gracefully exit */
-void sigint_handler(int sig)
+/*  Waits for SIGINT or SIGTERM, which every thread blocks, then shuts
+    the proxy down and exits. Accepting stops first: the accept loops
+    (acceptors, with the threaded engine) are woken by shutting their
+    listeners down and joined and idle kept-alive connections closed,
+    or the event loops told to stop. The
+    requests already being served get SHUTDOWN_SECS to finish, and
+    only then is the cache saved (with -s) and freed. A request still
+    running after that may be sending cache entries, so the cache is
+    saved but left for exit to reclaim. */
+void wait_for_shutdown(sigset_t *signals, struct listener *listeners,
+    pthread_t *acceptors, int nlisten, int useEpoll)
 {
-    cache_free(webStore);
+    int sig, i, drained;
+
+    while (sigwait(signals, &sig) != 0)
+        ;
+
+    pthread_mutex_lock(&stopLock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&stopCond);
+    pthread_mutex_unlock(&stopLock);
+
+    if (useEpoll)
+        drained = event_stop(SHUTDOWN_SECS) == 0;
+    else
+    {
+        for (i = 0; i < nlisten; i++)
+            shutdown(listeners[i].fd, SHUT_RDWR);
+        for (i = 0; i < nlisten; i++)
+            pthread_join(acceptors[i], NULL);
+        if (parked != NULL)
+            idle_stop(parked);
+
+        drained = tpool_drain(workers, SHUTDOWN_SECS) == 0;
+    }
+
+    if (snapshotPath != NULL && snapshotSecs > 0)
+        pthread_join(snapshotThread, NULL);
+
+    if (webStore->compress)
+        printf("Cached bodies compressed %.2fx\n", cache_ratio(webStore));
+    if (snapshotPath != NULL && snapshot_save(webStore, snapshotPath) == -1)
+        fprintf(stderr, "Could not save the cache to %s\n", snapshotPath);
+
+    if (drained)
+        cache_free(webStore);
+    else
+        fprintf(stderr, "Requests still running after %d seconds\n",
+            SHUTDOWN_SECS);
+
     printf("Thank you for using AR proxy!\n");
     exit(1);
 }
@@ -474,34 +1667,120 @@ void sigint_handler(int sig)
  * Cache Functions
  *****************/
 
+/*  Saves the cache to snapshotPath every snapshotSecs seconds, so a
+    proxy that is killed rather than interrupted still starts warm.
+    Returns once the proxy starts shutting down. */
+void *snapshot_loop(void *vargp)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&stopLock);
+
+    while (!stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += snapshotSecs;
+
+        if (pthread_cond_timedwait(&stopCond, &stopLock, &deadline)
+            != ETIMEDOUT || stopping)
+            continue;
+
+        pthread_mutex_unlock(&stopLock);
+        if (snapshot_save(webStore, snapshotPath) == -1)
+            fprintf(stderr, "Could not save the cache to %s\n",
+                snapshotPath);
+        pthread_mutex_lock(&stopLock);
+    }
+
+    pthread_mutex_unlock(&stopLock);
+    return NULL;
+}
+
 /*  Thread safe function that gets web data specified by
     name, dir, port of web server. Returns NULL if no corresponding
-    entry exists in the cache. Otherwise, returns pointer to the data
-    (which should not be modified), and stores size of data in 
-    *dataSize */
-const char *retrieve_cache(char *name, char *dir, int port, int *dataSize)
+    entry exists in the cache. Otherwise, returns the entry (whose data
+    should not be modified), pinned so that it can be sent without
+    holding any lock. Release it with web_data_release when done. */
+web_data retrieve_cache(char *name, char *dir, int port)
 {
-    P(&read_m);
-    if (read_cnt == 0)
-        P(&write_m);
-    read_cnt++;
-    V(&read_m);
+    return cache_lookup(webStore, name, dir, port);
+}
 
-    const char *data = cache_get(webStore, name, dir, port, dataSize);
+/*  Thread safe function that looks name, dir, port up in the disk
+    tier once retrieve_cache has missed. Returns NULL if it isn't there,
+    otherwise its record, pinned until disk_release. */
+disk_rec retrieve_disk(char *name, char *dir, int port)
+{
+    return cache_lookup_disk(webStore, name, dir, port);
+}
 
-    P(&read_m);
-    read_cnt--;
-    if (read_cnt == 0)
-        V(&write_m);
-    V(&read_m);
+/*  Thread safe function that returns an empty entry for name, dir,
+    port with room for capacity bytes, for the caller to fill and pass
+    to store_cache (or web_data_release), or NULL if it would not be
+    cached. It only evicts to make room if evict is set. */
+web_data reserve_cache(char *name, char *dir, int port, int capacity,
+    int evict)
+{
+    return cache_reserve(webStore, name, dir, port, capacity, evict);
+}
 
-    return data;
+/*  Thread safe function that hands an entry filled by the caller,
+    from web_data_alloc or reserve_cache, over to the cache. The caller
+    must not touch w afterwards. */
+void store_cache(web_data w)
+{
+    cache_store(webStore, w);
 }
 
 /*****************
  * String Parsing
  *****************/
 
+/*  Parses an HTTP request line, from the request head req, into its
+    method and the server's name, dir and port, and resets h for the
+    headers that follow. On a malformed or unsupported request an error
+    is sent to the client on fd and -1 is returned. Otherwise returns 0.
+    method, name and dir must have room for MAXLINE bytes. */
+int parse_request(int fd, struct http_request *req, char *method,
+    char *name, char *dir, int *port, struct client_hdrs *h)
+{
+	char uri[MAXLINE];
+
+	method[0] = '\0';
+
+	// Room is left for get_uri_info to append a '/' to the uri
+	if (req->method.len >= MAXLINE || req->uri.len >= MAXLINE - 1)
+	{
+		clienterror(fd, method, "400", "Bad Request",
+                "Invalid syntax for GET request");
+        fprintf(stderr, "Request line too long\n");
+		return -1;
+	}
+
+	memcpy(method, req->method.p, req->method.len);
+	method[req->method.len] = '\0';
+	memcpy(uri, req->uri.p, req->uri.len);
+	uri[req->uri.len] = '\0';
+
+	if (strcasecmp(method, "GET"))
+	{ 
+        clienterror(fd, method, "501", "Not Implemented",
+                "Proxy only supports the GET method");
+        fprintf(stderr, "Invalid header format: %s %s\n", method, uri);
+        return -1;
+    }
+
+    /* Get hostname and port from URI */
+
+    get_uri_info(uri, name, dir, port);
+
+    // HTTP/1.1 connections are persistent unless the client says otherwise
+    h->hostSpecified = 0;
+    h->keepAlive = req->version.len == 8
+        && http_slice_prefix(req->version, "HTTP/1.1");
+    return 0;
+}
+
 /*  Ignores "http://" and the like in the uri
     For example if uri is "http://www.google.com" the
     pointer returned points to "www.google.com" */
@@ -590,10 +1869,69 @@ void strip_space (char *s)
 	s[sp_loc] = '\0';
 }
 
+/*  Parses a Content-Length value, which starts at s and ends at eol.
+    Returns it, or -1 unless it is all digits (with blanks around them
+    allowed) and fits in a long. */
+long parse_length (const char *s, const char *eol)
+{
+    char *end;
+    long n;
+
+    s += strspn(s, " \t");
+    if (s >= eol || !isdigit((unsigned char)*s))
+        return -1;
+
+    errno = 0;
+    n = strtol(s, &end, 10);
+    if (errno == ERANGE)
+        return -1;
+
+    while (end < eol && strchr(" \t\r\n", *end))
+        end++;
+    return end == eol ? n : -1;
+}
+
 /*****************
  * Utilities
  *****************/
 
+/* Print command line usage and exit */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t min_threads] [-T max_threads] "
+        "[-q queue_depth] [-i idle_secs] [-e threads|epoll] "
+        "[-n event_loops] [-u] [-l listeners] [-p] "
+        "[-k keepalive_secs] [-K keepalive_max] [-c pool_idle] "
+        "[-C pool_idle_secs] [-A pool_active] [-D dns_ttl] [-P lru|s3fifo|tinylfu|gdsf] "
+        "[-a admit_window] [-H] [-z] [-d disk_file] [-M disk_mb] "
+        "[-s snapshot_file] [-S snapshot_secs] [-Z] <port>\n", prog);
+    exit(1);
+}
+
+/*  getaddrinfo answered from the DNS cache, for io_ops */
+int cached_getaddrinfo(const char *node, const char *service,
+    const struct addrinfo *hints, struct addrinfo **res)
+{
+    return dns_getaddrinfo(resolver, node, service, hints, res);
+}
+
+/*  Pins the calling thread to cpu, wrapping around if there are
+    fewer CPUs than that */
+void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus <= 0)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "Could not pin thread to CPU %d\n", cpu % ncpus);
+}
+
 /* Return the min of 2 numbers */
 int min (int x, int y)
 {
@@ -610,11 +1948,12 @@ void clienterror(int fd, char *cause, char *errnum,
     char buf[MAXLINE], body[MAXBUF];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+        "<body bgcolor=""ffffff"">\r\n"
+        "%s: %s\r\n"
+        "<p>%s: %.4000s\r\n"
+        "<hr><em>The Tiny Web server</em>\r\n",
+        errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
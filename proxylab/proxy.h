@@ -0,0 +1,76 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "csapp.h"
+#include "web_data.h"
+#include "disk.h"
+#include "http.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Largest response head the proxy will rewrite */
+#define MAX_HEAD (4 * MAXLINE)
+
+/* How the proxy names itself in the Via header of cache hits */
+#define VIA_NAME "ar-proxy"
+
+/* With -Z, cache hit bodies at least this big are sent with
+   MSG_ZEROCOPY, and the kernel gets this long to say it is done with
+   them before the connection is reset */
+#define ZEROCOPY_MIN (64 * 1024)
+#define ZEROCOPY_WAIT_MS 5000
+
+/* Bytes of an uncacheable body moved through a pipe at a time */
+#define SPLICE_CHUNK (64 * 1024)
+
+/* How long a shutdown waits for the requests being served to finish */
+#define SHUTDOWN_SECS 10
+
+/* Default client keep-alive idle timeout and requests per connection */
+#define KEEPALIVE_SECS 5
+#define KEEPALIVE_MAX 100
+
+extern const int verbose;
+
+/* What the proxy learns from a client's request line and headers */
+struct client_hdrs
+{
+    int hostSpecified;      /* the client sent a Host header */
+    int keepAlive;          /* the client wants a persistent connection */
+};
+
+/* What the proxy learns from a response head */
+struct response_info
+{
+    long contentLength; /* body length, -1 if it runs to EOF */
+    int keepAlive;      /* the server will keep its connection open */
+};
+
+/* Request handling shared by the threaded and event-driven engines */
+int parse_request(int fd, struct http_request *req, char *method,
+    char *name, char *dir, int *port, struct client_hdrs *h);
+int forward_header(const struct http_header *hd, struct client_hdrs *h);
+int format_proxyheaders(char *buf, int size, int hostSpecified,
+    const char *name, int keepAlive);
+int format_response_head(char *out, const char *head, int headLen,
+    int bodyLen, int keepAlive, long age, struct response_info *r);
+
+/* Cache Functions */
+web_data retrieve_cache(char *name, char *dir, int port);
+disk_rec retrieve_disk(char *name, char *dir, int port);
+web_data reserve_cache(char *name, char *dir, int port, int capacity,
+    int evict);
+void store_cache(web_data w);
+disk_rec spill_to_disk(char *name, char *dir, int port, const char *data,
+    int size);
+int disk_head_size(disk_rec rec);
+int cacheable_size(long total);
+
+/* Utilities */
+void pin_to_cpu(int cpu);
+void clienterror(int fd, char *cause, char *errnum,
+    char *shortmsg, char *longmsg);
+
+#endif
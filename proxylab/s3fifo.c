@@ -0,0 +1,124 @@
+#include "policy.h"
+
+/* Share of a shard's bytes for the small queue new entries start on */
+#define S3FIFO_SMALL_PCT 10
+/* Slots of the ghost table remembering keys evicted from the small queue */
+#define S3FIFO_GHOSTS 1024
+/* Uses counted per entry, at most */
+#define S3FIFO_MAX_FREQ 3
+
+enum { S3FIFO_SMALL, S3FIFO_MAIN };
+
+/*
+ * S3-FIFO: three FIFO queues. New entries go on a small queue. When it is
+ * evicted from, entries used since they arrived move to the main queue
+ * and the rest go, leaving their key in a ghost table; a key that comes
+ * back while remembered there goes straight to the main queue. Entries at
+ * the tail of the main queue get another lap for each use counted. A hit
+ * only bumps a counter, so one-hit wonders and scans pass through the
+ * small queue without pushing out the working set.
+ *
+ * The ghost table is direct-mapped by key hash: a newer key overwrites
+ * an older one in its slot, which bounds it without a queue of its own.
+ */
+struct s3fifo
+{
+    struct policy_queue small;
+    struct policy_queue main;
+    long smallMax;
+    uint64_t ghosts[S3FIFO_GHOSTS];
+};
+
+static void *s3fifo_new (int capacity)
+{
+    struct s3fifo *S = calloc(1, sizeof(struct s3fifo));
+
+    S->smallMax = (long)capacity * S3FIFO_SMALL_PCT / 100;
+    return S;
+}
+
+static void s3fifo_free (void *P)
+{
+    free (P);
+}
+
+static void s3fifo_access (void *P, uint64_t hash)
+{
+}
+
+static void s3fifo_hit (void *P, web_data w)
+{
+    if (w->freq < S3FIFO_MAX_FREQ)
+        w->freq++;
+}
+
+static void s3fifo_insert (void *P, web_data w)
+{
+    struct s3fifo *S = P;
+    uint64_t *ghost = &S->ghosts[w->hash % S3FIFO_GHOSTS];
+
+    w->freq = 0;
+
+    if (*ghost == w->hash)
+    {
+        *ghost = 0;
+        w->queue = S3FIFO_MAIN;
+        policy_queue_push (&S->main, w);
+    }
+
+    else
+    {
+        w->queue = S3FIFO_SMALL;
+        policy_queue_push (&S->small, w);
+    }
+}
+
+static web_data s3fifo_evict (void *P)
+{
+    struct s3fifo *S = P;
+    web_data w;
+
+    for (;;)
+    {
+        if (S->small.tail && (S->small.bytes > S->smallMax
+            || S->main.tail == NULL))
+        {
+            w = S->small.tail;
+            policy_queue_remove (&S->small, w);
+
+            if (w->freq == 0)
+            {
+                S->ghosts[w->hash % S3FIFO_GHOSTS] = w->hash;
+                return w;
+            }
+
+            w->freq = 0;
+            w->queue = S3FIFO_MAIN;
+            policy_queue_push (&S->main, w);
+        }
+
+        else
+        {
+            w = S->main.tail;
+            policy_queue_remove (&S->main, w);
+
+            if (w->freq == 0)
+                return w;
+
+            w->freq--;
+            policy_queue_push (&S->main, w);
+        }
+    }
+}
+
+static void s3fifo_remove (void *P, web_data w)
+{
+    struct s3fifo *S = P;
+
+    policy_queue_remove (w->queue == S3FIFO_MAIN ? &S->main : &S->small, w);
+}
+
+const policy_ops_t policy_s3fifo = {
+    "s3fifo", s3fifo_new, s3fifo_free, s3fifo_access, s3fifo_hit,
+    s3fifo_insert, s3fifo_evict, s3fifo_remove
+};
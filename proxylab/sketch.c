@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include "sketch.h"
+
+static int sketch_slot (sketch S, uint64_t hash, int row);
+
+/*
+ * sketch_new - an empty sketch with at least width counters per row
+ */
+sketch sketch_new (int width)
+{
+    sketch S = malloc(sizeof(struct sketch_header));
+
+    S->width = 16;
+    while (S->width < width)
+        S->width *= 2;
+
+    S->counts = calloc(SKETCH_DEPTH, S->width);
+    S->additions = 0;
+    return S;
+}
+
+void sketch_free (sketch S)
+{
+    free (S->counts);
+    free (S);
+}
+
+/*
+ * sketch_add - count one more occurrence of hash
+ */
+void sketch_add (sketch S, uint64_t hash)
+{
+    int row, i;
+
+    for (row = 0; row < SKETCH_DEPTH; row++)
+    {
+        unsigned char *c = &S->counts[sketch_slot (S, hash, row)];
+        if (*c < SKETCH_MAX)
+            (*c)++;
+    }
+
+    if (++S->additions < (long)S->width * SKETCH_SAMPLE)
+        return;
+
+    for (i = 0; i < SKETCH_DEPTH * S->width; i++)
+        S->counts[i] >>= 1;
+    S->additions = 0;
+}
+
+/*
+ * sketch_estimate - how often hash has been added, lately
+ */
+int sketch_estimate (sketch S, uint64_t hash)
+{
+    int row, est = SKETCH_MAX;
+
+    for (row = 0; row < SKETCH_DEPTH; row++)
+    {
+        int c = S->counts[sketch_slot (S, hash, row)];
+        if (c < est)
+            est = c;
+    }
+    return est;
+}
+
+/*
+ * sketch_slot - the counter of hash in row. The key hash is remixed for
+ * each row so that keys colliding in one row rarely collide in the
+ * others.
+ */
+static int sketch_slot (sketch S, uint64_t hash, int row)
+{
+    // splitmix64 of the hash, seeded per row
+    uint64_t h = hash + (row + 1) * 0x9e3779b97f4a7c15ULL;
+
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return row * S->width + (int)(h & (S->width - 1));
+}
@@ -0,0 +1,29 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+#define SKETCH_DEPTH 4
+/* Counters saturate here; TinyLFU only needs to tell small counts apart */
+#define SKETCH_MAX 15
+/* After this many additions per counter of a row, every counter is
+   halved, so that old popularity fades */
+#define SKETCH_SAMPLE 10
+
+/* A count-min sketch: an estimate of how often each key hash was added,
+   in a fixed amount of memory. Estimates never undercount, and overcount
+   only when keys collide in every row. */
+struct sketch_header
+{
+    unsigned char *counts;  // SKETCH_DEPTH rows of width counters
+    int width;              // a power of two
+    long additions;         // since the last halving
+};
+typedef struct sketch_header *sketch;
+
+sketch sketch_new (int width);
+void sketch_free (sketch S);
+void sketch_add (sketch S, uint64_t hash);
+int sketch_estimate (sketch S, uint64_t hash);
+
+#endif
@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+static int slabs_class (slabs S, int size);
+static int slabs_page_of (slabs S, void *chunk);
+static void slabs_page_unlist (slabs S, int *list, int p);
+static void slabs_page_list (slabs S, int *list, int p);
+static int slabs_grow (slabs S, int c);
+static web_data slabs_page_victim (slabs S, int p);
+static void slabs_drain (slabs S, int p);
+static void slabs_lru_push (slabs S, web_data w);
+static void slabs_lru_remove (slabs S, web_data w);
+
+/*
+ * slabs_new - reserve bytes, rounded down to whole pages, for cache
+ * entries. The memory is faulted in now, so the cache's footprint is
+ * fixed from the start. Returns NULL if it can't be had.
+ */
+slabs slabs_new (long bytes)
+{
+    slabs S = calloc(1, sizeof(struct slabs_header));
+    int i, size;
+
+    S->npages = bytes / SLAB_PAGE_SIZE;
+    S->base = mmap(NULL, (long)S->npages * SLAB_PAGE_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+        -1, 0);
+
+    if (S->npages < 1 || S->base == MAP_FAILED)
+    {
+        free (S);
+        return NULL;
+    }
+
+    // Classes grow by SLAB_GROWTH, 8-byte aligned, right up to a page,
+    // which the last takes whole. Past half a page a class gets one
+    // chunk per page, but an entry is still charged close to its size.
+    for (size = SLAB_MIN_CHUNK; size < SLAB_PAGE_SIZE
+        && S->nclasses < SLAB_MAX_CLASSES - 1; )
+    {
+        S->classes[S->nclasses++].size = size;
+        size = ((int)(size * SLAB_GROWTH) + 7) & ~7;
+    }
+    S->classes[S->nclasses++].size = SLAB_PAGE_SIZE;
+
+    for (i = 0; i < S->nclasses; i++)
+    {
+        S->classes[i].perPage = SLAB_PAGE_SIZE / S->classes[i].size;
+        S->classes[i].partial = -1;
+    }
+
+    S->pages = calloc(S->npages, sizeof(struct slab_page));
+    S->pool = -1;
+    for (i = S->npages - 1; i >= 0; i--)
+    {
+        S->pages[i].cls = -1;
+        slabs_page_list (S, &S->pool, i);
+    }
+
+    S->draining = -1;
+    pthread_mutex_init (&S->lock, NULL);
+    return S;
+}
+
+/*
+ * slabs_destroy - give the region back. Every entry in it must be gone.
+ */
+void slabs_destroy (slabs S)
+{
+    munmap (S->base, (long)S->npages * SLAB_PAGE_SIZE);
+    pthread_mutex_destroy (&S->lock);
+    free (S->pages);
+    free (S);
+}
+
+/*
+ * slabs_chunk_size - bytes an entry of size bytes takes up in S, or -1
+ * if it is too big for any class
+ */
+int slabs_chunk_size (slabs S, int size)
+{
+    int c = slabs_class (S, size);
+
+    return c < 0 ? -1 : S->classes[c].size;
+}
+
+/*
+ * slabs_alloc - a chunk for size bytes, or NULL if its class has none
+ * free and there is no free page to give it; see slabs_victim. The
+ * chunk is not a cached entry until slabs_link says so, whatever bytes
+ * it held before.
+ */
+void *slabs_alloc (slabs S, int size)
+{
+    int c = slabs_class (S, size);
+    struct slab_class *k;
+    struct slab_page *pg;
+    void *chunk;
+    int p;
+
+    if (c < 0)
+        return NULL;
+
+    k = &S->classes[c];
+    pthread_mutex_lock (&S->lock);
+
+    if (k->partial < 0 && !slabs_grow (S, c))
+    {
+        pthread_mutex_unlock (&S->lock);
+        return NULL;
+    }
+
+    p = k->partial;
+    pg = &S->pages[p];
+    chunk = pg->free;
+    pg->free = *(void **)chunk;
+    pg->used++;
+
+    int i = ((char *)chunk - (S->base + (long)p * SLAB_PAGE_SIZE)) / k->size;
+    pg->live[i / 64] |= 1ULL << (i % 64);
+
+    // Left over from another class's entries, it could pass for one to
+    // slabs_page_victim before the caller lays its own entry out
+    ((web_data)chunk)->slabLinked = 0;
+
+    if (pg->free == NULL)
+        slabs_page_unlist (S, &k->partial, p);
+
+    pthread_mutex_unlock (&S->lock);
+    return chunk;
+}
+
+/*
+ * slabs_free - give back a chunk from slabs_alloc. Once none of its
+ * page's chunks are in use, the page goes back to the pool.
+ */
+void slabs_free (slabs S, void *chunk)
+{
+    pthread_mutex_lock (&S->lock);
+
+    int p = slabs_page_of (S, chunk);
+    struct slab_page *pg = &S->pages[p];
+    struct slab_class *k = &S->classes[pg->cls];
+    int i = ((char *)chunk - (S->base + (long)p * SLAB_PAGE_SIZE)) / k->size;
+
+    pg->live[i / 64] &= ~(1ULL << (i % 64));
+    // A page being drained takes no new entries (see slabs_drain)
+    if (pg->free == NULL && S->draining != p)
+        slabs_page_list (S, &k->partial, p);
+    *(void **)chunk = pg->free;
+    pg->free = chunk;
+
+    if (--pg->used == 0)
+    {
+        if (S->draining == p)
+            S->draining = -1;
+        else
+            slabs_page_unlist (S, &k->partial, p);
+        pg->cls = -1;
+        slabs_page_list (S, &S->pool, p);
+    }
+
+    pthread_mutex_unlock (&S->lock);
+}
+
+/*
+ * slabs_link - put w, just cached, at the head of its class's LRU
+ */
+void slabs_link (slabs S, web_data w)
+{
+    pthread_mutex_lock (&S->lock);
+    slabs_lru_push (S, w);
+    w->slabBumped = time (NULL);
+    pthread_mutex_unlock (&S->lock);
+}
+
+/*
+ * slabs_unlink - take w, leaving the cache, off its class's LRU
+ */
+void slabs_unlink (slabs S, web_data w)
+{
+    pthread_mutex_lock (&S->lock);
+    slabs_lru_remove (S, w);
+    pthread_mutex_unlock (&S->lock);
+}
+
+/*
+ * slabs_touch - w was hit; move it to the head of its class's LRU unless
+ * it was moved there within SLAB_BUMP_SECS, which keeps hot entries from
+ * taking S's lock on every hit
+ */
+void slabs_touch (slabs S, web_data w)
+{
+    long now = time (NULL);
+
+    if (now - w->slabBumped < SLAB_BUMP_SECS)
+        return;
+
+    pthread_mutex_lock (&S->lock);
+    slabs_lru_remove (S, w);
+    slabs_lru_push (S, w);
+    w->slabBumped = now;
+    pthread_mutex_unlock (&S->lock);
+}
+
+/*
+ * slabs_victim - when slabs_alloc fails for size bytes, the cached entry
+ * to evict to make room, retained for the caller; NULL if none will do.
+ * That is the least recently used entry of size's class, unless another
+ * class's has been idle more than twice as long: then that class gives
+ * up its page, whose entries are evicted one by one until it is empty.
+ */
+web_data slabs_victim (slabs S, int size)
+{
+    int c = slabs_class (S, size);
+    web_data w = NULL;
+    int i, d = -1;
+
+    if (c < 0)
+        return NULL;
+
+    pthread_mutex_lock (&S->lock);
+
+    // Finish emptying the page already picked, unless it is c's own:
+    // then its free chunks are c's to use again
+    if (S->draining >= 0 && S->pages[S->draining].cls == c)
+        slabs_drain (S, -1);
+    if (S->draining >= 0)
+        w = slabs_page_victim (S, S->draining);
+
+    if (w == NULL)
+    {
+        for (i = 0; i < S->nclasses; i++)
+        {
+            if (S->classes[i].tail && (d < 0
+                || S->classes[i].tail->slabTick
+                < S->classes[d].tail->slabTick))
+                d = i;
+        }
+
+        web_data own = S->classes[c].tail;
+        web_data oldest = d >= 0 ? S->classes[d].tail : NULL;
+
+        if (own && (d == c
+            || own->slabTick - oldest->slabTick <= S->tick - own->slabTick))
+            w = own;
+
+        else if (oldest)
+        {
+            slabs_drain (S, slabs_page_of (S, oldest));
+            w = slabs_page_victim (S, S->draining);
+        }
+    }
+
+    // Being on an LRU, w is still held by the cache, so it can't be
+    // freed under us while we hold the lock
+    if (w != NULL)
+        web_data_retain (w);
+
+    pthread_mutex_unlock (&S->lock);
+    return w;
+}
+
+/*
+ * slabs_class - the smallest class that holds size bytes, or -1
+ */
+static int slabs_class (slabs S, int size)
+{
+    int lo = 0, hi = S->nclasses - 1;
+
+    if (size > S->classes[hi].size)
+        return -1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (S->classes[mid].size >= size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+static int slabs_page_of (slabs S, void *chunk)
+{
+    return ((char *)chunk - S->base) / SLAB_PAGE_SIZE;
+}
+
+/*
+ * slabs_grow - give class c a page from the pool, carved into chunks.
+ * Returns 0 if the pool is empty. Caller must hold S->lock.
+ */
+static int slabs_grow (slabs S, int c)
+{
+    struct slab_class *k = &S->classes[c];
+    int p = S->pool, i;
+
+    if (p < 0)
+        return 0;
+
+    struct slab_page *pg = &S->pages[p];
+    char *page = S->base + (long)p * SLAB_PAGE_SIZE;
+
+    slabs_page_unlist (S, &S->pool, p);
+    pg->cls = c;
+    pg->used = 0;
+    pg->free = NULL;
+    memset (pg->live, 0, sizeof(pg->live));
+
+    for (i = k->perPage - 1; i >= 0; i--)
+    {
+        void *chunk = page + (long)i * k->size;
+        *(void **)chunk = pg->free;
+        pg->free = chunk;
+    }
+
+    slabs_page_list (S, &k->partial, p);
+    return 1;
+}
+
+/*
+ * slabs_page_victim - an entry in page p still in the cache, or NULL
+ * if only ones pinned by readers are left. Caller must hold S->lock.
+ */
+static web_data slabs_page_victim (slabs S, int p)
+{
+    struct slab_page *pg = &S->pages[p];
+    char *page = S->base + (long)p * SLAB_PAGE_SIZE;
+    int i;
+
+    if (pg->cls < 0)
+        return NULL;
+
+    for (i = 0; i < S->classes[pg->cls].perPage; i++)
+    {
+        web_data w = (web_data)(page + (long)i * S->classes[pg->cls].size);
+
+        if ((pg->live[i / 64] >> (i % 64) & 1) && w->slabLinked)
+            return w;
+    }
+    return NULL;
+}
+
+/*
+ * slabs_drain - make page p (-1 for none) the one being emptied for
+ * another class. It comes off its class's list of pages with free
+ * chunks, so that nothing new lands on it meanwhile; the page drained
+ * before, if it was not emptied, goes back on its list. Caller must
+ * hold S->lock.
+ */
+static void slabs_drain (slabs S, int p)
+{
+    int q = S->draining;
+
+    if (q == p)
+        return;
+
+    if (q >= 0 && S->pages[q].free != NULL)
+        slabs_page_list (S, &S->classes[S->pages[q].cls].partial, q);
+    if (p >= 0 && S->pages[p].free != NULL)
+        slabs_page_unlist (S, &S->classes[S->pages[p].cls].partial, p);
+
+    S->draining = p;
+}
+
+/*
+ * slabs_lru_push - put w at the head of its class's LRU. Caller must
+ * hold S->lock.
+ */
+static void slabs_lru_push (slabs S, web_data w)
+{
+    struct slab_class *k = &S->classes[S->pages[slabs_page_of (S, w)].cls];
+
+    w->slabPrev = NULL;
+    w->slabNext = k->head;
+    if (k->head)
+        k->head->slabPrev = w;
+    else
+        k->tail = w;
+    k->head = w;
+
+    w->slabTick = ++S->tick;
+    w->slabLinked = 1;
+}
+
+/*
+ * slabs_lru_remove - take w off its class's LRU. Caller must hold
+ * S->lock.
+ */
+static void slabs_lru_remove (slabs S, web_data w)
+{
+    struct slab_class *k = &S->classes[S->pages[slabs_page_of (S, w)].cls];
+
+    if (w->slabPrev)
+        w->slabPrev->slabNext = w->slabNext;
+    else
+        k->head = w->slabNext;
+    if (w->slabNext)
+        w->slabNext->slabPrev = w->slabPrev;
+    else
+        k->tail = w->slabPrev;
+
+    w->slabPrev = w->slabNext = NULL;
+    w->slabLinked = 0;
+}
+
+/*
+ * slabs_page_list - push page p onto the list starting at *list
+ */
+static void slabs_page_list (slabs S, int *list, int p)
+{
+    S->pages[p].prev = -1;
+    S->pages[p].next = *list;
+    if (*list >= 0)
+        S->pages[*list].prev = p;
+    *list = p;
+}
+
+/*
+ * slabs_page_unlist - take page p off the list starting at *list
+ */
+static void slabs_page_unlist (slabs S, int *list, int p)
+{
+    struct slab_page *pg = &S->pages[p];
+
+    if (pg->prev >= 0)
+        S->pages[pg->prev].next = pg->next;
+    else
+        *list = pg->next;
+    if (pg->next >= 0)
+        S->pages[pg->next].prev = pg->prev;
+
+    pg->prev = pg->next = -1;
+}
@@ -0,0 +1,72 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "web_data.h"
+
+/* Pages are handed out whole to a size class, so one must hold the
+   largest entry: MAX_OBJECT_SIZE plus its header and key */
+#define SLAB_PAGE_SIZE (128 * 1024)
+#define SLAB_MIN_CHUNK 128
+#define SLAB_GROWTH 1.25
+#define SLAB_MAX_CLASSES 48
+#define SLAB_PAGE_CHUNKS (SLAB_PAGE_SIZE / SLAB_MIN_CHUNK)
+/* A hit moves an entry up its class's LRU at most this often */
+#define SLAB_BUMP_SECS 1
+
+/* A page of the region, carved into chunks of one class */
+struct slab_page
+{
+    int cls;            // -1 while in the pool of free pages
+    int used;           // chunks handed out
+    void *free;         // chunks not handed out, linked through themselves
+    int prev, next;     // in its class's list of pages with free chunks,
+                        // or the pool; -1 ends
+    uint64_t live[SLAB_PAGE_CHUNKS / 64];   // chunks handed out
+};
+
+struct slab_class
+{
+    int size;           // of each chunk
+    int perPage;
+    int partial;        // first page with free chunks, -1 if none
+    web_data head;      // cached entries in chunks of this class,
+    web_data tail;      // most recently used first
+};
+
+/*  Memory for cache entries: one region reserved (and faulted in) up
+    front, in the style of memcached. Entries are placed in chunks of
+    the smallest class that fits them, class sizes growing by
+    SLAB_GROWTH. A page whose chunks are all free goes back to a pool
+    for any class to take, and when a class needs memory and none is
+    free, slabs_victim picks an entry to evict: the class's own least
+    recently used one or, if another class's has been idle much longer,
+    the entries on that class's oldest page, so that memory follows
+    demand between classes. */
+struct slabs_header
+{
+    char *base;
+    int npages;
+    struct slab_page *pages;
+    int pool;           // first free page, -1 if none
+    int draining;       // page being emptied for another class, or -1
+    struct slab_class classes[SLAB_MAX_CLASSES];
+    int nclasses;
+    unsigned long tick; // logical clock for the LRUs
+    pthread_mutex_t lock;
+};
+typedef struct slabs_header *slabs;
+
+slabs slabs_new (long bytes);
+void slabs_destroy (slabs S);
+int slabs_chunk_size (slabs S, int size);
+void *slabs_alloc (slabs S, int size);
+void slabs_free (slabs S, void *chunk);
+
+void slabs_link (slabs S, web_data w);
+void slabs_unlink (slabs S, web_data w);
+void slabs_touch (slabs S, web_data w);
+web_data slabs_victim (slabs S, int size);
+
+#endif
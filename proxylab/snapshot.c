@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+static int snapshot_write_shard (cache C, int shard, FILE *fp,
+    struct snapshot_header *h);
+static int snapshot_by_use (const void *a, const void *b);
+static long snapshot_record_size (web_data w);
+static web_data snapshot_fix_up (char *map, long bytes, long off);
+
+/*
+ * snapshot_save - write every entry of C to a snapshot at path. The
+ * snapshot is written beside it and renamed over it once complete, so
+ * path always holds a whole snapshot, if any. Returns -1 if it could not
+ * be written.
+ */
+int snapshot_save (cache C, const char *path)
+{
+    struct snapshot_header h;
+    char *tmp = malloc(strlen (path) + 8);
+    FILE *fp = NULL;
+    int fd, i, ok = 1;
+
+    if (tmp == NULL)
+        return -1;
+
+    sprintf (tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp (tmp)) < 0 || (fp = fdopen (fd, "w")) == NULL)
+    {
+        if (fd >= 0)
+        {
+            close (fd);
+            unlink (tmp);
+        }
+        free (tmp);
+        return -1;
+    }
+
+    memset (&h, 0, sizeof(h));
+    memcpy (h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.hdrSize = sizeof(struct web_data_hdr);
+    h.bytes = sizeof(h);
+
+    // The header is written again once the counts are known
+    ok = fwrite (&h, sizeof(h), 1, fp) == 1;
+    for (i = 0; ok && i < C->nshards; i++)
+        ok = snapshot_write_shard (C, i, fp, &h) == 0;
+
+    ok = ok && fseek (fp, 0, SEEK_SET) == 0
+        && fwrite (&h, sizeof(h), 1, fp) == 1
+        && fflush (fp) == 0 && fsync (fd) == 0;
+    ok = fclose (fp) == 0 && ok && rename (tmp, path) == 0;
+
+    if (!ok)
+        unlink (tmp);
+    free (tmp);
+    return ok ? 0 : -1;
+}
+
+/*
+ * snapshot_load - map the snapshot at path and restore its entries to
+ * C, which should be empty. They are used where they are, whether C
+ * keeps entries on the heap or in slabs, so only their headers are
+ * touched until they are hit; C keeps the mapping until cache_free.
+ * Returns -1, with errno set,
+ * if there is no snapshot at path, or it is truncated or corrupt, in
+ * which case nothing is restored.
+ */
+int snapshot_load (cache C, const char *path)
+{
+    struct snapshot_header *h;
+    struct stat st;
+    char *map;
+    long off;
+    uint32_t i;
+    int fd;
+
+    if (C->snapshot)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return -1;
+
+    if (fstat (fd, &st) < 0 || st.st_size < (long)sizeof(*h))
+    {
+        close (fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Private, so headers can be fixed up without touching the file
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    h = (struct snapshot_header *)map;
+
+    if (memcmp (h->magic, SNAPSHOT_MAGIC, sizeof(h->magic))
+        || h->hdrSize != sizeof(struct web_data_hdr)
+        || h->bytes != (uint64_t)st.st_size)
+    {
+        munmap (map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Every record is checked before any is cached
+    for (i = 0, off = sizeof(*h); i < h->count; i++)
+    {
+        web_data w = snapshot_fix_up (map, st.st_size, off);
+
+        if (w == NULL)
+        {
+            munmap (map, st.st_size);
+            errno = EINVAL;
+            return -1;
+        }
+        off += snapshot_record_size (w);
+    }
+
+    if (off != st.st_size)
+    {
+        munmap (map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    C->snapshot = map;
+    C->snapshotBytes = st.st_size;
+
+    for (i = 0, off = sizeof(*h); i < h->count; i++)
+    {
+        web_data w = (web_data)(map + off);
+
+        off += snapshot_record_size (w);
+        cache_restore (C, w, w->uses);
+    }
+
+    return 0;
+}
+
+/*
+ * snapshot_write_shard - append the records of the entries of the
+ * shard-th shard of C to fp, least recently used first, counting them
+ * in h. Returns -1 if a write fails.
+ */
+static int snapshot_write_shard (cache C, int shard, FILE *fp,
+    struct snapshot_header *h)
+{
+    static const char pad[SNAPSHOT_ALIGN];
+    struct cache_item *items;
+    int n = cache_collect (C, shard, &items);
+    int i, ok = 1;
+
+    qsort (items, n, sizeof(struct cache_item), snapshot_by_use);
+
+    for (i = 0; i < n; i++)
+    {
+        web_data w = items[i].w;
+        struct web_data_hdr r;
+        long size = snapshot_record_size (w);
+
+        // Only what the entry's key and data need; the rest is the
+        // cache's to set once it is restored
+        memset (&r, 0, sizeof(r));
+        r.hash = w->hash;
+        r.port = w->port;
+        r.website = (char *)(w->website - (char *)w);
+        r.file = (char *)(w->file - (char *)w);
+        r.data = (char *)(w->data - (char *)w);
+        r.data_size = w->data_size;
+        r.plain_size = w->plain_size;
+        r.head_size = w->head_size;
+        r.stored = w->stored;
+        r.uses = items[i].uses;
+
+        ok = ok && fwrite (&r, sizeof(r), 1, fp) == 1
+            && fwrite (w + 1, 1, web_data_size (w) - sizeof(r), fp)
+                == web_data_size (w) - sizeof(r)
+            && fwrite (pad, 1, size - web_data_size (w), fp)
+                == size - web_data_size (w);
+
+        if (ok)
+        {
+            h->count++;
+            h->bytes += size;
+        }
+        web_data_release (w);
+    }
+
+    free (items);
+    return ok ? 0 : -1;
+}
+
+/*
+ * snapshot_by_use - orders cache_items by when they were last used
+ */
+static int snapshot_by_use (const void *a, const void *b)
+{
+    unsigned long x = ((const struct cache_item *)a)->used;
+    unsigned long y = ((const struct cache_item *)b)->used;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * snapshot_record_size - bytes w's record takes up, padding included
+ */
+static long snapshot_record_size (web_data w)
+{
+    return (web_data_size (w) + SNAPSHOT_ALIGN - 1)
+        / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+/*
+ * snapshot_fix_up - check that the record at off in the bytes long map
+ * is whole and well formed, and turn it into an entry of the snapshot,
+ * as fresh as one from web_data_alloc. Returns it, or NULL if it is not.
+ */
+static web_data snapshot_fix_up (char *map, long bytes, long off)
+{
+    web_data w = (web_data)(map + off);
+    long room = bytes - off;
+    long fileOff, dataOff;
+
+    if (room < (long)sizeof(*w) || off % SNAPSHOT_ALIGN)
+        return NULL;
+
+    fileOff = (long)w->file;
+    dataOff = (long)w->data;
+
+    // The key strings fill exactly the room up to the data, in order
+    if ((long)w->website != sizeof(*w) || fileOff <= (long)sizeof(*w)
+        || dataOff <= fileOff || w->data_size < 0 || w->plain_size < 0
+        || w->uses < 0 || w->head_size < 0
+        || w->head_size > (w->plain_size ? w->plain_size : w->data_size)
+        || dataOff > room || w->data_size > room - dataOff
+        || memchr (map + off + sizeof(*w), '\0', fileOff - sizeof(*w))
+            != map + off + fileOff - 1
+        || memchr (map + off + fileOff, '\0', dataOff - fileOff)
+            != map + off + dataOff - 1)
+        return NULL;
+
+    w->website = (char *)(w + 1);
+    w->file = (char *)w + fileOff;
+    w->data = (char *)w + dataOff;
+    w->hash = web_data_hash (w->website, w->file, w->port);
+    w->refs = 1;
+    w->prev = w->next = NULL;
+    w->acc_time = 0;
+    w->queue = w->freq = w->pos = 0;
+    w->priority = 0;
+    w->slabs = NULL;
+    w->slabPrev = w->slabNext = NULL;
+    w->slabLinked = 0;
+    w->used = 0;
+    w->mapped = 1;
+    return w;
+}
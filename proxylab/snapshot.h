@@ -0,0 +1,32 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC "PXSNAP1"
+/* Records start on multiples of this, so their headers are aligned */
+#define SNAPSHOT_ALIGN 8
+
+/* A snapshot is the cached entries written out to a file so a restarted
+   proxy can start warm. The file is this header and then count records,
+   each a struct web_data_hdr with offsets from the record's start in
+   place of its pointers, followed by the entry's key strings and data,
+   just as the entry is laid out in memory. Loading maps the file and
+   fixes the headers up where they are, so the entries are cached without
+   copying (see cache_restore). A shard's records are in the order its
+   entries were last used, least recent first, each with how many hits
+   it had. The layout is that of the binary that wrote it; hdrSize is
+   there to turn away files from a build where it differs. */
+struct snapshot_header
+{
+	char magic[8];      // SNAPSHOT_MAGIC
+	uint32_t hdrSize;   // sizeof(struct web_data_hdr)
+	uint32_t count;     // records
+	uint64_t bytes;     // the file's length
+};
+
+int snapshot_save (cache C, const char *path);
+int snapshot_load (cache C, const char *path);
+
+#endif
@@ -1,25 +1,1001 @@
-/* This function tests the cache data structure */
+/* This function tests the cache data structure and the DNS cache */
 
 #include <assert.h>
 #include <stdio.h>
 #include <time.h>
+#include <poll.h>
+#include "csapp.h"
 #include "cache.h"
+#include "dns.h"
+#include "policy.h"
+#include "lz.h"
+#include "snapshot.h"
+#include "http.h"
+#include "tpool.h"
+#include "connpool.h"
+#include "idle.h"
 
 /*
- * stall - stall the program so that clock() will actually register ticks
- * pretty overkill but it works 
+ * stub_resolve - a slow resolver that knows one name, counting its calls
  */
-void stall (int n) {
-  int i,j;
-  int freq=n-1;
-  for (i=2; i<=n; ++i) for (j=i - 1;j>1;--j) if (i%j==0) {--freq; break;}
-  return;
+int stub_calls = 0;
+
+int stub_resolve (const char *host, struct dns_addrs *out) {
+  struct sockaddr_in *sin = (struct sockaddr_in *)&out->addr[0];
+
+  __sync_fetch_and_add (&stub_calls, 1);
+  usleep (100000);
+
+  if (strcmp (host, "origin.test"))
+    return EAI_NONAME;
+
+  memset (sin, 0, sizeof (*sin));
+  sin->sin_family = AF_INET;
+  inet_pton (AF_INET, "192.0.2.1", &sin->sin_addr);
+  out->len[0] = sizeof (*sin);
+  out->n = 1;
+  return 0;
+}
+
+void *lookup_thread (void *D) {
+  assert (dns_lookup ((dns)D, "origin.test", NULL) == 0);
+  return NULL;
+}
+
+/*
+ * test_dns - concurrent misses share one lookup, answers and failures
+ * are cached until they expire, and /etc/hosts is honoured
+ */
+void test_dns () {
+  dns D = dns_new (60, 60, stub_resolve);
+  pthread_t tids[8];
+  struct addrinfo *res;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    Pthread_create (&tids[i], NULL, lookup_thread, D);
+  for (i = 0; i < 8; i++)
+    Pthread_join (tids[i], NULL);
+  assert (stub_calls == 1);
+
+  assert (dns_getaddrinfo (D, "origin.test", "8080", NULL, &res) == 0);
+  assert (stub_calls == 1);
+  assert (((struct sockaddr_in *)res->ai_addr)->sin_port == htons (8080));
+  assert (res->ai_next == NULL);
+  dns_freeaddrinfo (res);
+
+  assert (dns_lookup (D, "missing.test", NULL) == EAI_NONAME);
+  assert (dns_lookup (D, "missing.test", NULL) == EAI_NONAME);
+  assert (stub_calls == 2);
+  dns_free (D);
+
+  D = dns_new (1, 1, stub_resolve);
+  assert (dns_lookup (D, "origin.test", NULL) == 0);
+  sleep (2);
+  assert (dns_lookup (D, "origin.test", NULL) == 0);
+  assert (stub_calls == 4);
+  dns_free (D);
+
+  D = dns_new (60, 5, NULL);
+  assert (dns_getaddrinfo (D, "localhost", "80", NULL, &res) == 0);
+  dns_freeaddrinfo (res);
+  dns_free (D);
+}
+
+/*
+ * test_pinned - an entry looked up with cache_lookup stays readable
+ * after it is evicted, until it is released
+ */
+void test_pinned () {
+  cache C = cache_new (1, &policy_lru, 0, 0, 0);
+  int BIG = 500000;
+  char *s = malloc (BIG);
+  memset (s, 50, BIG);
+
+  cache_insert (C, "www.pinned.com", "/", 80, s, BIG);
+  web_data w = cache_lookup (C, "www.pinned.com", "/", 80);
+  assert (w != NULL && w->data_size == BIG);
+
+  cache_insert (C, "www.other.com", "/", 80, s, BIG);
+  cache_insert (C, "www.other2.com", "/", 80, s, BIG);
+  assert (cache_lookup (C, "www.pinned.com", "/", 80) == NULL);
+  assert (memcmp (w->data, s, BIG) == 0);
+  web_data_release (w);
+
+  free (s);
+  cache_free (C);
+}
+
+/*
+ * test_index - thousands of entries stay findable through index growth,
+ * evictions and the tombstones they leave
+ */
+void test_index () {
+  cache C = cache_new (1, &policy_lru, 0, 0, 0);
+  char site[64], body[100];
+  int i, n, found = 0;
+  memset (body, 51, sizeof (body));
+
+  for (i = 0; i < 20000; i++) {
+    sprintf (site, "www.site%d.com", i);
+    cache_insert (C, site, "/", 80, body, sizeof (body));
+  }
+
+  // Only as many of the newest as MAX_CACHE_SIZE holds, counting their
+  // headers and keys, fit
+  web_data w = web_data_new ("www.site19999.com", "/", 80, body,
+    sizeof (body));
+  int fit = MAX_CACHE_SIZE / web_data_size (w);
+  web_data_free (w);
+
+  for (i = 0; i < 20000; i++) {
+    sprintf (site, "www.site%d.com", i);
+    if (cache_get (C, site, "/", 80, &n) != NULL) {
+      assert (n == sizeof (body));
+      found++;
+    }
+  }
+  assert (found == fit);
+  assert (cache_get (C, "www.site19999.com", "/", 81, &n) == NULL);
+  assert (cache_get (C, "www.site19999.com", "/x", 80, &n) == NULL);
+
+  cache_free (C);
+}
+
+/*
+ * test_policy_bounds - under every policy a shard stays within its
+ * budget and holds exactly the entries its index can find
+ */
+void test_policy_bounds (const policy_ops_t *policy) {
+  cache C = cache_new (1, policy, 0, 0, 0);
+  char site[64], *body = malloc (50000);
+  int i, n, found = 0;
+  memset (body, 52, 50000);
+
+  for (i = 0; i < 20000; i++) {
+    sprintf (site, "www.site%d.com", i % 3000);
+    if (cache_get (C, site, "/", 80, &n) != NULL)
+      assert (n == 100 + (i % 3000) * 37 % 5000);
+    else
+      cache_insert (C, site, "/", 80, body, 100 + (i % 3000) * 37 % 5000);
+    assert (C->shards[0].size <= C->capacity);
+  }
+
+  for (i = 0; i < 3000; i++) {
+    sprintf (site, "www.site%d.com", i);
+    if (cache_get (C, site, "/", 80, &n) != NULL)
+      found++;
+  }
+  assert (found == C->shards[0].items->size);
+
+  free (body);
+  cache_free (C);
+}
+
+/*
+ * test_scan - a hot set survives a scan bigger than the cache under the
+ * scan resistant policies, but not under LRU
+ */
+int test_scan (const policy_ops_t *policy) {
+  cache C = cache_new (1, policy, 0, 0, 0);
+  char site[64], body[1000];
+  int i, j, n, hot = 0;
+  memset (body, 53, sizeof (body));
+
+  for (j = 0; j < 4; j++) {
+    for (i = 0; i < 20; i++) {
+      sprintf (site, "www.hot%d.com", i);
+      if (cache_get (C, site, "/", 80, &n) == NULL)
+        cache_insert (C, site, "/", 80, body, sizeof (body));
+    }
+  }
+
+  for (i = 0; i < 2 * MAX_CACHE_SIZE / (int)sizeof (body); i++) {
+    sprintf (site, "www.scan%d.com", i);
+    assert (cache_get (C, site, "/", 80, &n) == NULL);
+    cache_insert (C, site, "/", 80, body, sizeof (body));
+  }
+
+  for (i = 0; i < 20; i++) {
+    sprintf (site, "www.hot%d.com", i);
+    if (cache_get (C, site, "/", 80, &n) != NULL)
+      hot++;
+  }
+
+  cache_free (C);
+  return hot;
+}
+
+/*
+ * test_gdsf_size - GDSF evicts one big object before many small ones
+ */
+void test_gdsf_size () {
+  cache C = cache_new (1, &policy_gdsf, 0, 0, 0);
+  char site[64], *body = malloc (100000);
+  int i, n;
+  memset (body, 54, 100000);
+
+  for (i = 0; i < 900; i++) {
+    sprintf (site, "www.small%d.com", i);
+    cache_insert (C, site, "/", 80, body, 1000);
+    if (i == 499)
+      cache_insert (C, "www.big.com", "/", 80, body, 100000);
+  }
+
+  assert (cache_get (C, "www.big.com", "/", 80, &n) == NULL);
+  assert (cache_get (C, "www.small0.com", "/", 80, &n) != NULL);
+
+  free (body);
+  cache_free (C);
+}
+
+/*
+ * test_policies - every policy keeps the cache consistent; S3-FIFO and
+ * W-TinyLFU resist scans, GDSF favours small objects
+ */
+void test_policies () {
+  const policy_ops_t *policies[] = {
+    &policy_lru, &policy_s3fifo, &policy_tinylfu, &policy_gdsf
+  };
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    assert (policy_find (policies[i]->name) == policies[i]);
+    test_policy_bounds (policies[i]);
+  }
+  assert (policy_find ("fifo") == NULL);
+
+  assert (test_scan (&policy_lru) == 0);
+  assert (test_scan (&policy_s3fifo) == 20);
+  assert (test_scan (&policy_tinylfu) == 20);
+  assert (test_scan (&policy_gdsf) == 20);
+
+  test_gdsf_size ();
+}
+
+/*
+ * test_doorkeeper - with admission, objects are cached on their second
+ * insert, a scan of unique objects leaves the cache alone, and keys are
+ * forgotten after a couple of windows
+ */
+void test_doorkeeper () {
+  cache C = cache_new (1, &policy_lru, 100, 0, 0);
+  char site[64], body[1000];
+  int i, n;
+  memset (body, 55, sizeof (body));
+
+  // Asking for room to fill does not count as an insert
+  assert (cache_reserve (C, "www.hot.com", "/", 80, sizeof (body), 1)
+    == NULL);
+  cache_insert (C, "www.hot.com", "/", 80, body, sizeof (body));
+  assert (cache_get (C, "www.hot.com", "/", 80, &n) == NULL);
+  cache_insert (C, "www.hot.com", "/", 80, body, sizeof (body));
+  assert (cache_get (C, "www.hot.com", "/", 80, &n) != NULL);
+
+  for (i = 0; i < 2 * MAX_CACHE_SIZE / (int)sizeof (body); i++) {
+    sprintf (site, "www.scan%d.com", i);
+    cache_insert (C, site, "/", 80, body, sizeof (body));
+  }
+  // Only bloom filter false positives, a few percent, get in
+  assert (C->shards[0].items->size < i / 20);
+  assert (cache_get (C, "www.hot.com", "/", 80, &n) != NULL);
+
+  cache_insert (C, "www.late.com", "/", 80, body, sizeof (body));
+  for (i = 0; i < 300; i++) {
+    sprintf (site, "www.other%d.com", i);
+    cache_insert (C, site, "/", 80, body, sizeof (body));
+  }
+  cache_insert (C, "www.late.com", "/", 80, body, sizeof (body));
+  assert (cache_get (C, "www.late.com", "/", 80, &n) == NULL);
+
+  cache_free (C);
+}
+
+/*
+ * test_store - an entry filled in place is cached as one block, trimmed
+ * to its contents, and the shard's size counts its header and key too;
+ * storing a key again replaces its entry; a small cache is split into fewer shards so each holds a few of the
+ * biggest objects
+ */
+void test_store () {
+  cache C = cache_new (1, &policy_lru, 0, 0, 0);
+  web_data w = web_data_alloc ("www.store.com", "/a", 80, 100000);
+  int n;
+
+  memset (w->data, 56, 300);
+  w->data_size = 300;
+  cache_store (C, w);
+
+  w = cache_lookup (C, "www.store.com", "/a", 80);
+  assert (w != NULL && w->data_size == 300 && w->data[299] == 56);
+  assert (w->website == (char *)(w + 1));
+  assert (web_data_size (w) == sizeof (struct web_data_hdr)
+    + strlen ("www.store.com") + 1 + strlen ("/a") + 1 + 300);
+  assert (C->shards[0].size == web_data_size (w));
+  web_data_release (w);
+
+  assert (cache_get (C, "www.store.com", "/a", 80, &n) != NULL && n == 300);
+
+  // The cache notes where a response's head ends, and when it came
+  w = web_data_alloc ("www.store.com", "/b", 80, 100);
+  w->data_size = sprintf (w->data, "HTTP/1.0 200 OK\r\nA: b\r\n\r\nbody");
+  cache_store (C, w);
+  w = cache_lookup (C, "www.store.com", "/b", 80);
+  assert (w != NULL && w->head_size == w->data_size - 4);
+  assert (w->stored > 0 && time (NULL) - w->stored < 5);
+  web_data_release (w);
+  w = cache_lookup (C, "www.store.com", "/a", 80);
+  assert (w != NULL && w->head_size == 0);
+  web_data_release (w);
+
+  // Looking again after a miss finds what landed meanwhile
+  assert (cache_recheck (C, "www.store.com", "/c", 80) == NULL);
+  w = cache_recheck (C, "www.store.com", "/a", 80);
+  assert (w != NULL && w->data_size == 300);
+  web_data_release (w);
+  cache_free (C);
+
+  // A key stored twice, as two fetches racing for it do, is one entry,
+  // the later one, with or without slabs
+  for (n = 0; n < 2; n++) {
+    C = cache_new (1, &policy_lru, 0, n, 0);
+    w = web_data_alloc ("www.store.com", "/a", 80, 300);
+    memset (w->data, 56, 300);
+    w->data_size = 300;
+    cache_store (C, w);
+    w = cache_reserve (C, "www.store.com", "/a", 80, 200, 1);
+    memset (w->data, 57, 200);
+    w->data_size = 200;
+    cache_store (C, w);
+
+    assert (C->shards[0].items->size == 1);
+    w = cache_lookup (C, "www.store.com", "/a", 80);
+    assert (w != NULL && w->data_size == 200 && w->data[0] == 57);
+    assert (n || C->shards[0].size == web_data_size (w));
+    web_data_release (w);
+    cache_free (C);
+  }
+
+  C = cache_new (CACHE_SHARDS, &policy_lru, 0, 0, 0);
+  assert (C->nshards >= 1 && C->nshards <= CACHE_SHARDS);
+  assert (C->nshards == 1 || C->capacity >= CACHE_SHARD_MIN);
+  assert (C->capacity >= CACHE_SHARD_OBJECTS * 102400);
+  cache_free (C);
+}
+
+/*
+ * test_slabs - entries kept in slabs read back intact, shards stay
+ * within budget counting whole chunks, a page moves from a class of
+ * small entries to one that has none when a big entry arrives, classes
+ * stay close together past half a page, and a reserved entry is cached
+ * in the chunk it was filled in
+ */
+void test_slabs () {
+  cache C = cache_new (1, &policy_lru, 0, 1, 0);
+  char site[64], *body = malloc (60000);
+  web_data w;
+  int i, n, found;
+  const char *d;
+  assert (C->slabs != NULL);
+
+  for (i = 0; i < 4000; i++) {
+    memset (body, i & 0xff, 300);
+    sprintf (site, "www.small%d.com", i);
+    cache_insert (C, site, "/", 80, body, 300);
+    assert (C->shards[0].size <= C->capacity);
+  }
+  for (i = 3990; i < 4000; i++) {
+    sprintf (site, "www.small%d.com", i);
+    d = cache_get (C, site, "/", 80, &n);
+    assert (d != NULL && n == 300 && (unsigned char)d[299] == (i & 0xff));
+  }
+
+  // Every page belongs to the small entries' class now
+  int before = C->shards[0].items->size;
+  int chunk = C->shards[0].size / before;
+  memset (body, 57, 60000);
+  cache_insert (C, "www.big.com", "/", 80, body, 60000);
+  w = cache_lookup (C, "www.big.com", "/", 80);
+  assert (w != NULL && w->slabs == C->slabs && w->data_size == 60000);
+  assert ((char *)w >= C->slabs->base && (char *)w
+    < C->slabs->base + (long)C->slabs->npages * SLAB_PAGE_SIZE);
+  assert (memcmp (w->data, body, 60000) == 0);
+  assert (strcmp (w->website, "www.big.com") == 0);
+  web_data_release (w);
+
+  // Making room took one page of small entries and no more
+  for (i = 0, found = 0; i < 4000; i++) {
+    sprintf (site, "www.small%d.com", i);
+    if (cache_get (C, site, "/", 80, &n) != NULL)
+      found++;
+  }
+  assert (found == C->shards[0].items->size - 1);
+  assert (found == before - SLAB_PAGE_SIZE / chunk);
+  assert (C->shards[0].size <= C->capacity);
+
+  n = slabs_chunk_size (C->slabs, 70000);
+  assert (n >= 70000 && n <= 70000 * SLAB_GROWTH + 8);
+
+  // Only with leave to evict, the cache being full
+  assert (cache_reserve (C, "www.reserved.com", "/", 80, 70000, 0) == NULL);
+  w = cache_reserve (C, "www.reserved.com", "/", 80, 70000, 1);
+  assert (w != NULL && w->slabs == C->slabs);
+  memset (w->data, 7, 70000);
+  w->data_size = 70000;
+  web_data filled = w;
+  cache_store (C, w);
+  w = cache_lookup (C, "www.reserved.com", "/", 80);
+  assert (w == filled && w->data_size == 70000 && w->data[69999] == 7);
+  web_data_release (w);
+
+  free (body);
+  cache_free (C);
+
+  // A page carved again for another class holds no stale entries: only
+  // the one linked since is offered up when the page is drained
+  slabs S = slabs_new (SLAB_PAGE_SIZE);
+  char *big = slabs_alloc (S, 60000);
+  memset (big, 0xff, slabs_chunk_size (S, 60000));
+  slabs_free (S, big);
+
+  char *stale = slabs_alloc (S, 300);
+  assert (stale == big && ((web_data)stale)->slabLinked == 0);
+  w = web_data_init (slabs_alloc (S, 300), "www.linked.com", "/", 80);
+  slabs_link (S, w);
+  web_data victim = slabs_victim (S, 60000);
+  assert (victim == w && S->draining == 0);
+  web_data_release (victim);
+
+  // Nothing new lands on the page while it drains, and once empty it
+  // is free for the class that wanted it
+  assert (slabs_alloc (S, 300) == NULL);
+  slabs_unlink (S, w);
+  slabs_free (S, w);
+  slabs_free (S, stale);
+  assert (S->draining == -1 && slabs_alloc (S, 60000) == big);
+  slabs_destroy (S);
+}
+
+/*
+ * test_compress - text bodies are cached compressed and unpack intact,
+ * in slabs too; ones already compressed or that won't shrink are cached
+ * as they are; and the codec rejects a truncated block
+ */
+void test_compress () {
+  const char *head = "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n";
+  const char *gzip = "HTTP/1.0 200 OK\r\nContent-Encoding: gzip\r\n\r\n";
+  char *page = malloc (50000), *plain = malloc (50000), *packed;
+  int slabbed, len, n, i;
+  web_data w;
+
+  len = sprintf (page, "%s", head);
+  for (i = 0; len < 40000; i++)
+    len += sprintf (page + len, "<tr><td class=\"row\">%d</td>"
+      "<td><a href=\"/item/%d\">item %d</a></td></tr>\n", i, i * 7, i);
+
+  for (slabbed = 0; slabbed < 2; slabbed++) {
+    cache C = cache_new (1, &policy_lru, 0, slabbed, 1);
+
+    cache_insert (C, "www.text.com", "/", 80, page, len);
+    w = cache_lookup (C, "www.text.com", "/", 80);
+    assert (w != NULL && w->plain_size == len && w->data_size < len / 3);
+    assert (web_data_plain_size (w) == len);
+    assert (w->head_size == strlen (head));
+    memset (plain, 0, 50000);
+    assert (web_data_unpack (w, plain) == len);
+    assert (memcmp (plain, page, len) == 0);
+    web_data_release (w);
+    assert (cache_ratio (C) > 3);
+
+    // Already encoded: stored as is, even though it would shrink
+    memcpy (page, gzip, strlen (gzip));
+    cache_insert (C, "www.gzip.com", "/", 80, page, len);
+    w = cache_lookup (C, "www.gzip.com", "/", 80);
+    assert (w != NULL && w->plain_size == 0 && w->data_size == len);
+    web_data_release (w);
+    memcpy (page, head, strlen (head));
+
+    // Noise doesn't shrink, so it is stored as is
+    for (i = 0; i < 20000; i++)
+      plain[i] = rand ();
+    memcpy (plain, head, strlen (head));
+    cache_insert (C, "www.noise.com", "/", 80, plain, 20000);
+    w = cache_lookup (C, "www.noise.com", "/", 80);
+    assert (w != NULL && w->plain_size == 0 && w->data_size == 20000);
+    web_data_release (w);
+
+    cache_free (C);
+  }
+
+  // Round trips of short, long-run and incompressible input
+  packed = malloc (lz_bound (50000));
+  for (i = 0; i < 50000; i++)
+    plain[i] = i % 7 == 0 ? rand () : 'a';
+  for (n = 0; n <= 50000; n = n * 3 + 1) {
+    len = lz_compress (plain, n, packed, lz_bound (n));
+    assert (len > 0 && len <= lz_bound (n));
+    assert (lz_decompress (packed, len, page, n) == n);
+    assert (memcmp (page, plain, n) == 0);
+  }
+  len = lz_compress (plain, 50000, packed, lz_bound (50000));
+  assert (lz_decompress (packed, len, page, 49999) == -1);
+  assert (lz_compress (plain, 50000, packed, 100) == -1);
+
+  free (packed);
+  free (plain);
+  free (page);
+}
+
+/*
+ * test_disk - entries evicted from memory land in the disk tier and
+ * sendfile back intact; the log drops its oldest records as it wraps,
+ * but never one that is pinned, and a newer copy of a key replaces it
+ */
+void test_disk () {
+  char path[] = "/tmp/proxy_test_diskXXXXXX";
+  char outPath[] = "/tmp/proxy_test_outXXXXXX";
+  cache C = cache_new (1, &policy_lru, 0, 0, 0);
+  char site[64], *body = malloc (50000), *out = malloc (50000);
+  disk_rec r, pinned;
+  int i, fd, n, found;
+  long off;
+
+  close (mkstemp (path));
+  assert (cache_open_disk (C, path, 1 << 20) == 0);
+  fd = mkstemp (outPath);
+  assert (fd >= 0);
+  assert (disk_max_object (C->disk) == (1 << 20) / DISK_MAX_OBJECT_FRAC);
+
+  // 30 objects of 50000 bytes overflow memory, but not memory and disk
+  for (i = 0; i < 30; i++) {
+    memset (body, i, 50000);
+    sprintf (site, "www.disk%d.com", i);
+    cache_insert (C, site, "/", 80, body, 50000);
+  }
+  assert (cache_lookup_disk (C, "www.disk29.com", "/", 80) == NULL);
+  for (i = 0, found = 0; i < 30; i++) {
+    sprintf (site, "www.disk%d.com", i);
+    if ((r = cache_lookup_disk (C, site, "/", 80)) == NULL)
+      continue;
+    assert (cache_get (C, site, "/", 80, &n) == NULL);
+    assert (r->dataSize == 50000 && disk_data (r)[49999] == i);
+
+    off = 0;
+    lseek (fd, 0, SEEK_SET);
+    assert (disk_sendfile (r, fd, &off, 50000) == 50000 && off == 50000);
+    assert (pread (fd, out, 50000, 0) == 50000);
+    assert (out[0] == i && out[49999] == i);
+    disk_release (r);
+    found++;
+  }
+  assert (found > 0 && found + C->shards[0].items->size == 30);
+
+  // 1MB holds 25 page-aligned records of this size; the first ones
+  // written are gone
+  disk D = C->disk;
+  for (i = 0; i < 100; i++) {
+    memset (body, i, 40000);
+    sprintf (site, "www.log%d.com", i);
+    assert (disk_put (D, site, "/", 80, body, 40000));
+  }
+  assert (disk_lookup (D, "www.log0.com", "/", 80) == NULL);
+  r = disk_lookup (D, "www.log99.com", "/", 80);
+  assert (r != NULL && disk_data (r)[0] == 99);
+  disk_release (r);
+
+  // A pinned record holds the log back until it is released
+  pinned = disk_lookup (D, "www.log80.com", "/", 80);
+  assert (pinned != NULL);
+  for (i = 0; i < 100 && disk_put (D, "www.more.com", "/", 80, body, 40000);
+    i++)
+    ;
+  assert (i < 100 && disk_data (pinned)[0] == 80);
+  disk_release (pinned);
+  assert (disk_put (D, "www.more.com", "/", 80, body, 40000));
+
+  // The newest copy of a key is the one found
+  memset (body, 7, 100);
+  assert (disk_put (D, "www.log99.com", "/", 80, body, 100));
+  r = disk_lookup (D, "www.log99.com", "/", 80);
+  assert (r != NULL && r->dataSize == 100 && disk_data (r)[0] == 7);
+  disk_release (r);
+
+  assert (disk_put (D, "www.huge.com", "/", 80, body, 1 << 20) == 0);
+
+  cache_free (C);
+  close (fd);
+  unlink (outPath);
+  unlink (path);
+  free (body);
+  free (out);
+}
+
+/*
+ * test_snapshot - a saved cache loads back with its data intact and its
+ * entries in the same order of use, in place whether or not the cache
+ * has slabs; a damaged snapshot is turned away whole
+ */
+void test_snapshot () {
+  char path[] = "/tmp/proxy_test_snapXXXXXX";
+  cache C = cache_new (1, &policy_lru, 0, 0, 0);
+  char site[64], *body = malloc (100000);
+  web_data w;
+  int i, n;
+
+  close (mkstemp (path));
+  for (i = 0; i < 8; i++) {
+    memset (body, i, 100000);
+    sprintf (site, "www.snap%d.com", i);
+    cache_insert (C, site, "/", 80, body, 100000);
+  }
+  assert (cache_get (C, "www.snap0.com", "/", 80, &n) != NULL);
+  assert (snapshot_save (C, path) == 0);
+  cache_free (C);
+
+  // On the heap, entries are used where they were mapped
+  C = cache_new (1, &policy_lru, 0, 0, 0);
+  assert (snapshot_load (C, path) == 0);
+  assert (C->shards[0].items->size == 8 && C->snapshot != NULL);
+  assert (snapshot_load (C, path) == -1);
+
+  // snap1 was the least recently used, and snap0 the most
+  for (i = 8; i < 11; i++) {
+    sprintf (site, "www.snap%d.com", i);
+    cache_insert (C, site, "/", 80, body, 100000);
+  }
+  assert (cache_get (C, "www.snap1.com", "/", 80, &n) == NULL);
+  for (i = 2; i < 8; i++) {
+    sprintf (site, "www.snap%d.com", i);
+    w = cache_lookup (C, site, "/", 80);
+    assert (w != NULL && w->mapped && w->data_size == 100000);
+    assert ((char *)w > C->snapshot
+      && (char *)w < C->snapshot + C->snapshotBytes);
+    assert (w->data[0] == i && w->data[99999] == i);
+    web_data_release (w);
+  }
+  w = cache_lookup (C, "www.snap0.com", "/", 80);
+  assert (w != NULL && w->uses == 2 && w->data[99999] == 0);
+  web_data_release (w);
+  cache_free (C);
+
+  // With slabs too, until they are evicted to make room for new ones
+  C = cache_new (1, &policy_lru, 0, 1, 0);
+  assert (snapshot_load (C, path) == 0 && C->snapshot != NULL);
+  w = cache_lookup (C, "www.snap0.com", "/", 80);
+  assert (w != NULL && w->mapped && w->slabs == NULL);
+  assert (w->data[0] == 0 && w->data_size == 100000);
+  web_data_release (w);
+  for (i = 8; i < 11; i++) {
+    sprintf (site, "www.snap%d.com", i);
+    cache_insert (C, site, "/", 80, body, 100000);
+    w = cache_lookup (C, site, "/", 80);
+    assert (w != NULL && w->slabs != NULL);
+    web_data_release (w);
+  }
+  assert (cache_get (C, "www.snap1.com", "/", 80, &n) == NULL);
+  assert (C->shards[0].size <= C->capacity);
+  cache_free (C);
+
+  // A truncated or missing snapshot restores nothing
+  C = cache_new (1, &policy_lru, 0, 0, 0);
+  assert (truncate (path, 500000) == 0);
+  assert (snapshot_load (C, path) == -1 && errno == EINVAL);
+  assert (C->shards[0].items->size == 0 && C->snapshot == NULL);
+  unlink (path);
+  assert (snapshot_load (C, path) == -1 && errno == ENOENT);
+  cache_free (C);
+  free (body);
+}
+
+/*
+ * test_http - request heads parse in place into slices, header names
+ * are told apart whatever their case, and Rio hands out one head, or
+ * line, at a time however the bytes arrive
+ */
+void test_http () {
+  const char *req =
+    "\r\nGET http://www.example.com:8080/a/b.html HTTP/1.1\r\n"
+    "host: www.example.com\r\n"
+    "User-Agent  :   a rather long agent string, with: colons  \r\n"
+    "X-Folded\r\n"
+    "PROXY-CONNECTION: Keep-Alive\r\n"
+    "\r\n"
+    "GET / HTTP/1.0\r\n\r\n";
+  int headLen = strstr (req, "\r\n\r\n") + 4 - req;
+  struct http_request r;
+  char buf[MAXLINE], many[HTTP_MAX_HEADERS * 8 + 64];
+  struct http_header *hd;
+  int fds[2], len, i;
+  rio_t rio;
+
+  assert (http_parse_request (req, strlen (req), &r) == headLen);
+  assert (r.method.len == 3 && !strncmp (r.method.p, "GET", 3));
+  assert (r.uri.len == strlen ("http://www.example.com:8080/a/b.html"));
+  assert (http_slice_prefix (r.version, "HTTP/1.1") && r.version.len == 8);
+  assert (r.nheaders == 4);
+
+  hd = &r.headers[0];
+  assert (hd->id == HTTP_HOST && hd->value.len == strlen ("www.example.com"));
+  assert (hd->line.len == strlen ("host: www.example.com\r\n"));
+  hd = &r.headers[1];
+  assert (hd->id == HTTP_USER_AGENT && hd->name.len == strlen ("User-Agent"));
+  assert (hd->value.len == strlen ("a rather long agent string, with: colons"));
+  assert (!strncmp (hd->value.p, "a rather", 8));
+  hd = &r.headers[2];
+  assert (hd->id == HTTP_OTHER && hd->name.len == 0);
+  assert (hd->line.len == strlen ("X-Folded\r\n"));
+  hd = &r.headers[3];
+  assert (hd->id == HTTP_PROXY_CONNECTION);
+  assert (http_slice_prefix (hd->value, "keep-alive"));
+
+  // Every cut short of the blank line is incomplete
+  for (len = 0; len < headLen; len++)
+    assert (http_parse_request (req, len, &r) == 0);
+
+  assert (http_parse_request ("GET /\r\n\r\n", 9, &r) == -1);
+  len = sprintf (many, "GET / HTTP/1.0\r\n");
+  for (i = 0; i <= HTTP_MAX_HEADERS; i++)
+    len += sprintf (many + len, "X: %d\r\n", i);
+  len += sprintf (many + len, "\r\n");
+  assert (http_parse_request (many, len, &r) == -1);
+
+  assert (http_header_id ("ACCEPT-encoding", 15) == HTTP_ACCEPT_ENCODING);
+  assert (http_header_id ("Accept", 6) == HTTP_ACCEPT);
+  assert (http_header_id ("Keep-alive", 10) == HTTP_KEEP_ALIVE);
+  assert (http_header_id ("Connection", 10) == HTTP_CONNECTION);
+  assert (http_header_id ("Hosts", 5) == HTTP_OTHER);
+  assert (http_header_id ("Cookie", 6) == HTTP_OTHER);
+  assert (http_header_id ("Accept-Language", 15) == HTTP_OTHER);
+
+  // Two pipelined heads and then a line, read back one at a time
+  assert (pipe (fds) == 0);
+  assert (write (fds[1], req, strlen (req)) == strlen (req));
+  assert (write (fds[1], "tail\n", 5) == 5);
+  close (fds[1]);
+  rio_readinitb (&rio, fds[0]);
+  assert (rio_readheadb (&rio, buf, MAXLINE) == headLen);
+  assert (!memcmp (buf, req, headLen));
+  assert (rio_readheadb (&rio, buf, MAXLINE) == strlen (req) - headLen);
+  assert (rio_readlineb (&rio, buf, 3) == 3 && !strcmp (buf, "ta"));
+  assert (rio_readlineb (&rio, buf, MAXLINE) == 3 && !strcmp (buf, "il\n"));
+  assert (rio_readlineb (&rio, buf, MAXLINE) == 0);
+  assert (rio_readheadb (&rio, buf, MAXLINE) == 0);
+  close (fds[0]);
+
+  // A head that doesn't fit, or ends early, is an error
+  for (i = 0; i < 2; i++) {
+    assert (pipe (fds) == 0);
+    assert (write (fds[1], req, headLen - i) == headLen - i);
+    close (fds[1]);
+    rio_readinitb (&rio, fds[0]);
+    assert (rio_readheadb (&rio, buf, i ? MAXLINE : headLen - 1) == -1);
+    close (fds[0]);
+  }
+}
+
+/*
+ * tpool_stub - a job that takes a while, counting the args it ran with
+ */
+int tpool_ran = 0;
+
+void tpool_stub (int fd, int arg) {
+  usleep (200000);
+  __sync_fetch_and_add (&tpool_ran, arg);
+}
+
+/*
+ * test_tpool - a pool grows while work is queued, shrinks back to
+ * min_threads once idle, and then blocks instead of polling
+ */
+void test_tpool () {
+  tpool P = tpool_new (1, 4, 8, 1, tpool_stub);
+  struct timespec t0, t1;
+  int i, n;
+
+  for (i = 0; i < 4; i++)
+    assert (tpool_submit (P, -1, 1) == 0);
+  pthread_mutex_lock (&P->mutex);
+  n = P->nthreads;
+  pthread_mutex_unlock (&P->mutex);
+  assert (n > 1);
+  assert (tpool_drain (P, 5) == 0 && tpool_ran == 4);
+
+  sleep (3);
+  pthread_mutex_lock (&P->mutex);
+  assert (P->nthreads == 1 && P->nidle == 1);
+  pthread_mutex_unlock (&P->mutex);
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &t0);
+  sleep (1);
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &t1);
+  assert ((t1.tv_sec - t0.tv_sec) * 1000000000L
+    + (t1.tv_nsec - t0.tv_nsec) < 50000000L);
+
+  // Still serves work after all that
+  assert (tpool_submit (P, -1, 1) == 0);
+  assert (tpool_drain (P, 5) == 0 && tpool_ran == 5);
+}
+
+/*
+ * connpool_waiter - check out a connection to the test origin, which
+ * has to wait for one to be handed back
+ */
+int connpool_port;
+int connpool_got = 0;
+
+void *connpool_waiter (void *P) {
+  int reused, fd;
+
+  fd = connpool_get ((connpool)P, "127.0.0.1", connpool_port, &reused);
+  __sync_fetch_and_add (&connpool_got, 1);
+  return (void *)(long)fd;
+}
+
+/*
+ * connpool_test_origin - the pool's only origin
+ */
+struct origin *connpool_test_origin (connpool P) {
+  int b;
+
+  for (b = 0; b < CONNPOOL_BUCKETS; b++)
+    if (P->buckets[b])
+      return P->buckets[b];
+  return NULL;
+}
+
+/*
+ * test_connpool - connections handed back are reused until the origin
+ * closes them, at most maxIdle are kept, and no more than maxActive are
+ * out at once
+ */
+void test_connpool () {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+  int lfd = socket (AF_INET, SOCK_STREAM, 0);
+  int a, b, reused, sa;
+  struct origin *o;
+  pthread_t tid;
+  void *ret;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  assert (bind (lfd, (struct sockaddr *)&sin, sizeof (sin)) == 0);
+  assert (listen (lfd, 8) == 0);
+  assert (getsockname (lfd, (struct sockaddr *)&sin, &len) == 0);
+  connpool_port = ntohs (sin.sin_port);
+
+  connpool P = connpool_new (1, 60, 2);
+
+  // A new connection, then the same one again once handed back
+  a = connpool_get (P, "127.0.0.1", connpool_port, &reused);
+  assert (a >= 0 && !reused);
+  sa = accept (lfd, NULL, NULL);
+  connpool_put (P, "127.0.0.1", connpool_port, a);
+  o = connpool_test_origin (P);
+  assert (o->nidle == 1 && o->nactive == 0);
+  assert (connpool_get (P, "127.0.0.1", connpool_port, &reused) == a
+    && reused);
+
+  // A third request waits until one of the two out comes back
+  b = connpool_get (P, "127.0.0.1", connpool_port, &reused);
+  assert (b >= 0 && !reused && o->nactive == 2);
+  close (accept (lfd, NULL, NULL));
+  assert (pthread_create (&tid, NULL, connpool_waiter, P) == 0);
+  usleep (200000);
+  assert (connpool_got == 0);
+  connpool_drop (P, "127.0.0.1", connpool_port, b);
+  assert (pthread_join (tid, &ret) == 0 && (long)ret >= 0);
+  close (accept (lfd, NULL, NULL));
+  assert (o->nactive == 2);
+
+  // Only maxIdle are kept when both are handed back
+  connpool_put (P, "127.0.0.1", connpool_port, (int)(long)ret);
+  connpool_put (P, "127.0.0.1", connpool_port, a);
+  assert (o->nidle == 1 && o->nactive == 0);
+
+  // The kept one is a, and once the origin closes it it isn't reused
+  close (sa);
+  usleep (50000);
+  b = connpool_get (P, "127.0.0.1", connpool_port, &reused);
+  assert (b >= 0 && !reused && o->nidle == 0);
+  close (accept (lfd, NULL, NULL));
+  connpool_drop (P, "127.0.0.1", connpool_port, b);
+  assert (o->nactive == 0);
+
+  connpool_free (P);
+  close (lfd);
+}
+
+/*
+ * idle_stub - a wake handler that notes what it was handed
+ */
+int idle_woken = 0, idle_fd = -1, idle_served = -1;
+
+void idle_stub (int fd, int served) {
+  idle_fd = fd;
+  idle_served = served;
+  __sync_fetch_and_add (&idle_woken, 1);
+}
+
+/*
+ * idle_closed - whether the peer of fd, the other end of a parked
+ * socket, sees it closed within secs seconds
+ */
+int idle_closed (int fd, int secs) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  char c;
+
+  return poll (&pfd, 1, secs * 1000) == 1 && read (fd, &c, 1) == 0;
+}
+
+/*
+ * test_idle - a parked connection is handed back once it has something
+ * to read, closed once it has been idle too long, and closed by
+ * idle_stop, after which parking just closes
+ */
+void test_idle () {
+  idlers I = idle_new (1, idle_stub);
+  int a[2], b[2], c[2], d[2], i;
+
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, a) == 0);
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, b) == 0);
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, c) == 0);
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, d) == 0);
+
+  // Woken by its next request, with the count it was parked with
+  idle_park (I, a[0], 3);
+  idle_park (I, b[0], 1);
+  usleep (100000);
+  assert (idle_woken == 0);
+  assert (write (a[1], "G", 1) == 1);
+  for (i = 0; i < 100 && !idle_woken; i++)
+    usleep (10000);
+  assert (idle_woken == 1 && idle_fd == a[0] && idle_served == 3);
+
+  // Nothing more arrives on b, so it expires without a wakeup
+  assert (idle_closed (b[1], 3));
+  assert (idle_woken == 1);
+
+  // Stopping closes what is parked, and anything parked later
+  idle_park (I, c[0], 1);
+  idle_stop (I);
+  assert (idle_closed (c[1], 0));
+  idle_park (I, d[0], 1);
+  assert (idle_closed (d[1], 0));
+  assert (idle_woken == 1);
+
+  // The proxy keeps I around for late parkers; the test needn't
+  close (I->epfd);
+  close (I->stopfd);
+  free (I);
+
+  close (a[0]);
+  close (a[1]);
+  close (b[1]);
+  close (c[1]);
+  close (d[1]);
 }
 
 int main () {
+    test_dns ();
+    test_pinned ();
+    test_index ();
+    test_policies ();
+    test_doorkeeper ();
+    test_store ();
+    test_slabs ();
+    test_compress ();
+    test_disk ();
+    test_snapshot ();
+    test_http ();
+    test_tpool ();
+    test_connpool ();
+    test_idle ();
+
     // Allocate local variables
     int *dummy = malloc(sizeof(int));
-    cache C = cache_new ();
+    cache C = cache_new (1, &policy_lru, 0, 0, 0);
 
     // Init some macros
     int BIG = 500000;
@@ -33,14 +1009,12 @@ int main () {
     assert (cache_get (C, "www.google.com", "/", 80, dummy) != NULL);
     assert (cache_get (C, "www.google.com", "/", 80, dummy) != NULL);
     assert (cache_get (C, "www.google.com", "/", 80, dummy) != NULL);
-    stall (9999);
 
     // Insert youtube.com
     assert (cache_get (C, "www.youtube.com", "/", 80, dummy) == NULL);
     cache_insert (C, "www.youtube.com", "/", 80, large_string, BIG);
     assert (cache_get (C, "www.google.com", "/", 80, dummy) != NULL);
     assert (cache_get (C, "www.youtube.com", "/", 80, dummy) != NULL);
-    stall(9999);
 
     // Insert youtube2.com
     assert (cache_get (C, "www.youtube2.com", "/", 80, dummy) == NULL);
@@ -48,7 +1022,6 @@ int main () {
     assert (cache_get (C, "www.youtube.com", "/", 80, dummy) != NULL);
     assert (cache_get (C, "www.youtube2.com", "/", 80, dummy) != NULL);
     assert (cache_get (C, "www.google.com", "/", 80, dummy) == NULL);
-    stall (9999);
 
     // Access youtube again
     assert (cache_get (C, "www.youtube.com", "/", 80, dummy) != NULL);
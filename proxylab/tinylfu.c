@@ -0,0 +1,152 @@
+#include "policy.h"
+#include "sketch.h"
+
+/* Share of a shard's bytes for the admission window */
+#define TINYLFU_WINDOW_PCT 1
+/* Share of the rest for the protected segment of the main SLRU */
+#define TINYLFU_PROTECTED_PCT 80
+/* Expected bytes per entry, to size the frequency sketch */
+#define TINYLFU_ENTRY_BYTES 256
+
+enum { TINYLFU_WINDOW, TINYLFU_PROBATION, TINYLFU_PROTECTED };
+
+/*
+ * W-TinyLFU: new entries go on a small LRU window. The window's LRU entry
+ * spills into the main cache, a segmented LRU, while the window is over
+ * its share and the main cache has room. Otherwise it is a candidate for
+ * the main cache, admitted only if a count-min sketch of recent lookups
+ * says it is used more often than the main cache's own victim; whichever
+ * loses is evicted. The window lets bursts in, the sketch keeps
+ * scans and one-hit wonders from displacing popular entries.
+ *
+ * Main entries start on probation and are promoted to the protected
+ * segment when hit again; the protected segment's overflow is demoted
+ * back to probation, whose tail is the main cache's victim.
+ */
+struct tinylfu
+{
+    struct policy_queue window;
+    struct policy_queue probation;
+    struct policy_queue protected;
+    long windowMax;
+    long mainMax;
+    long protectedMax;
+    sketch freq;
+};
+
+static void *tinylfu_new (int capacity)
+{
+    struct tinylfu *T = calloc(1, sizeof(struct tinylfu));
+
+    T->windowMax = (long)capacity * TINYLFU_WINDOW_PCT / 100;
+    T->mainMax = capacity - T->windowMax;
+    T->protectedMax = T->mainMax * TINYLFU_PROTECTED_PCT / 100;
+    T->freq = sketch_new (capacity / TINYLFU_ENTRY_BYTES);
+    return T;
+}
+
+static void tinylfu_free (void *P)
+{
+    struct tinylfu *T = P;
+
+    sketch_free (T->freq);
+    free (T);
+}
+
+static void tinylfu_access (void *P, uint64_t hash)
+{
+    struct tinylfu *T = P;
+
+    sketch_add (T->freq, hash);
+}
+
+static void tinylfu_hit (void *P, web_data w)
+{
+    struct tinylfu *T = P;
+
+    switch (w->queue)
+    {
+    case TINYLFU_WINDOW:
+        policy_queue_remove (&T->window, w);
+        policy_queue_push (&T->window, w);
+        break;
+    case TINYLFU_PROBATION:
+        policy_queue_remove (&T->probation, w);
+        w->queue = TINYLFU_PROTECTED;
+        policy_queue_push (&T->protected, w);
+
+        while (T->protected.bytes > T->protectedMax
+            && T->protected.tail != w)
+        {
+            web_data d = T->protected.tail;
+            policy_queue_remove (&T->protected, d);
+            d->queue = TINYLFU_PROBATION;
+            policy_queue_push (&T->probation, d);
+        }
+        break;
+    case TINYLFU_PROTECTED:
+        policy_queue_remove (&T->protected, w);
+        policy_queue_push (&T->protected, w);
+        break;
+    }
+}
+
+static void tinylfu_insert (void *P, web_data w)
+{
+    struct tinylfu *T = P;
+
+    w->queue = TINYLFU_WINDOW;
+    policy_queue_push (&T->window, w);
+}
+
+static web_data tinylfu_evict (void *P)
+{
+    struct tinylfu *T = P;
+    web_data cand, victim;
+
+    while ((cand = T->window.tail))
+    {
+        int spill = T->window.bytes > T->windowMax;
+
+        victim = T->probation.tail ? T->probation.tail : T->protected.tail;
+        policy_queue_remove (&T->window, cand);
+
+        // An overfull window spills into the main cache while it has room
+        if (spill && (victim == NULL || T->probation.bytes
+            + T->protected.bytes + web_data_size (cand) <= T->mainMax))
+        {
+            cand->queue = TINYLFU_PROBATION;
+            policy_queue_push (&T->probation, cand);
+            continue;
+        }
+
+        if (victim == NULL || sketch_estimate (T->freq, cand->hash)
+            <= sketch_estimate (T->freq, victim->hash))
+            return cand;
+
+        cand->queue = TINYLFU_PROBATION;
+        policy_queue_push (&T->probation, cand);
+        policy_queue_remove (victim->queue == TINYLFU_PROBATION
+            ? &T->probation : &T->protected, victim);
+        return victim;
+    }
+
+    if ((victim = T->probation.tail))
+        policy_queue_remove (&T->probation, victim);
+    else
+        policy_queue_remove (&T->protected, victim = T->protected.tail);
+    return victim;
+}
+
+static void tinylfu_remove (void *P, web_data w)
+{
+    struct tinylfu *T = P;
+
+    policy_queue_remove (w->queue == TINYLFU_WINDOW ? &T->window
+        : w->queue == TINYLFU_PROBATION ? &T->probation : &T->protected, w);
+}
+
+const policy_ops_t policy_tinylfu = {
+    "tinylfu", tinylfu_new, tinylfu_free, tinylfu_access, tinylfu_hit,
+    tinylfu_insert, tinylfu_evict, tinylfu_remove
+};
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "tpool.h"
+
+static void *tpool_worker (void *vargp);
+static int tpool_spawn (tpool P);
+
+/*
+ * tpool_new - start a pool with min_threads workers. handler is called
+ * by a worker for every fd taken off the queue, with the arg it was
+ * submitted with, and owns the fd.
+ */
+tpool tpool_new (int min_threads, int max_threads, int depth,
+    int idle_secs, void (*handler)(int fd, int arg))
+{
+    tpool P = malloc(sizeof(struct tpool_header));
+
+    if (min_threads < 1)
+        min_threads = 1;
+    if (max_threads < min_threads)
+        max_threads = min_threads;
+    if (depth < 1)
+        depth = 1;
+
+    P->queue = calloc(depth, sizeof(struct tpool_job));
+    P->depth = depth;
+    P->front = 0;
+    P->count = 0;
+    P->min_threads = min_threads;
+    P->max_threads = max_threads;
+    P->nthreads = 0;
+    P->nidle = 0;
+    P->idle_secs = idle_secs;
+    P->handler = handler;
+
+    pthread_mutex_init(&P->mutex, NULL);
+    pthread_cond_init(&P->ready, NULL);
+    pthread_cond_init(&P->drained, NULL);
+
+    // Workers are detached and run with a bounded stack so that the
+    // memory cost of the pool is known up front
+    pthread_attr_init(&P->attr);
+    pthread_attr_setdetachstate(&P->attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&P->attr, TPOOL_STACK_SIZE);
+
+    pthread_mutex_lock(&P->mutex);
+    int i;
+    for (i = 0; i < min_threads; i++)
+        tpool_spawn(P);
+    pthread_mutex_unlock(&P->mutex);
+
+    return P;
+}
+
+/*
+ * tpool_submit - queue fd and arg for a worker. Returns 0 on success
+ * and -1 if the queue is full, in which case the caller still owns fd.
+ */
+int tpool_submit (tpool P, int fd, int arg)
+{
+    pthread_mutex_lock(&P->mutex);
+
+    if (P->count == P->depth)
+    {
+        pthread_mutex_unlock(&P->mutex);
+        return -1;
+    }
+
+    P->queue[(P->front + P->count) % P->depth].fd = fd;
+    P->queue[(P->front + P->count) % P->depth].arg = arg;
+    P->count++;
+
+    // Grow if there is more queued work than idle workers to take it
+    if (P->count > P->nidle && P->nthreads < P->max_threads)
+        tpool_spawn(P);
+
+    pthread_cond_signal(&P->ready);
+    pthread_mutex_unlock(&P->mutex);
+    return 0;
+}
+
+/*
+ * tpool_drain - wait up to secs seconds for the queue to empty and every
+ * worker to finish what it is doing. Nothing more should be submitted
+ * meanwhile. Returns 0 once the pool is idle and -1 if it is still busy.
+ */
+int tpool_drain (tpool P, int secs)
+{
+    struct timespec deadline;
+    int rc = 0, idle;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += secs;
+
+    pthread_mutex_lock(&P->mutex);
+
+    while ((P->count > 0 || P->nidle < P->nthreads) && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&P->drained, &P->mutex, &deadline);
+
+    idle = P->count == 0 && P->nidle == P->nthreads;
+    pthread_mutex_unlock(&P->mutex);
+    return idle ? 0 : -1;
+}
+
+/*
+ * tpool_spawn - start one more worker. Caller must hold P->mutex.
+ * Returns 0 on success and -1 if the thread could not be created.
+ */
+static int tpool_spawn (tpool P)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, &P->attr, tpool_worker, P) != 0)
+    {
+        fprintf(stderr, "Could not create worker thread\n");
+        return -1;
+    }
+
+    P->nthreads++;
+    return 0;
+}
+
+/*
+ * tpool_worker - take fds off the queue until this worker has been idle
+ * for idle_secs while the pool is above min_threads. While it is not,
+ * idle workers wait untimed, so an idle pool uses no CPU.
+ */
+static void *tpool_worker (void *vargp)
+{
+    tpool P = (tpool)vargp;
+    struct timespec deadline;
+    struct tpool_job job;
+
+    pthread_mutex_lock(&P->mutex);
+
+    while (1)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += P->idle_secs;
+
+        while (P->count == 0)
+        {
+            int rc;
+
+            P->nidle++;
+            pthread_cond_broadcast(&P->drained);
+            if (P->nthreads > P->min_threads)
+                rc = pthread_cond_timedwait(&P->ready, &P->mutex, &deadline);
+            else
+                rc = pthread_cond_wait(&P->ready, &P->mutex);
+            P->nidle--;
+
+            if (rc == ETIMEDOUT && P->count == 0
+                && P->nthreads > P->min_threads)
+            {
+                P->nthreads--;
+                pthread_mutex_unlock(&P->mutex);
+                return NULL;
+            }
+        }
+
+        job = P->queue[P->front];
+        P->front = (P->front + 1) % P->depth;
+        P->count--;
+
+        pthread_mutex_unlock(&P->mutex);
+        P->handler(job.fd, job.arg);
+        pthread_mutex_lock(&P->mutex);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef TPOOL_H
+#define TPOOL_H
+
+#include <pthread.h>
+
+/* Defaults for the worker pool, overridable from the command line */
+#define TPOOL_MIN_THREADS 4
+#define TPOOL_MAX_THREADS 64
+#define TPOOL_QUEUE_DEPTH 256
+#define TPOOL_IDLE_SECS 30
+#define TPOOL_STACK_SIZE (512 * 1024)
+
+/* A connected file descriptor for a worker, and a number of the
+   submitter's to go with it */
+struct tpool_job
+{
+    int fd;
+    int arg;
+};
+
+/*  A pool of worker threads fed by a bounded queue of connected
+    file descriptors. The pool never runs fewer than min_threads
+    workers. It grows towards max_threads while work is queued and
+    nobody is idle, and surplus workers exit after sitting idle for
+    idle_secs. */
+struct tpool_header
+{
+    struct tpool_job *queue; /* circular buffer of pending fds */
+    int depth;              /* capacity of queue */
+    int front;              /* index of the oldest pending fd */
+    int count;              /* number of pending fds */
+
+    int min_threads;
+    int max_threads;
+    int nthreads;           /* workers currently alive */
+    int nidle;              /* workers blocked waiting for work */
+    int idle_secs;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;   /* signalled when an fd is queued */
+    pthread_cond_t drained; /* broadcast when a worker runs out of work */
+    pthread_attr_t attr;
+
+    void (*handler)(int fd, int arg);
+};
+typedef struct tpool_header *tpool;
+
+tpool tpool_new (int min_threads, int max_threads, int depth,
+    int idle_secs, void (*handler)(int fd, int arg));
+int tpool_submit (tpool P, int fd, int arg);
+int tpool_drain (tpool P, int secs);
+
+#endif
@@ -0,0 +1,541 @@
+/*
+ * uring.c - io_uring I/O backend
+ *
+ * Each thread lazily sets up its own ring (there is no locking around
+ * a ring) and registers a pair of relay buffers with it, so reads and
+ * writes into those buffers use the _FIXED opcodes and skip the
+ * per-call page pinning. Where io_uring actually saves system calls:
+ *
+ *   - uring_accept arms one multishot accept and then hands out one
+ *     connection per completion. A burst of connections is drained
+ *     from the completion queue without entering the kernel at all.
+ *   - uring_relay submits the write of chunk k together with the read
+ *     of chunk k+1, so copying a response costs one io_uring_enter per
+ *     chunk instead of a read and a write.
+ *
+ * uring_read and uring_write are drop-in replacements for the system
+ * calls underneath Rio (see io_ops in csapp.h). If a thread cannot get
+ * a ring they fall back to the plain system calls. Connections to web
+ * servers are raced by open_clientfd_r on non-blocking sockets and do
+ * not go through the ring.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "uring.h"
+
+/* user_data of the multishot accept; other requests count up from 2 */
+#define URING_ACCEPT_TAG 1
+
+/* A completion that arrived while waiting for a different request */
+struct uring_done
+{
+    __u64 tag;
+    __s32 res;
+    __u32 flags;
+};
+
+struct uring
+{
+    int fd;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqPtr, *cqPtr;
+    size_t sqSize, cqSize, sqesSize;
+
+    char *buf;                  /* 2 * URING_BUFSIZE, registered */
+    int fixed;                  /* 1 if buf is registered with the ring */
+    __u64 nextTag;
+
+    struct uring_done *stash;   /* completions nobody has claimed yet */
+    int nstash, stashSize;
+
+    int acceptArmed;            /* a multishot accept is outstanding */
+    int acceptMultishot;        /* 0 once the kernel rejected multishot */
+};
+
+static pthread_key_t uring_key;
+static __thread struct uring *ring;
+static __thread int ringFailed;
+
+static struct uring *uring_get (void);
+static struct uring *uring_new (void);
+static void uring_free (void *vargp);
+static struct io_uring_sqe *uring_sqe (struct uring *r, int op, int fd,
+    const void *buf, size_t n, __u64 *tag);
+static int uring_enter (struct uring *r, unsigned submit, unsigned wait);
+static int uring_wait (struct uring *r, __u64 tag, __u32 *flags);
+static void uring_stash (struct uring *r, struct io_uring_cqe *cqe);
+static int uring_want (long limit, int size);
+
+/*
+ * uring_init - check that the kernel supports every operation we use.
+ * Returns 0 if the io_uring backend can be used and -1 otherwise.
+ */
+int uring_init (void)
+{
+    static const int ops[] = {IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_ACCEPT};
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    int fd, i, ok = 1;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return -1;
+
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, size);
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+        probe, 256) < 0)
+        ok = 0;
+
+    for (i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (ops[i] > probe->last_op
+            || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+
+    free(probe);
+    close(fd);
+
+    if (!ok || pthread_key_create(&uring_key, uring_free) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * uring_read - read(2) through this thread's ring
+ */
+ssize_t uring_read (int fd, void *buf, size_t n)
+{
+    struct uring *r = uring_get();
+    __u64 tag;
+
+    if (r == NULL)
+        return read(fd, buf, n);
+
+    uring_sqe(r, IORING_OP_READ, fd, buf, n, &tag);
+    if (uring_enter(r, 1, 0) < 0)
+        return -1;
+
+    int res = uring_wait(r, tag, NULL);
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+/*
+ * uring_write - write(2) through this thread's ring
+ */
+ssize_t uring_write (int fd, const void *buf, size_t n)
+{
+    struct uring *r = uring_get();
+    __u64 tag;
+
+    if (r == NULL)
+        return write(fd, buf, n);
+
+    uring_sqe(r, IORING_OP_WRITE, fd, buf, n, &tag);
+    if (uring_enter(r, 1, 0) < 0)
+        return -1;
+
+    int res = uring_wait(r, tag, NULL);
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+/*
+ * uring_accept - return the next connection on listenfd. Only one
+ * thread should accept on a given listenfd through its ring. Returns
+ * the connected fd or -1 with errno set.
+ */
+int uring_accept (int listenfd)
+{
+    struct uring *r = uring_get();
+    __u32 flags = 0;
+    __u64 tag;
+
+    if (r == NULL)
+        return accept(listenfd, NULL, NULL);
+
+    while (1)
+    {
+        if (!r->acceptArmed)
+        {
+            struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_ACCEPT,
+                listenfd, NULL, 0, &tag);
+            sqe->user_data = URING_ACCEPT_TAG;
+            if (r->acceptMultishot)
+                sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+            if (uring_enter(r, 1, 0) < 0)
+                return -1;
+            r->acceptArmed = 1;
+        }
+
+        int res = uring_wait(r, URING_ACCEPT_TAG, &flags);
+
+        // A failed accept is armed afresh next time, whatever the flags
+        if (res < 0 || !(flags & IORING_CQE_F_MORE))
+            r->acceptArmed = 0;
+
+        // Kernels before 5.19 reject the multishot flag
+        if (res == -EINVAL && r->acceptMultishot)
+        {
+            r->acceptMultishot = 0;
+            continue;
+        }
+
+        if (res < 0)
+        {
+            errno = -res;
+            return -1;
+        }
+        return res;
+    }
+}
+
+/*
+ * uring_relay - copy what webfd sends to fd, passing each chunk to sink
+ * as well. Stops after limit bytes, or at EOF if limit is negative. The
+ * write of one chunk and the read of the next go to the kernel in a
+ * single submission, both on registered buffers. Returns 0 on success
+ * and -1 on a read or write error.
+ */
+int uring_relay (int webfd, int fd, long limit,
+    void (*sink)(void *arg, const char *data, int len), void *arg)
+{
+    struct uring *r = uring_get();
+    __u64 rtag, wtag;
+    int n, w;
+
+    if (limit == 0)
+        return 0;
+
+    if (r == NULL)
+    {
+        char buf[MAXLINE];
+
+        while ((n = rio_readn(webfd, buf, uring_want(limit, MAXLINE))) > 0)
+        {
+            if (rio_writen(fd, buf, n) != n)
+                return -1;
+            sink(arg, buf, n);
+
+            if (limit > 0 && (limit -= n) == 0)
+                return 0;
+        }
+        return n;
+    }
+
+    char *cur = r->buf;
+    char *next = r->buf + URING_BUFSIZE;
+
+    uring_sqe(r, IORING_OP_READ_FIXED, webfd, cur,
+        uring_want(limit, URING_BUFSIZE), &rtag);
+    if (uring_enter(r, 1, 0) < 0)
+        return -1;
+    n = uring_wait(r, rtag, NULL);
+
+    while (n > 0)
+    {
+        sink(arg, cur, n);
+
+        if (limit > 0)
+            limit -= n;
+
+        // Nothing more to read once limit bytes have arrived
+        uring_sqe(r, IORING_OP_WRITE_FIXED, fd, cur, n, &wtag);
+        if (limit != 0)
+            uring_sqe(r, IORING_OP_READ_FIXED, webfd, next,
+                uring_want(limit, URING_BUFSIZE), &rtag);
+        if (uring_enter(r, limit != 0 ? 2 : 1, 0) < 0)
+            return -1;
+
+        w = uring_wait(r, wtag, NULL);
+        int rn = limit != 0 ? uring_wait(r, rtag, NULL) : 0;
+
+        if (w < 0)
+            return -1;
+
+        // Finish a short write before the next chunk goes out
+        if (w < n && rio_writen(fd, cur + w, n - w) != n - w)
+            return -1;
+
+        n = rn;
+        char *tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    if (n < 0)
+    {
+        errno = -n;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * uring_want - how much to read next: size, or less if only limit
+ * bytes are left to relay
+ */
+static int uring_want (long limit, int size)
+{
+    return limit >= 0 && limit < size ? (int)limit : size;
+}
+
+/*
+ * uring_get - this thread's ring, created on first use. Returns NULL if
+ * this thread could not get one.
+ */
+static struct uring *uring_get (void)
+{
+    if (ring == NULL && !ringFailed)
+    {
+        if ((ring = uring_new()) == NULL)
+            ringFailed = 1;
+        else
+            pthread_setspecific(uring_key, ring);
+    }
+
+    return ring;
+}
+
+/*
+ * uring_new - set up a ring and map its queues. Registering the relay
+ * buffers is best-effort, since it can fail on a low RLIMIT_MEMLOCK.
+ */
+static struct uring *uring_new (void)
+{
+    struct io_uring_params p;
+    struct uring *r = calloc(1, sizeof(struct uring));
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    r->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cqSize > r->sqSize)
+            r->sqSize = r->cqSize;
+        r->cqSize = r->sqSize;
+    }
+
+    r->sqPtr = mmap(NULL, r->sqSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cqPtr = r->sqPtr;
+    else
+        r->cqPtr = mmap(NULL, r->cqSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+    r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+    if (r->sqPtr == MAP_FAILED || r->cqPtr == MAP_FAILED
+        || r->sqes == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map io_uring queues\n");
+        uring_free(r);
+        return NULL;
+    }
+
+    char *sq = r->sqPtr;
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+
+    char *cq = r->cqPtr;
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->nextTag = URING_ACCEPT_TAG + 1;
+    r->acceptMultishot = 1;
+
+    struct iovec iov;
+    r->buf = malloc(2 * URING_BUFSIZE);
+    iov.iov_base = r->buf;
+    iov.iov_len = 2 * URING_BUFSIZE;
+
+    r->fixed = syscall(__NR_io_uring_register, r->fd,
+        IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    return r;
+}
+
+/*
+ * uring_free - tear down a ring, either on thread exit or after a
+ * failed setup
+ */
+static void uring_free (void *vargp)
+{
+    struct uring *r = (struct uring *)vargp;
+
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqesSize);
+    if (r->cqPtr && r->cqPtr != MAP_FAILED && r->cqPtr != r->sqPtr)
+        munmap(r->cqPtr, r->cqSize);
+    if (r->sqPtr && r->sqPtr != MAP_FAILED)
+        munmap(r->sqPtr, r->sqSize);
+
+    close(r->fd);
+    free(r->buf);
+    free(r->stash);
+    free(r);
+}
+
+/*
+ * uring_sqe - queue a request for op on fd with buffer buf of n bytes
+ * and store its user_data in *tag. Reads and writes that fall inside the
+ * registered buffers are turned into their _FIXED variants. The request
+ * is not submitted until uring_enter.
+ */
+static struct io_uring_sqe *uring_sqe (struct uring *r, int op, int fd,
+    const void *buf, size_t n, __u64 *tag)
+{
+    unsigned tail = *r->sqTail;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    const char *p = buf;
+    int inFixed = r->fixed && p >= r->buf
+        && p + n <= r->buf + 2 * URING_BUFSIZE;
+
+    if (op == IORING_OP_READ_FIXED && !inFixed)
+        op = IORING_OP_READ;
+    if (op == IORING_OP_WRITE_FIXED && !inFixed)
+        op = IORING_OP_WRITE;
+    if (op == IORING_OP_READ && inFixed)
+        op = IORING_OP_READ_FIXED;
+    if (op == IORING_OP_WRITE && inFixed)
+        op = IORING_OP_WRITE_FIXED;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = n;
+    sqe->off = (__u64)-1;   /* sockets have no file position */
+    sqe->buf_index = 0;
+    sqe->user_data = *tag = r->nextTag++;
+
+    if (op == IORING_OP_ACCEPT)
+        sqe->off = 0;
+
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*
+ * uring_enter - submit the submit newest requests and wait until at
+ * least wait completions are ready. Returns -1 with errno set on error.
+ */
+static int uring_enter (struct uring *r, unsigned submit, unsigned wait)
+{
+    int rc;
+
+    do
+    {
+        rc = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * uring_wait - wait for the completion of the request tagged tag and
+ * return its result (a negated errno on failure). Completions of other
+ * requests seen on the way are stashed for their own waiters.
+ */
+static int uring_wait (struct uring *r, __u64 tag, __u32 *flags)
+{
+    int i;
+
+    while (1)
+    {
+        for (i = 0; i < r->nstash; i++)
+        {
+            if (r->stash[i].tag == tag)
+            {
+                struct uring_done d = r->stash[i];
+                r->stash[i] = r->stash[--r->nstash];
+                if (flags)
+                    *flags = d.flags;
+                return d.res;
+            }
+        }
+
+        unsigned head = *r->cqHead;
+        unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+            head++;
+
+            if (cqe->user_data == tag)
+            {
+                int res = cqe->res;
+                if (flags)
+                    *flags = cqe->flags;
+                __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+                return res;
+            }
+
+            uring_stash(r, cqe);
+        }
+
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+
+        if (uring_enter(r, 0, 1) < 0)
+            return -errno;
+    }
+}
+
+/*
+ * uring_stash - remember a completion for whoever waits on it later.
+ * Dropping one would leave its waiter stuck for good, so running out of
+ * memory for it is fatal.
+ */
+static void uring_stash (struct uring *r, struct io_uring_cqe *cqe)
+{
+    if (r->nstash == r->stashSize)
+    {
+        r->stashSize = r->stashSize ? 2 * r->stashSize : 8;
+        r->stash = Realloc(r->stash,
+            r->stashSize * sizeof(struct uring_done));
+    }
+
+    r->stash[r->nstash].tag = cqe->user_data;
+    r->stash[r->nstash].res = cqe->res;
+    r->stash[r->nstash].flags = cqe->flags;
+    r->nstash++;
+}
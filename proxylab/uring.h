@@ -0,0 +1,20 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Submission queue depth of each thread's ring */
+#define URING_ENTRIES 32
+/* Each thread registers two relay buffers of this size with its ring */
+#define URING_BUFSIZE 16384
+
+int uring_init (void);
+
+ssize_t uring_read (int fd, void *buf, size_t n);
+ssize_t uring_write (int fd, const void *buf, size_t n);
+int uring_accept (int listenfd);
+int uring_relay (int webfd, int fd, long limit,
+    void (*sink)(void *arg, const char *data, int len), void *arg);
+
+#endif
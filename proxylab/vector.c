@@ -1,142 +1,168 @@
 #include "vector.h"
 
-void vector_pop (vector V, int index);
-int vector_find_LRU (vector V);
-void vector_resize (vector V);
+static void vector_index_add (vector V, web_data w);
+static void vector_index_remove (vector V, web_data w);
+static void vector_index_rebuild (vector V, int cap);
+
+#define VECTOR_INDEX_MIN 16
+
+/* Marks an index slot whose entry was removed, so probes go past it */
+static struct web_data_hdr tombstone;
+#define TOMBSTONE (&tombstone)
 
 /*
  * vector_new - constructor for vector
  */
-vector vector_new () 
+vector vector_new ()
 {
     vector V = malloc(sizeof(struct vector_header));
     V->size = 0;
-    V->capacity = 5;
-    V->arr = calloc(V->capacity, sizeof(web_data));
+    V->index = NULL;
+    V->indexCap = 0;
+    vector_index_rebuild (V, VECTOR_INDEX_MIN);
     return V;
 }
 
 /*
  * vector_free - frees a vector and all its contents
  */
-void vector_free (vector V) 
+void vector_free (vector V)
 {
-    // Free elements in array
     int i;
-    for (i = 0; i < V->size; i ++) 
+
+    // Free elements in the index
+    for (i = 0; i < V->indexCap; i++)
     {
-        web_data_free (V->arr[i]);
+        web_data w = V->index[i].w;
+        if (w != NULL && w != TOMBSTONE)
+            web_data_release (w);
     }
-    // Free the array
-    free (V->arr);
+    // Free the index
+    free (V->index);
     // Free V
     free (V);
 }
 
 /*
  * vector_get - Return web_data_hdr pointer (i.e. web_data) that matches
- * website, file, and port
+ * website, file, and port, whose web_data_hash is hash
  */
-web_data vector_get (vector V, char *website, char *file, int port)
+web_data vector_get (vector V, uint64_t hash, char *website, char *file,
+    int port)
 {
-    // Iterate over the vector
+    int mask = V->indexCap - 1;
     int i;
-    for (i = 0; i < V->size; i ++) {
-        // If matches
-        if (web_data_equals (V->arr[i], website, file, port)) {
-            // Update the used timestamp and return
-            web_data_update_acc_time (V->arr[i]);
-            return V->arr[i];
-        }
+
+    // Probe the index until an empty slot; only a matching hash costs
+    // a look at the key strings
+    for (i = hash & mask; V->index[i].w != NULL; i = (i + 1) & mask) {
+        web_data w = V->index[i].w;
+
+        if (w != TOMBSTONE && V->index[i].hash == hash
+            && web_data_equals (w, website, file, port))
+            return w;
     }
     // Not found
     return NULL;
 }
 
-/* 
- * vector_pop -  pops the element at index in the vector
+/*
+ * vector_remove - Removes w, which the cache's eviction policy picked,
+ * from the vector
  */
-void vector_pop (vector V, int index) 
+void vector_remove (vector V, web_data w)
 {
-    assert (index >= 0);
-    assert (index < V->size);
-    
-    // Dumb way: shift every pointer after 'index' one spot back in the array
-    int i;
-    for (i = index + 1; i < V->size; i ++) {
-        V->arr[i - 1] = V->arr[i];
-    }
+    assert (V->size > 0);
+    vector_index_remove (V, w);
     V->size = V->size - 1;
+    // drop the cache's reference; readers still streaming it keep it alive
+    web_data_release (w);
 }
 
 /*
- * vector_find_LRU - Returns index of least recently used element 
- * in the vector
+ * vector_push_back - add w to the vector
  */
-int vector_find_LRU (vector V) 
+void vector_push_back (vector V, web_data w)
 {
-    assert (V->size > 0);
-    // Index of the least recently used element
-    int best_index = 0;
-    // Iterate over the vector
-    int i;
-    for (i = 1; i < V->size; i ++) {
-        if (V->arr[i]->acc_time < V->arr[best_index]->acc_time) {
-            best_index = i;
-        }
-    }
-    return best_index;
+    V->size = V->size + 1;
+    vector_index_add (V, w);
 }
 
 /*
- * vector_evict_LRU - Evicts the least recently used element in the vector
- * Returns size of data removed
+ * vector_entries - put the vector's entries, in no particular order,
+ * into out, which has room for V->size of them. Returns how many.
  */
-int vector_evict_LRU (vector V) 
+int vector_entries (vector V, web_data *out)
 {
-    assert (V->size > 0);
-    // Get the index
-    int index = vector_find_LRU (V);
-    // size of data removed
-    int size = V->arr[index]->data_size;
-    // free the data stored in the cache
-    web_data_free(V->arr[index]);
-    // pop from the list of pointers
-    vector_pop (V, index);  
-    return size;
+    int i, n = 0;
+
+    for (i = 0; i < V->indexCap; i++) {
+        web_data w = V->index[i].w;
+        if (w != NULL && w != TOMBSTONE)
+            out[n++] = w;
+    }
+    return n;
 }
 
 /*
- * vector_push_back - push a pointer of type w into the vector
+ * vector_index_add - add w to the index, growing it (or clearing out
+ * tombstones) to keep it at most 3/4 full
  */
-void vector_push_back (vector V, web_data w)
+static void vector_index_add (vector V, web_data w)
 {
-    // If vector is filled to capacity, increase the capacity
-    if (V->size == V->capacity)
-        vector_resize (V);
+    if ((V->indexUsed + 1) * 4 > V->indexCap * 3) {
+        int cap = VECTOR_INDEX_MIN;
+        while (cap < V->size * 2)
+            cap *= 2;
+        vector_index_rebuild (V, cap);
+    }
 
-    // Insert into the vector
-    V->arr[V->size] = w;
-    V->size = V->size + 1;
+    int mask = V->indexCap - 1;
+    int i = w->hash & mask;
+
+    while (V->index[i].w != NULL && V->index[i].w != TOMBSTONE)
+        i = (i + 1) & mask;
+
+    if (V->index[i].w == NULL)
+        V->indexUsed++;
+    V->index[i].hash = w->hash;
+    V->index[i].w = w;
 }
 
 /*
- * vector_resize - double the capacity of the vector
+ * vector_index_remove - replace w's slot with a tombstone
  */
-void vector_resize (vector V) {
-    V->capacity = V->capacity * 2;
-    
-    // create new array
-    web_data* new_arr = calloc(V->capacity, sizeof(web_data));
-    // copy elements over
+static void vector_index_remove (vector V, web_data w)
+{
+    int mask = V->indexCap - 1;
     int i;
-    for (i = 0; i < V->size; i ++) {
-        new_arr[i] = V->arr[i];
+
+    for (i = w->hash & mask; V->index[i].w != NULL; i = (i + 1) & mask) {
+        if (V->index[i].w == w) {
+            V->index[i].w = TOMBSTONE;
+            return;
+        }
     }
+}
+
+/*
+ * vector_index_rebuild - replace the index with an empty one of cap
+ * slots and add every entry of the old one back
+ */
+static void vector_index_rebuild (vector V, int cap)
+{
+    struct vector_slot *old = V->index;
+    int oldCap = V->indexCap;
+    int i;
 
-    // free old array
-    free (V->arr);
+    V->index = calloc(cap, sizeof(struct vector_slot));
+    V->indexCap = cap;
+    V->indexUsed = 0;
 
-    // point array to the new array
-    V->arr = new_arr;
+    for (i = 0; i < oldCap; i++) {
+        web_data w = old[i].w;
+        if (w != NULL && w != TOMBSTONE)
+            vector_index_add (V, w);
+    }
+    free (old);
 }
@@ -5,19 +5,32 @@
 #include <assert.h>
 #include "web_data.h"
 
+/* A slot of the hash index. The hash is kept next to the pointer so a
+   probe only follows pointers whose hash already matches. */
+struct vector_slot
+{
+    uint64_t hash;
+    web_data w;     // NULL if the slot was never used
+};
+
 struct vector_header 
 {
     int size;
-    int capacity;
-    web_data* arr; // array of webdata
+
+    // Open-addressing (linear probing) index over the entries, by key hash
+    struct vector_slot *index;
+    int indexCap;   // a power of two
+    int indexUsed;  // slots holding an entry or a tombstone
 };
 typedef struct vector_header *vector;
 
 vector vector_new ();
 void vector_free (vector V);
 
-web_data vector_get (vector V, char *website, char *file, int port);
+web_data vector_get (vector V, uint64_t hash, char *website, char *file,
+    int port);
 void vector_push_back (vector V, web_data w);
-int vector_evict_LRU (vector V);
+void vector_remove (vector V, web_data w);
+int vector_entries (vector V, web_data *out);
 
 #endif
@@ -1,30 +1,201 @@
 #include "web_data.h"
+#include "slab.h"
+#include "lz.h"
+
+/*
+ * web_data_alloc - an entry for website, file, port with room for
+ * capacity bytes of data but none yet. The header, the key strings and
+ * the data share one block; fill w->data, set w->data_size and give
+ * back the unused room with web_data_trim.
+ */
+web_data web_data_alloc (char *website, char *file, int port, int capacity)
+{
+    web_data w = malloc(web_data_block_size (website, file, capacity));
+
+    if (w == NULL)
+        return NULL;
+
+    return web_data_init (w, website, file, port);
+}
+
+/*
+ * web_data_block_size - bytes of the block an entry for website, file
+ * with room for capacity bytes of data takes up
+ */
+int web_data_block_size (char *website, char *file, int capacity)
+{
+    return sizeof(struct web_data_hdr) + strlen (website) + 1
+        + strlen (file) + 1 + capacity;
+}
+
+/*
+ * web_data_init - lay an empty entry for website, file, port out in
+ * block, which has web_data_block_size bytes for the data it will hold
+ */
+web_data web_data_init (void *block, char *website, char *file, int port)
+{
+    int siteLen = strlen (website) + 1;
+    int fileLen = strlen (file) + 1;
+    web_data w = block;
+
+    w->website = (char *)(w + 1);
+    w->file = w->website + siteLen;
+    w->data = w->file + fileLen;
+    memcpy (w->website, website, siteLen);
+    memcpy (w->file, file, fileLen);
+    w->port = port;
+    w->data_size = 0;
+    w->plain_size = 0;
+    w->head_size = 0;
+    w->stored = 0;
+    w->hash = web_data_hash (website, file, port);
+    w->refs = 1;
+    w->prev = w->next = NULL;
+    w->acc_time = 0;
+    w->queue = w->freq = w->pos = 0;
+    w->priority = 0;
+    w->slabs = NULL;
+    w->slabPrev = w->slabNext = NULL;
+    w->slabLinked = 0;
+    w->used = 0;
+    w->uses = w->mapped = 0;
+
+    return w;
+}
 
 web_data web_data_new (char *website, char *file, int port, 
     char *data, int dataSize) 
 {
-    web_data w = malloc(sizeof(struct web_data_hdr));
-	  w->website = malloc(strlen(website)+1);
-	  w->file = malloc(strlen(file)+1);
-	  w->data = malloc(dataSize);
-	  
-    strcpy (w->website, website);
-	  strcpy (w->file, file);
+    web_data w = web_data_alloc (website, file, port, dataSize);
+
     memcpy (w->data, data, dataSize);
-	  w->port = port;
-	  w->data_size = dataSize;
-    web_data_update_acc_time (w);
-    
+    w->data_size = dataSize;
     return w;
 }
 
+/*
+ * web_data_trim - shrink w's block to its data_size bytes of data.
+ * Returns the entry, which may have moved. Only for entries no one else
+ * holds yet.
+ */
+web_data web_data_trim (web_data w)
+{
+    int fileOff = w->file - (char *)w;
+    int dataOff = w->data - (char *)w;
+    web_data t = realloc(w, web_data_size (w));
+
+    // If it can't be shrunk, w is still whole
+    if (t == NULL)
+        return w;
+
+    t->website = (char *)(t + 1);
+    t->file = (char *)t + fileOff;
+    t->data = (char *)t + dataOff;
+    return t;
+}
+
+/*
+ * web_data_place - a copy of w, which no one else holds yet, in chunk.
+ * Its slabs field is left for the caller to set.
+ */
+web_data web_data_place (web_data w, void *chunk)
+{
+    web_data t = chunk;
+
+    memcpy (t, w, web_data_size (w));
+    t->website = (char *)t + (w->website - (char *)w);
+    t->file = (char *)t + (w->file - (char *)w);
+    t->data = (char *)t + (w->data - (char *)w);
+    return t;
+}
+
+/*
+ * web_data_compress - w with its data compressed, if that saves at least
+ * an eighth of it. Then w, which no one else may hold yet, is released
+ * for a new entry, untrimmed; otherwise w itself is returned.
+ */
+web_data web_data_compress (web_data w)
+{
+    web_data t = web_data_alloc (w->website, w->file, w->port,
+        lz_bound (w->data_size));
+
+    if (t == NULL)
+        return w;
+
+    t->data_size = lz_compress (w->data, w->data_size, t->data,
+        lz_bound (w->data_size));
+
+    if (t->data_size < 0 || t->data_size > w->data_size / 8 * 7)
+    {
+        free (t);
+        return w;
+    }
+
+    t->plain_size = w->data_size;
+    t->head_size = w->head_size;
+    t->stored = w->stored;
+    web_data_release (w);
+    return t;
+}
+
+/*
+ * web_data_plain_size - bytes of w's data once decompressed
+ */
+int web_data_plain_size (web_data w)
+{
+    return w->plain_size ? w->plain_size : w->data_size;
+}
+
+/*
+ * web_data_unpack - decompress w's data into buf, which holds
+ * web_data_plain_size bytes. Returns that size, or -1 if the data is
+ * corrupt.
+ */
+int web_data_unpack (web_data w, char *buf)
+{
+    if (w->plain_size == 0)
+    {
+        memcpy (buf, w->data, w->data_size);
+        return w->data_size;
+    }
+
+    int n = lz_decompress (w->data, w->data_size, buf, w->plain_size);
+
+    return n == w->plain_size ? n : -1;
+}
+
+/*
+ * web_data_size - bytes w takes up: header, key and data
+ */
+int web_data_size (web_data w)
+{
+    return (int)(w->data + w->data_size - (char *)w);
+}
+
 // Free the pointer of type web_data
 void web_data_free (web_data w) 
 {
-    free (w->website);
-    free (w->file);
-    free (w->data);
-    free (w);
+    if (w->slabs)
+        slabs_free (w->slabs, w);
+    else if (!w->mapped)
+        free (w);
+}
+
+/*
+ * web_data_retain - pin w so that it outlives its eviction from the cache
+ */
+void web_data_retain (web_data w)
+{
+    __atomic_add_fetch (&w->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * web_data_release - drop a reference to w, freeing it after the last
+ */
+void web_data_release (web_data w)
+{
+    if (__atomic_sub_fetch (&w->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        web_data_free (w);
 }
 
 int web_data_equals (web_data w, char *website, char *file, int port) 
@@ -36,9 +207,34 @@ int web_data_equals (web_data w, char *website, char *file, int port)
 		  &&	w->port == port);
 }
 
-void web_data_update_acc_time (web_data w) 
+/*
+ * web_data_hash - 64-bit FNV-1a hash of a cache key
+ */
+uint64_t web_data_hash (char *website, char *file, int port)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    // The terminating '\0's keep "ab" + "c" apart from "a" + "bc"
+    do
+        h = (h ^ (unsigned char)*website) * 1099511628211ULL;
+    while (*website++);
+    do
+        h = (h ^ (unsigned char)*file) * 1099511628211ULL;
+    while (*file++);
+
+    for (i = 0; i < 4; i++, port >>= 8)
+        h = (h ^ (port & 0xff)) * 1099511628211ULL;
+
+    return h;
+}
+
+/*
+ * web_data_update_acc_time - record that w was used at logical time tick.
+ * Ticks come from the LRU policy, which orders its entries by them;
+ * clock() was CPU time and often did not move between two accesses.
+ */
+void web_data_update_acc_time (web_data w, unsigned long tick)
 {
-    // clock is thread safe according to
-    // http://www.keil.com/support/man/docs/armlibref/armlibref_Chdiedfe.htm
-    w->acc_time = clock ();
+    w->acc_time = tick;
 }
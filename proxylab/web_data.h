@@ -2,26 +2,65 @@
 #define WEB_DATA_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <time.h>
 #include "web_data.h"
 
+struct slabs_header;
+
+/* A cached object. The header is followed in the same block by the
+   website and file strings and then the data, which these point into. */
 struct web_data_hdr
 {
+	uint64_t hash;  // web_data_hash of the key, checked before the strings
 	char *website;
 	char *file;
 	int port;
 	char *data;
 	int data_size;
-	clock_t acc_time;
+	int plain_size; // data's size before compression, 0 if stored as is
+	int head_size;  // of that, the response head's, 0 if it has none
+	long stored;    // time() when it was cached
+	int refs;       // the cache's reference plus one per reader
+
+	// Bookkeeping of the eviction policy of the shard holding it
+	struct web_data_hdr *prev, *next;  // the policy queue it is on
+	unsigned long acc_time;  // the policy's tick when last used
+	int queue;      // which of the policy's queues that is
+	int freq;       // uses the policy has counted
+	double priority;  // GDSF: its H value
+	int pos;        // GDSF: its place in the heap
+
+	// Set when it lives in a slab chunk rather than on the heap
+	struct slabs_header *slabs;
+	struct web_data_hdr *slabPrev, *slabNext;  // its class's LRU
+	unsigned long slabTick;  // when it was put at the head of that
+	long slabBumped;         // ... in seconds
+	int slabLinked;          // on that LRU, i.e. still cached
+
+	// Kept by the cache itself, whatever the policy, for snapshots
+	unsigned long used;  // its shard's tick when last inserted or hit
+	int uses;            // hits since it was cached
+	int mapped;          // lives in a loaded snapshot, freed with it
 };
 typedef struct web_data_hdr *web_data;
 
+web_data web_data_alloc (char *website, char *file, int port, int capacity);
+int web_data_block_size (char *website, char *file, int capacity);
+web_data web_data_init (void *block, char *website, char *file, int port);
 web_data web_data_new (char *website, char *file, int port, 
     char *data, int dataSize);
+web_data web_data_trim (web_data w);
+web_data web_data_place (web_data w, void *chunk);
+web_data web_data_compress (web_data w);
+int web_data_plain_size (web_data w);
+int web_data_unpack (web_data w, char *buf);
 void web_data_free (web_data w);
+void web_data_retain (web_data w);
+void web_data_release (web_data w);
 int web_data_equals (web_data w, char *website, char *file, int port);
+uint64_t web_data_hash (char *website, char *file, int port);
 int web_data_size (web_data w);
-void web_data_update_acc_time (web_data w);
+void web_data_update_acc_time (web_data w, unsigned long tick);
 
 #endif